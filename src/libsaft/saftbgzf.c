@@ -0,0 +1,322 @@
+/* saftbgzf.c
+ * Copyright (C) 2008  Sylvain FORET
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *                                                                       
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *                                                                       
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * A block is a gzip member whose extra field holds a `BC' subfield giving
+ * the size of the block, and whose trailer gives the size of its
+ * decompressed data. The blocks of a batch are hence located without being
+ * decompressed, and each one is inflated straight to its place in the output.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "safterror.h"
+#include "saftbgzf.h"
+#include "saftpool.h"
+
+#define BGZF_HEADER_SIZE       18
+#define BGZF_TRAILER_SIZE       8
+#define BGZF_MAX_BLOCK_SIZE    (1 << 16)
+/* Number of blocks decompressed at once, per thread */
+#define BGZF_BLOCKS_PER_THREAD 16
+
+#define BGZF_UINT16(p)         ((uint16_t)(p)[0] | ((uint16_t)(p)[1] << 8))
+#define BGZF_UINT32(p)         ((uint32_t)(p)[0]         | ((uint32_t)(p)[1] << 8) | \
+                                ((uint32_t)(p)[2] << 16) | ((uint32_t)(p)[3] << 24))
+
+
+typedef struct _SaftBgzfBlock SaftBgzfBlock;
+
+struct _SaftBgzfBlock
+{
+  const unsigned char *data;
+  size_t               size;
+  size_t               offset;
+  uint32_t             out_size;
+  uint32_t             crc;
+  int                  error;
+};
+
+struct _SaftBgzf
+{
+  SaftPool        *pool;
+  z_stream        *streams;
+  int              fd;
+
+  /* Compressed bytes [in_start, in_end) not yet decompressed */
+  unsigned char   *in;
+  size_t           in_alloc;
+  size_t           in_start;
+  size_t           in_end;
+  int              in_eof;
+
+  SaftBgzfBlock   *blocks;
+  size_t           max_blocks;
+
+  /* Decompressed bytes [out_start, out_end) not yet read */
+  unsigned char   *out;
+  size_t           out_alloc;
+  size_t           out_start;
+  size_t           out_end;
+
+  unsigned int     n_threads;
+  int              error;
+};
+
+
+static size_t saft_bgzf_block_size   (const unsigned char *header,
+                                      size_t               size);
+
+static int    saft_bgzf_fill         (SaftBgzf            *bgzf);
+
+static void   saft_bgzf_inflate_func (size_t               task,
+                                      unsigned int         thread,
+                                      void                *data);
+
+
+int
+saft_bgzf_check (int fd)
+{
+  unsigned char header[BGZF_HEADER_SIZE];
+
+  if (pread (fd, header, BGZF_HEADER_SIZE, 0) != BGZF_HEADER_SIZE)
+    return 0;
+
+  return saft_bgzf_block_size (header, BGZF_HEADER_SIZE) > 0;
+}
+
+SaftBgzf*
+saft_bgzf_new (int           fd,
+               unsigned int  n_threads)
+{
+  SaftBgzf     *bgzf;
+  unsigned int  i;
+
+  if (n_threads < 1)
+    n_threads = 1;
+
+  bgzf             = malloc (sizeof (*bgzf));
+  bgzf->pool       = n_threads > 1 ? saft_pool_new (n_threads) : NULL;
+  bgzf->streams    = calloc (n_threads, sizeof (*bgzf->streams));
+  bgzf->fd         = fd;
+  bgzf->n_threads  = n_threads;
+  bgzf->error      = 0;
+
+  bgzf->max_blocks = BGZF_BLOCKS_PER_THREAD * n_threads;
+  bgzf->blocks     = malloc (bgzf->max_blocks * sizeof (*bgzf->blocks));
+  bgzf->in_alloc   = bgzf->max_blocks * BGZF_MAX_BLOCK_SIZE;
+  bgzf->in         = malloc (bgzf->in_alloc);
+  bgzf->in_start   = 0;
+  bgzf->in_end     = 0;
+  bgzf->in_eof     = 0;
+  bgzf->out_alloc  = bgzf->max_blocks * BGZF_MAX_BLOCK_SIZE;
+  bgzf->out        = malloc (bgzf->out_alloc);
+  bgzf->out_start  = 0;
+  bgzf->out_end    = 0;
+
+  for (i = 0; i < n_threads; i++)
+    if (inflateInit2 (bgzf->streams + i, -MAX_WBITS) != Z_OK)
+      bgzf->error = 1;
+
+  return bgzf;
+}
+
+void
+saft_bgzf_free (SaftBgzf *bgzf)
+{
+  unsigned int i;
+
+  if (!bgzf)
+    return;
+
+  for (i = 0; i < bgzf->n_threads; i++)
+    inflateEnd (bgzf->streams + i);
+  if (bgzf->pool)
+    saft_pool_free (bgzf->pool);
+  free (bgzf->streams);
+  free (bgzf->blocks);
+  free (bgzf->in);
+  free (bgzf->out);
+  free (bgzf);
+}
+
+ssize_t
+saft_bgzf_read (SaftBgzf *bgzf,
+                char     *buffer,
+                size_t    size)
+{
+  while (bgzf->out_start == bgzf->out_end)
+    {
+      int status = saft_bgzf_fill (bgzf);
+
+      if (status <= 0)
+        return status;
+    }
+
+  if (size > bgzf->out_end - bgzf->out_start)
+    size = bgzf->out_end - bgzf->out_start;
+  memcpy (buffer, bgzf->out + bgzf->out_start, size);
+  bgzf->out_start += size;
+
+  return size;
+}
+
+/* Returns the size of the block starting with header, or 0 if it is not a
+ * BGZF block */
+static size_t
+saft_bgzf_block_size (const unsigned char *header,
+                      size_t               size)
+{
+  size_t xlen;
+  size_t i;
+
+  /* Magic number, deflate method and extra field flag */
+  if (size < BGZF_HEADER_SIZE ||
+      header[0] != 0x1f || header[1] != 0x8b || header[2] != 8 || !(header[3] & 4))
+    return 0;
+
+  xlen = BGZF_UINT16 (header + 10);
+  for (i = 12; i + 4 <= 12 + xlen && i + 6 <= size; i += 4 + BGZF_UINT16 (header + i + 2))
+    if (header[i] == 'B' && header[i + 1] == 'C' && BGZF_UINT16 (header + i + 2) == 2)
+      return BGZF_UINT16 (header + i + 4) + 1;
+
+  return 0;
+}
+
+/* Decompresses the next batch of blocks, and returns 1 on success, 0 at the
+ * end of the file and -1 on errors */
+static int
+saft_bgzf_fill (SaftBgzf *bgzf)
+{
+  size_t n_blocks = 0;
+  size_t out_size = 0;
+  size_t i;
+
+  if (bgzf->error)
+    return -1;
+
+  /* Keeps the undecompressed bytes and refills the input buffer */
+  memmove (bgzf->in, bgzf->in + bgzf->in_start, bgzf->in_end - bgzf->in_start);
+  bgzf->in_end  -= bgzf->in_start;
+  bgzf->in_start = 0;
+  while (!bgzf->in_eof && bgzf->in_end < bgzf->in_alloc)
+    {
+      ssize_t status = read (bgzf->fd, bgzf->in + bgzf->in_end, bgzf->in_alloc - bgzf->in_end);
+
+      if (status < 0)
+        {
+          bgzf->error = 1;
+          return -1;
+        }
+      if (status == 0)
+        bgzf->in_eof = 1;
+      bgzf->in_end += status;
+    }
+
+  while (n_blocks < bgzf->max_blocks && bgzf->in_start < bgzf->in_end)
+    {
+      const unsigned char *header = bgzf->in + bgzf->in_start;
+      const size_t         left   = bgzf->in_end - bgzf->in_start;
+      SaftBgzfBlock       *block  = bgzf->blocks + n_blocks;
+      size_t               size;
+
+      size = saft_bgzf_block_size (header, left);
+      if (size == 0 || size < BGZF_HEADER_SIZE + BGZF_TRAILER_SIZE)
+        {
+          if (left >= BGZF_HEADER_SIZE)
+            saft_error ("Malformed BGZF block");
+          else
+            saft_error ("Truncated BGZF file");
+          bgzf->error = 1;
+          return -1;
+        }
+      if (size > left)
+        {
+          if (bgzf->in_eof)
+            {
+              saft_error ("Truncated BGZF file");
+              bgzf->error = 1;
+              return -1;
+            }
+          break;
+        }
+
+      block->data     = header + 12 + BGZF_UINT16 (header + 10);
+      block->size     = header + size - BGZF_TRAILER_SIZE - block->data;
+      block->crc      = BGZF_UINT32 (header + size - 8);
+      block->out_size = BGZF_UINT32 (header + size - 4);
+      block->offset   = out_size;
+      block->error    = 0;
+      if (block->out_size > BGZF_MAX_BLOCK_SIZE)
+        {
+          saft_error ("Malformed BGZF block");
+          bgzf->error = 1;
+          return -1;
+        }
+      out_size       += block->out_size;
+      bgzf->in_start += size;
+      n_blocks++;
+    }
+  if (n_blocks == 0)
+    return 0;
+
+  if (bgzf->pool)
+    saft_pool_run (bgzf->pool, n_blocks, saft_bgzf_inflate_func, bgzf);
+  else
+    for (i = 0; i < n_blocks; i++)
+      saft_bgzf_inflate_func (i, 0, bgzf);
+
+  for (i = 0; i < n_blocks; i++)
+    if (bgzf->blocks[i].error)
+      {
+        saft_error ("Corrupted BGZF block");
+        bgzf->error = 1;
+        return -1;
+      }
+  bgzf->out_start = 0;
+  bgzf->out_end   = out_size;
+
+  return 1;
+}
+
+static void
+saft_bgzf_inflate_func (size_t        task,
+                        unsigned int  thread,
+                        void         *data)
+{
+  SaftBgzf      *bgzf   = data;
+  SaftBgzfBlock *block  = bgzf->blocks + task;
+  z_stream      *stream = bgzf->streams + thread;
+  unsigned char *out    = bgzf->out + block->offset;
+
+  inflateReset (stream);
+  stream->next_in   = (unsigned char*)block->data;
+  stream->avail_in  = block->size;
+  stream->next_out  = out;
+  stream->avail_out = block->out_size;
+  if (inflate (stream, Z_FINISH) != Z_STREAM_END ||
+      stream->total_out != block->out_size ||
+      crc32 (crc32 (0, NULL, 0), out, block->out_size) != block->crc)
+    block->error = 1;
+}
+
+/* vim:ft=c:expandtab:sw=4:ts=4:sts=4:cinoptions={.5s^-2n-2(0:
+ */
@@ -0,0 +1,58 @@
+/* saftbgzf.h
+ * Copyright (C) 2008  Sylvain FORET
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *                                                                       
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *                                                                       
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Reading of BGZF files, the blocked gzip files of samtools, whose blocks of
+ * at most 64KB can be decompressed independently. Batches of blocks are
+ * decompressed by the threads of a pool.
+ */
+
+#ifndef __SAFT_BGZF_H__
+#define __SAFT_BGZF_H__
+
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+typedef struct _SaftBgzf SaftBgzf;
+
+/* Returns non zero if the file starts with a BGZF block. Does not move the
+ * offset of the file */
+int       saft_bgzf_check (int           fd);
+
+SaftBgzf* saft_bgzf_new   (int           fd,
+                           unsigned int  n_threads);
+
+void      saft_bgzf_free  (SaftBgzf     *bgzf);
+
+/* As read(): returns the number of decompressed bytes written to buffer, 0
+ * at the end of the file and -1 on errors */
+ssize_t   saft_bgzf_read  (SaftBgzf     *bgzf,
+                           char         *buffer,
+                           size_t        size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __SAFT_BGZF_H__ */
+
+/* vim:ft=c:expandtab:sw=4:ts=4:sts=4:cinoptions={.5s^-2n-2(0:
+ */
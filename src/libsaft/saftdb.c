@@ -0,0 +1,861 @@
+/* saftdb.c
+ * Copyright (C) 2008  Sylvain FORET
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *                                                                       
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *                                                                       
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ *
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "saftdb.h"
+#include "safterror.h"
+
+#define RECORDS_CHUNK  256
+#define NAMES_CHUNK    (1 << 16)
+#define DELETED_CHUNK  256
+
+
+typedef struct _SaftDBDeleted SaftDBDeleted;
+
+struct _SaftDBDeleted
+{
+  char     *name;
+  /* The sequences of that name are deleted from the first segments */
+  uint64_t  segments;
+};
+
+struct _SaftDBWriter
+{
+  char         *filename;
+  char         *tmp_filename;
+  FILE         *stream;
+  SaftDBHeader  header;
+  SaftDBRecord *records;
+  uint64_t     *compositions;
+  char         *names;
+  size_t        records_alloc;
+  size_t        names_alloc;
+  /* Where the next counts are written */
+  uint64_t      offset;
+  int           failed;
+};
+
+static int            saft_db_segment_map    (SaftDBSegment   *segment,
+                                              const char      *filename);
+
+static void           saft_db_segment_unmap  (SaftDBSegment   *segment);
+
+static int            saft_db_segment_check  (SaftDBSegment   *segment,
+                                              const char      *filename);
+
+static int            saft_db_same_layout    (const SaftDBHeader *header1,
+                                              const SaftDBHeader *header2);
+
+static char*          saft_db_segment_path   (const char      *filename,
+                                              uint64_t         segment);
+
+static char*          saft_db_deleted_path   (const char      *filename);
+
+static SaftDBDeleted* saft_db_read_deleted   (SaftDB          *db,
+                                              size_t          *n_deleted);
+
+static void           saft_db_free_deleted   (SaftDBDeleted   *deleted,
+                                              size_t           n_deleted);
+
+static int            saft_db_deleted_cmp    (const void      *a,
+                                              const void      *b);
+
+static void           saft_db_remove_stale   (const char      *filename);
+
+static uint64_t       saft_db_new_stamp      (void);
+
+static void           saft_db_writer_pad     (SaftDBWriter    *writer);
+
+static void           saft_db_writer_write   (SaftDBWriter    *writer,
+                                              const void      *data,
+                                              size_t           size);
+
+static void           saft_db_writer_free    (SaftDBWriter    *writer);
+
+
+/* Only regular files are looked at, reading from a pipe would lose what was
+ * read */
+int
+saft_db_is_db (const char *filename)
+{
+  char        magic[sizeof (((SaftDBHeader*)NULL)->magic)];
+  struct stat st;
+  int         in;
+  int         ret;
+
+  if (stat (filename, &st) == -1 || !S_ISREG (st.st_mode) ||
+      (in = open (filename, O_RDONLY)) == -1)
+    return 0;
+  ret = read (in, magic, sizeof (magic)) == sizeof (magic) &&
+        !memcmp (magic, SAFT_DB_MAGIC, sizeof (magic));
+  close (in);
+
+  return ret;
+}
+
+SaftDB*
+saft_db_open (const char *filename)
+{
+  SaftDB        *db;
+  SaftDBSegment  segment;
+  SaftDBDeleted *deleted;
+  size_t         n_deleted;
+  size_t         n_records;
+  size_t         i;
+  size_t         j;
+
+  if (saft_db_segment_map (&segment, filename))
+    return NULL;
+  if (segment.header->segment != 0)
+    {
+      saft_error ("`%s' is a segment of a saft database", filename);
+      saft_db_segment_unmap (&segment);
+      return NULL;
+    }
+
+  db              = calloc (1, sizeof (*db));
+  db->filename    = strdup (filename);
+  db->segments    = malloc (sizeof (*db->segments));
+  db->segments[0] = segment;
+  db->n_segments  = 1;
+  db->header      = segment.header;
+  n_records       = segment.header->n_sequences;
+  while (1)
+    {
+      char        *path = saft_db_segment_path (filename, db->n_segments);
+      struct stat  st;
+
+      if (stat (path, &st) == -1)
+        {
+          free (path);
+          break;
+        }
+      if (saft_db_segment_map (&segment, path))
+        {
+          free (path);
+          saft_db_close (db);
+          return NULL;
+        }
+      /* Left by a previous database of that name */
+      if (segment.header->stamp != db->header->stamp ||
+          segment.header->segment != db->n_segments)
+        {
+          saft_db_segment_unmap (&segment);
+          free (path);
+          break;
+        }
+      if (!saft_db_same_layout (segment.header, db->header))
+        {
+          saft_error ("`%s' does not hold the same words as `%s'", path, filename);
+          saft_db_segment_unmap (&segment);
+          free (path);
+          saft_db_close (db);
+          return NULL;
+        }
+      free (path);
+      db->segments                   = realloc (db->segments,
+                                                (db->n_segments + 1) * sizeof (*db->segments));
+      db->segments[db->n_segments++] = segment;
+      n_records                     += segment.header->n_sequences;
+    }
+
+  deleted       = saft_db_read_deleted (db, &n_deleted);
+  db->sequences = malloc (n_records * sizeof (*db->sequences));
+  for (i = 0; i < db->n_segments; i++)
+    {
+      const SaftDBSegment *seg = db->segments + i;
+
+      for (j = 0; j < seg->header->n_sequences; j++)
+        {
+          SaftDBSequence *sequence = db->sequences + db->n_sequences;
+          SaftDBDeleted   key;
+          SaftDBDeleted  *found;
+          unsigned int    k;
+
+          key.name = (char*)seg->names + seg->records[j].name_offset;
+          found    = n_deleted ? bsearch (&key, deleted, n_deleted, sizeof (*deleted),
+                                          saft_db_deleted_cmp) : NULL;
+          if (found && i < found->segments)
+            continue;
+
+          sequence->record      = seg->records + j;
+          sequence->name        = key.name;
+          sequence->counts      = seg->map + seg->records[j].counts_offset;
+          sequence->composition = seg->compositions + j * seg->header->alphabet_size;
+          db->length           += sequence->record->length;
+          for (k = 0; k < seg->header->alphabet_size; k++)
+            db->composition[k] += sequence->composition[k];
+          db->n_sequences++;
+        }
+    }
+  saft_db_free_deleted (deleted, n_deleted);
+
+  return db;
+}
+
+void
+saft_db_close (SaftDB *db)
+{
+  if (db)
+    {
+      size_t i;
+
+      for (i = 0; i < db->n_segments; i++)
+        saft_db_segment_unmap (db->segments + i);
+      if (db->segments)
+        free (db->segments);
+      if (db->sequences)
+        free (db->sequences);
+      if (db->filename)
+        free (db->filename);
+      free (db);
+    }
+}
+
+const void*
+saft_db_counts (SaftDB *db,
+                size_t  rank)
+{
+  return db->sequences[rank].counts;
+}
+
+const char*
+saft_db_name (SaftDB *db,
+              size_t  rank)
+{
+  return db->sequences[rank].name;
+}
+
+void
+saft_db_split (SaftDB       *db,
+               unsigned int  part,
+               unsigned int  n_parts,
+               size_t       *first,
+               size_t       *last)
+{
+  const size_t n_sequences = db->n_sequences;
+  size_t      *bounds[2]   = {first, last};
+  unsigned int j;
+
+  for (j = 0; j < 2; j++)
+    {
+      const unsigned int p       = part + j;
+      uint64_t           letters = 0;
+      double             target;
+      size_t             i;
+
+      if (p == 0)
+        i = 0;
+      else if (p >= n_parts)
+        i = n_sequences;
+      else if (db->length == 0)
+        i = n_sequences * p / n_parts;
+      else
+        {
+          target = (double)db->length * p / n_parts;
+          for (i = 0; i < n_sequences; i++)
+            {
+              const uint64_t length = db->sequences[i].record->length;
+
+              if (letters + length / 2.0 >= target)
+                break;
+              letters += length;
+            }
+        }
+      *bounds[j] = i;
+    }
+}
+
+/* The list is written again with the new names, so that the searches reading
+ * it meanwhile see either list */
+int
+saft_db_delete (const char  *filename,
+                char       **names,
+                size_t       n_names)
+{
+  SaftDB        *db;
+  SaftDBDeleted *deleted;
+  FILE          *stream;
+  char          *path;
+  char          *tmp_path;
+  size_t         n_deleted;
+  size_t         i;
+  int            ret = 0;
+
+  if (!(db = saft_db_open (filename)))
+    return 1;
+
+  path     = saft_db_deleted_path (filename);
+  tmp_path = malloc (strlen (path) + sizeof (".tmp"));
+  sprintf (tmp_path, "%s.tmp", path);
+  if (!(stream = fopen (tmp_path, "w")))
+    {
+      saft_error ("Couldn't open `%s'", tmp_path);
+      free (tmp_path);
+      free (path);
+      saft_db_close (db);
+      return 1;
+    }
+
+  deleted = saft_db_read_deleted (db, &n_deleted);
+  fprintf (stream, "%" PRIu64 "\n", db->header->stamp);
+  for (i = 0; i < n_deleted; i++)
+    fprintf (stream, "%" PRIu64 "\t%s\n", deleted[i].segments, deleted[i].name);
+  for (i = 0; i < n_names; i++)
+    fprintf (stream, "%" PRIu64 "\t%s\n", (uint64_t)db->n_segments, names[i]);
+  saft_db_free_deleted (deleted, n_deleted);
+
+  if (ferror (stream) | fclose (stream))
+    {
+      saft_error ("An IO error occured while writing `%s'", tmp_path);
+      unlink (tmp_path);
+      ret = 1;
+    }
+  else if (rename (tmp_path, path) == -1)
+    {
+      saft_error ("Couldn't rename `%s' to `%s'", tmp_path, path);
+      unlink (tmp_path);
+      ret = 1;
+    }
+
+  free (tmp_path);
+  free (path);
+  saft_db_close (db);
+
+  return ret;
+}
+
+int
+saft_db_compact (const char *filename)
+{
+  SaftDB       *db;
+  SaftDBWriter *writer;
+  size_t        i;
+
+  if (!(db = saft_db_open (filename)))
+    return 1;
+  writer = saft_db_writer_new (filename,
+                               db->header->alphabet,
+                               db->header->alphabet_size,
+                               db->header->word_size,
+                               db->header->counts_type,
+                               db->header->count_size,
+                               0);
+  if (!writer)
+    {
+      saft_db_close (db);
+      return 1;
+    }
+  for (i = 0; i < db->n_sequences; i++)
+    {
+      SaftDBRecord record = *db->sequences[i].record;
+
+      saft_db_writer_add (writer,
+                          &record,
+                          db->sequences[i].name,
+                          db->sequences[i].counts,
+                          db->sequences[i].composition);
+    }
+  saft_db_close (db);
+
+  return saft_db_writer_close (writer);
+}
+
+static int
+saft_db_segment_map (SaftDBSegment *segment,
+                     const char    *filename)
+{
+  struct stat  st;
+  void        *map;
+  int          in;
+
+  if ((in = open (filename, O_RDONLY)) == -1)
+    {
+      saft_error ("Couldn't open `%s'", filename);
+      return 1;
+    }
+  if (fstat (in, &st) == -1 || !S_ISREG (st.st_mode) ||
+      (size_t)st.st_size < sizeof (SaftDBHeader))
+    {
+      saft_error ("`%s' is not a saft database", filename);
+      close (in);
+      return 1;
+    }
+  /* Shared, so that the pages are shared by the processes mapping the
+   * database */
+  map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, in, 0);
+  close (in);
+  if (map == MAP_FAILED)
+    {
+      saft_error ("Couldn't map `%s'", filename);
+      return 1;
+    }
+
+  segment->map    = map;
+  segment->size   = st.st_size;
+  segment->header = map;
+  if (saft_db_segment_check (segment, filename))
+    {
+      saft_db_segment_unmap (segment);
+      return 1;
+    }
+  segment->records      = (const SaftDBRecord*)(segment->map + segment->header->records_offset);
+  segment->compositions = (const uint64_t*)(segment->map + segment->header->compositions_offset);
+  segment->names        = segment->map + segment->header->names_offset;
+
+  return 0;
+}
+
+static void
+saft_db_segment_unmap (SaftDBSegment *segment)
+{
+  if (segment->map)
+    munmap ((void*)segment->map, segment->size);
+  segment->map = NULL;
+}
+
+/* Only the header and the records are checked, not the counts */
+static int
+saft_db_segment_check (SaftDBSegment *segment,
+                       const char    *filename)
+{
+  const SaftDBHeader *header = segment->header;
+  const SaftDBRecord *records;
+  const size_t        size   = segment->size;
+  uint64_t            i;
+
+  if (memcmp (header->magic, SAFT_DB_MAGIC, sizeof (header->magic)))
+    {
+      saft_error ("`%s' is not a saft database", filename);
+      return 1;
+    }
+  if (header->version != SAFT_DB_VERSION)
+    {
+      saft_error ("`%s' is a saft database of version %u, this version of saft only reads version %u",
+                  filename, header->version, SAFT_DB_VERSION);
+      return 1;
+    }
+  if (header->byte_order != SAFT_DB_BYTE_ORDER)
+    {
+      saft_error ("`%s' was written on an architecture of another byte order", filename);
+      return 1;
+    }
+  if (header->file_size != size ||
+      header->count_size == 0 ||
+      header->alphabet_size > SAFT_DB_MAX_LETTERS ||
+      header->records_offset % sizeof (uint64_t) ||
+      header->records_offset > size ||
+      header->n_sequences > (size - header->records_offset) / sizeof (SaftDBRecord) ||
+      header->compositions_offset % sizeof (uint64_t) ||
+      header->compositions_offset > size ||
+      header->n_sequences * header->alphabet_size >
+        (size - header->compositions_offset) / sizeof (uint64_t) ||
+      header->names_offset > size ||
+      header->names_size > size - header->names_offset ||
+      (header->names_size > 0 && segment->map[header->names_offset + header->names_size - 1] != '\0'))
+    {
+      saft_error ("`%s' is truncated or corrupted", filename);
+      return 1;
+    }
+
+  records = (const SaftDBRecord*)(segment->map + header->records_offset);
+  for (i = 0; i < header->n_sequences; i++)
+    if (records[i].name_offset >= header->names_size ||
+        records[i].counts_offset % SAFT_DB_ALIGN ||
+        records[i].counts_offset > size ||
+        records[i].n_counts > (size - records[i].counts_offset) / header->count_size)
+      {
+        saft_error ("`%s' is truncated or corrupted", filename);
+        return 1;
+      }
+
+  return 0;
+}
+
+static int
+saft_db_same_layout (const SaftDBHeader *header1,
+                     const SaftDBHeader *header2)
+{
+  return (header1->word_size == header2->word_size &&
+          header1->counts_type == header2->counts_type &&
+          header1->count_size == header2->count_size &&
+          header1->alphabet_size == header2->alphabet_size &&
+          !strncmp (header1->alphabet, header2->alphabet, sizeof (header1->alphabet)));
+}
+
+static char*
+saft_db_segment_path (const char *filename,
+                      uint64_t    segment)
+{
+  char *path = malloc (strlen (filename) + 32);
+
+  sprintf (path, "%s.%" PRIu64, filename, segment);
+
+  return path;
+}
+
+static char*
+saft_db_deleted_path (const char *filename)
+{
+  char *path = malloc (strlen (filename) + sizeof (SAFT_DB_DELETED_SUFFIX));
+
+  sprintf (path, "%s" SAFT_DB_DELETED_SUFFIX, filename);
+
+  return path;
+}
+
+/* Returns the deleted names sorted, each with the largest number of
+ * segments it was deleted from */
+static SaftDBDeleted*
+saft_db_read_deleted (SaftDB *db,
+                      size_t *n_deleted)
+{
+  SaftDBDeleted *deleted = NULL;
+  FILE          *stream;
+  char          *path;
+  char          *line    = NULL;
+  size_t         size    = 0;
+  size_t         n_alloc = 0;
+  size_t         i;
+  size_t         j;
+  uint64_t       stamp;
+
+  *n_deleted = 0;
+  path       = saft_db_deleted_path (db->filename);
+  stream     = fopen (path, "r");
+  free (path);
+  if (!stream)
+    return NULL;
+
+  /* Left by a previous database of that name */
+  if (getline (&line, &size, stream) == -1 ||
+      sscanf (line, "%" SCNu64, &stamp) != 1 ||
+      stamp != db->header->stamp)
+    {
+      if (line)
+        free (line);
+      fclose (stream);
+      return NULL;
+    }
+  while (getline (&line, &size, stream) != -1)
+    {
+      char     *name;
+      uint64_t  segments;
+
+      line[strcspn (line, "\r\n")] = '\0';
+      segments = strtoull (line, &name, 10);
+      if (*name != '\t')
+        continue;
+      if (*n_deleted == n_alloc)
+        {
+          n_alloc += DELETED_CHUNK;
+          deleted  = realloc (deleted, n_alloc * sizeof (*deleted));
+        }
+      deleted[*n_deleted].name     = strdup (name + 1);
+      deleted[*n_deleted].segments = segments;
+      (*n_deleted)++;
+    }
+  if (line)
+    free (line);
+  fclose (stream);
+
+  if (*n_deleted == 0)
+    return deleted;
+  qsort (deleted, *n_deleted, sizeof (*deleted), saft_db_deleted_cmp);
+  for (i = 1, j = 0; i < *n_deleted; i++)
+    if (strcmp (deleted[i].name, deleted[j].name))
+      deleted[++j] = deleted[i];
+    else
+      {
+        if (deleted[i].segments > deleted[j].segments)
+          deleted[j].segments = deleted[i].segments;
+        free (deleted[i].name);
+      }
+  *n_deleted = j + 1;
+
+  return deleted;
+}
+
+static void
+saft_db_free_deleted (SaftDBDeleted *deleted,
+                      size_t         n_deleted)
+{
+  size_t i;
+
+  for (i = 0; i < n_deleted; i++)
+    free (deleted[i].name);
+  if (deleted)
+    free (deleted);
+}
+
+static int
+saft_db_deleted_cmp (const void *a,
+                     const void *b)
+{
+  return strcmp (((const SaftDBDeleted*)a)->name, ((const SaftDBDeleted*)b)->name);
+}
+
+/* Removes the segments and the deleted sequences of the database that was
+ * replaced */
+static void
+saft_db_remove_stale (const char *filename)
+{
+  char     *path;
+  uint64_t  i;
+  int       removed;
+
+  for (i = 1; ; i++)
+    {
+      path    = saft_db_segment_path (filename, i);
+      removed = unlink (path) == 0;
+      free (path);
+      if (!removed)
+        break;
+    }
+  path = saft_db_deleted_path (filename);
+  unlink (path);
+  free (path);
+}
+
+static uint64_t
+saft_db_new_stamp (void)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+
+  return ((uint64_t)tv.tv_sec * 1000000 + tv.tv_usec) ^ ((uint64_t)getpid () << 44);
+}
+
+SaftDBWriter*
+saft_db_writer_new (const char       *filename,
+                    const char       *alphabet,
+                    unsigned int      alphabet_size,
+                    unsigned int      word_size,
+                    SaftDBCountsType  counts_type,
+                    size_t            count_size,
+                    int               append)
+{
+  SaftDBWriter *writer;
+
+  if (alphabet_size > SAFT_DB_MAX_LETTERS)
+    {
+      saft_error ("Databases of alphabets of more than %d letters are not implemented",
+                  SAFT_DB_MAX_LETTERS);
+      return NULL;
+    }
+
+  writer = calloc (1, sizeof (*writer));
+  memcpy (writer->header.magic, SAFT_DB_MAGIC, sizeof (writer->header.magic));
+  strncpy (writer->header.alphabet, alphabet, sizeof (writer->header.alphabet) - 1);
+  writer->header.version       = SAFT_DB_VERSION;
+  writer->header.byte_order    = SAFT_DB_BYTE_ORDER;
+  writer->header.word_size     = word_size;
+  writer->header.counts_type   = counts_type;
+  writer->header.count_size    = count_size;
+  writer->header.alphabet_size = alphabet_size;
+
+  if (append)
+    {
+      SaftDB *db = saft_db_open (filename);
+
+      if (!db)
+        {
+          saft_db_writer_free (writer);
+          return NULL;
+        }
+      if (!saft_db_same_layout (&writer->header, db->header))
+        {
+          saft_error ("`%s' was not written for %s words of size %u",
+                      filename, alphabet, word_size);
+          saft_db_close (db);
+          saft_db_writer_free (writer);
+          return NULL;
+        }
+      writer->header.stamp   = db->header->stamp;
+      writer->header.segment = db->n_segments;
+      writer->filename       = saft_db_segment_path (filename, db->n_segments);
+      saft_db_close (db);
+    }
+  else
+    {
+      writer->header.stamp = saft_db_new_stamp ();
+      writer->filename     = strdup (filename);
+    }
+
+  writer->tmp_filename = malloc (strlen (writer->filename) + sizeof (".tmp"));
+  sprintf (writer->tmp_filename, "%s.tmp", writer->filename);
+  if (!(writer->stream = fopen (writer->tmp_filename, "w")))
+    {
+      saft_error ("Couldn't open `%s'", writer->tmp_filename);
+      saft_db_writer_free (writer);
+      return NULL;
+    }
+
+  /* The header is written again once complete */
+  saft_db_writer_write (writer, &writer->header, sizeof (writer->header));
+
+  return writer;
+}
+
+int
+saft_db_writer_add (SaftDBWriter   *writer,
+                    SaftDBRecord   *record,
+                    const char     *name,
+                    const void     *counts,
+                    const uint64_t *composition)
+{
+  const size_t       name_size     = strlen (name) + 1;
+  const unsigned int alphabet_size = writer->header.alphabet_size;
+  unsigned int       i;
+
+  if (writer->header.n_sequences == writer->records_alloc)
+    {
+      writer->records_alloc += RECORDS_CHUNK;
+      writer->records        = realloc (writer->records,
+                                        writer->records_alloc * sizeof (*writer->records));
+      writer->compositions   = realloc (writer->compositions,
+                                        writer->records_alloc * alphabet_size *
+                                        sizeof (*writer->compositions));
+    }
+  if (writer->header.names_size + name_size > writer->names_alloc)
+    {
+      writer->names_alloc = writer->header.names_size + name_size + NAMES_CHUNK;
+      writer->names       = realloc (writer->names, writer->names_alloc);
+    }
+  memcpy (writer->names + writer->header.names_size, name, name_size);
+  record->name_offset        = writer->header.names_size;
+  writer->header.names_size += name_size;
+
+  saft_db_writer_pad (writer);
+  record->counts_offset = writer->offset;
+  saft_db_writer_write (writer, counts, record->n_counts * writer->header.count_size);
+
+  memcpy (writer->compositions + writer->header.n_sequences * alphabet_size,
+          composition,
+          alphabet_size * sizeof (*composition));
+  for (i = 0; i < alphabet_size; i++)
+    writer->header.composition[i] += composition[i];
+  writer->records[writer->header.n_sequences++] = *record;
+  writer->header.length                        += record->length;
+
+  return writer->failed;
+}
+
+int
+saft_db_writer_close (SaftDBWriter *writer)
+{
+  int ret;
+
+  saft_db_writer_pad (writer);
+  writer->header.records_offset = writer->offset;
+  saft_db_writer_write (writer,
+                        writer->records,
+                        writer->header.n_sequences * sizeof (*writer->records));
+  writer->header.compositions_offset = writer->offset;
+  saft_db_writer_write (writer,
+                        writer->compositions,
+                        writer->header.n_sequences * writer->header.alphabet_size *
+                        sizeof (*writer->compositions));
+  writer->header.names_offset = writer->offset;
+  saft_db_writer_write (writer, writer->names, writer->header.names_size);
+  writer->header.file_size = writer->offset;
+
+  if (!writer->failed && fseek (writer->stream, 0, SEEK_SET) == -1)
+    writer->failed = 1;
+  saft_db_writer_write (writer, &writer->header, sizeof (writer->header));
+
+  if (ferror (writer->stream) | fclose (writer->stream))
+    writer->failed = 1;
+  writer->stream = NULL;
+  if (writer->failed)
+    saft_error ("An IO error occured while writing `%s'", writer->tmp_filename);
+  else if (rename (writer->tmp_filename, writer->filename) == -1)
+    {
+      saft_error ("Couldn't rename `%s' to `%s'", writer->tmp_filename, writer->filename);
+      writer->failed = 1;
+    }
+  if (writer->failed)
+    unlink (writer->tmp_filename);
+  else if (writer->header.segment == 0)
+    saft_db_remove_stale (writer->filename);
+
+  ret = writer->failed;
+  saft_db_writer_free (writer);
+
+  return ret;
+}
+
+static void
+saft_db_writer_pad (SaftDBWriter *writer)
+{
+  static const char zeros[SAFT_DB_ALIGN] = {0};
+
+  if (writer->offset % SAFT_DB_ALIGN)
+    saft_db_writer_write (writer, zeros, SAFT_DB_ALIGN - writer->offset % SAFT_DB_ALIGN);
+}
+
+static void
+saft_db_writer_write (SaftDBWriter *writer,
+                      const void   *data,
+                      size_t        size)
+{
+  if (writer->failed || size == 0)
+    return;
+  if (fwrite (data, 1, size, writer->stream) != size)
+    writer->failed = 1;
+  writer->offset += size;
+}
+
+static void
+saft_db_writer_free (SaftDBWriter *writer)
+{
+  if (writer->stream)
+    {
+      fclose (writer->stream);
+      unlink (writer->tmp_filename);
+    }
+  if (writer->records)
+    free (writer->records);
+  if (writer->compositions)
+    free (writer->compositions);
+  if (writer->names)
+    free (writer->names);
+  if (writer->tmp_filename)
+    free (writer->tmp_filename);
+  if (writer->filename)
+    free (writer->filename);
+  free (writer);
+}
+
+/* vim:ft=c:expandtab:sw=4:ts=4:sts=4:cinoptions={.5s^-2n-2(0:
+ */
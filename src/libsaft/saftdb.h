@@ -0,0 +1,221 @@
+/* saftdb.h
+ * Copyright (C) 2008  Sylvain FORET
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *                                                                       
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *                                                                       
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Binary databases of word counts, written by saft-makedb and mapped in
+ * memory by the searches, so that the database is neither parsed nor counted
+ * again and its pages are shared by the processes searching it.
+ *
+ * The file starts with a SaftDBHeader, followed by the counts of each
+ * sequence, SAFT_DB_ALIGN aligned, then by one SaftDBRecord per sequence, by
+ * the composition of each sequence and by the names of the sequences, each
+ * terminated by a '\0'. The counts are stored in the layout of the search
+ * engine that wrote them, and the file is only read on the architecture it
+ * was written on.
+ *
+ * The sequences appended to a database are written as segments named after
+ * it, FILE.1, FILE.2, ..., and the deleted sequences are listed in a text
+ * file named after it with the SAFT_DB_DELETED_SUFFIX suffix, one line per
+ * sequence:
+ *
+ *   SEGMENTS<TAB>NAME
+ *
+ * after a first line holding the stamp of the database. The sequences called
+ * NAME are deleted from the SEGMENTS first segments, the database itself
+ * being the segment 0. saft_db_compact writes the sequences left as a single
+ * segment again. The segments and the list of the deleted sequences hold the
+ * stamp of the database, so that those of a previous database are ignored.
+ */
+
+#ifndef __SAFT_DB_H__
+#define __SAFT_DB_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define SAFT_DB_MAGIC           "SAFTDB\r\n"
+#define SAFT_DB_VERSION         3
+#define SAFT_DB_BYTE_ORDER      0x01020304
+#define SAFT_DB_ALIGN           64
+#define SAFT_DB_MAX_LETTERS     32
+#define SAFT_DB_DELETED_SUFFIX  ".deleted"
+
+typedef enum
+{
+  /* WordCount[4^k] arrays */
+  SAFT_DB_COUNTS_ARRAY = 0,
+  /* The SaftHashNode of hash tables */
+  SAFT_DB_COUNTS_HASH  = 1
+}
+SaftDBCountsType;
+
+typedef struct _SaftDBHeader SaftDBHeader;
+
+struct _SaftDBHeader
+{
+  char      magic[8];
+  uint32_t  version;
+  uint32_t  byte_order;
+  uint32_t  word_size;
+  uint32_t  counts_type;
+  /* Size of one count, or hash node */
+  uint32_t  count_size;
+  uint32_t  alphabet_size;
+  char      alphabet[16];
+  /* Identifies the database, whose segments have the same stamp */
+  uint64_t  stamp;
+  uint64_t  segment;
+  uint64_t  n_sequences;
+  /* Letters of the sequences, indexed by the codes of the alphabet */
+  uint64_t  composition[SAFT_DB_MAX_LETTERS];
+  uint64_t  length;
+  uint64_t  records_offset;
+  /* alphabet_size letters per sequence */
+  uint64_t  compositions_offset;
+  uint64_t  names_offset;
+  uint64_t  names_size;
+  uint64_t  file_size;
+};
+
+typedef struct _SaftDBRecord SaftDBRecord;
+
+struct _SaftDBRecord
+{
+  uint64_t  length;
+  /* From the start of the names */
+  uint64_t  name_offset;
+  /* From the start of the file */
+  uint64_t  counts_offset;
+  /* Number of counts, or of nodes of the hash table */
+  uint64_t  n_counts;
+  /* The rest of the hash table, unused by arrays */
+  uint64_t  hash_mod;
+  uint64_t  hash_mask;
+  uint64_t  hash_nnodes;
+};
+
+typedef struct _SaftDBSegment SaftDBSegment;
+
+struct _SaftDBSegment
+{
+  const SaftDBHeader *header;
+  const SaftDBRecord *records;
+  const uint64_t     *compositions;
+  const char         *names;
+
+  const char         *map;
+  size_t              size;
+};
+
+typedef struct _SaftDBSequence SaftDBSequence;
+
+struct _SaftDBSequence
+{
+  const SaftDBRecord *record;
+  const char         *name;
+  const void         *counts;
+  const uint64_t     *composition;
+};
+
+typedef struct _SaftDB SaftDB;
+
+struct _SaftDB
+{
+  char               *filename;
+  /* That of the first segment, the others have the same word size,
+   * alphabet and layout of the counts */
+  const SaftDBHeader *header;
+  SaftDBSegment      *segments;
+  size_t              n_segments;
+
+  /* The sequences which were not deleted, segment after segment */
+  SaftDBSequence     *sequences;
+  size_t              n_sequences;
+  uint64_t            length;
+  uint64_t            composition[SAFT_DB_MAX_LETTERS];
+};
+
+/* Whether the file starts like a database, without checking the rest */
+int         saft_db_is_db   (const char   *filename);
+
+/* Maps the database and its segments, returns NULL if it is not a valid
+ * database */
+SaftDB*     saft_db_open    (const char   *filename);
+
+void        saft_db_close   (SaftDB       *db);
+
+const void* saft_db_counts  (SaftDB       *db,
+                             size_t        rank);
+
+const char* saft_db_name    (SaftDB       *db,
+                             size_t        rank);
+
+/* Same as saft_fasta_index_split */
+void        saft_db_split   (SaftDB       *db,
+                             unsigned int  part,
+                             unsigned int  n_parts,
+                             size_t       *first,
+                             size_t       *last);
+
+/* Deletes the sequences of the given names from the database and its
+ * segments, returns 0 on success */
+int         saft_db_delete  (const char   *filename,
+                             char        **names,
+                             size_t        n_names);
+
+/* Writes the sequences left as a single segment, returns 0 on success */
+int         saft_db_compact (const char   *filename);
+
+/* The database is written to a temporary file, which replaces filename when
+ * it is closed, so that the searches mapping the previous database are not
+ * disturbed. When appending, the sequences are written as the next segment
+ * of the database filename instead */
+
+typedef struct _SaftDBWriter SaftDBWriter;
+
+SaftDBWriter* saft_db_writer_new   (const char       *filename,
+                                    const char       *alphabet,
+                                    unsigned int      alphabet_size,
+                                    unsigned int      word_size,
+                                    SaftDBCountsType  counts_type,
+                                    size_t            count_size,
+                                    int               append);
+
+/* The name_offset and counts_offset of record are filled in, the other
+ * fields are left to the caller. Returns 0 on success */
+int           saft_db_writer_add   (SaftDBWriter     *writer,
+                                    SaftDBRecord     *record,
+                                    const char       *name,
+                                    const void       *counts,
+                                    const uint64_t   *composition);
+
+/* Writes the header and frees the writer, returns 0 on success */
+int           saft_db_writer_close (SaftDBWriter     *writer);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __SAFT_DB_H__ */
+
+/* vim:ft=c:expandtab:sw=4:ts=4:sts=4:cinoptions={.5s^-2n-2(0:
+ */
@@ -19,20 +19,38 @@
  *
  */
 
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <zlib.h>
 
 #include "safterror.h"
+#include "saftbgzf.h"
 #include "saftfasta.h"
+#include "saftfastaindex.h"
+#include "saftpool.h"
 
 #define FASTA_CHUNK     256
-#define READ_CHUNK     4096
+/* The streams are read in large blocks, aligned for the vectorised memchr and
+ * memcpy */
+#define READ_CHUNK     (1 << 20)
+#define READ_ALIGN       64
+#define GZIP_BUFFER    (1 << 17)
 #define NAME_INIT_SIZE  256
 #define SEQ_INIT_SIZE  4096
+/* How far ahead of the parser the pages of a mapped file are requested */
+#define MAP_PREFETCH   (64 << 20)
+/* Letter replacing the bases of FASTQ reads with a low quality */
+#define FASTQ_MASK     'N'
+#define FASTQ_OFFSET    33
 
 
 typedef struct _SaftFastaParseData SaftFastaParseData;
@@ -48,80 +66,1552 @@ static int saft_fasta_append (SaftSequence       *seq,
                               SaftFastaParseData *data);
 
 
+typedef struct _SaftFastaShardData SaftFastaShardData;
+
+struct _SaftFastaShardData
+{
+  SaftFastaIterFunc  func;
+  void              *data;
+  size_t             rank;
+  size_t             n_sequences;
+  unsigned int       shard;
+  unsigned int       n_shards;
+};
+
+static int saft_fasta_shard  (SaftSequence       *seq,
+                              SaftFastaShardData *data);
+
+typedef struct _SaftFastaFragmentShardData SaftFastaFragmentShardData;
+
+struct _SaftFastaFragmentShardData
+{
+  const SaftFastaFragmentFuncs *funcs;
+  void                         *data;
+  size_t                        rank;
+  unsigned int                  shard;
+  unsigned int                  n_shards;
+};
+
+static int  saft_fasta_shard_begin (const char *name,
+                                    size_t      name_length,
+                                    void       *data);
+
+static void saft_fasta_shard_feed  (const char *letters,
+                                    size_t      length,
+                                    void       *data);
+
+static int  saft_fasta_shard_end   (void       *data);
+
+static const SaftFastaFragmentFuncs saft_fasta_shard_funcs =
+{
+  saft_fasta_shard_begin,
+  saft_fasta_shard_feed,
+  saft_fasta_shard_end
+};
+
+
+/* Joins the fragments of the sequences read from a stream */
+typedef struct _SaftFastaJoinData SaftFastaJoinData;
+
+struct _SaftFastaJoinData
+{
+  SaftFastaIterFunc  func;
+  void              *data;
+  SaftSequence      *seq;
+};
+
+static int  saft_fasta_join_begin (const char *name,
+                                   size_t      name_length,
+                                   void       *data);
+
+static void saft_fasta_join_feed  (const char *letters,
+                                   size_t      length,
+                                   void       *data);
+
+static int  saft_fasta_join_end   (void       *data);
+
+static const SaftFastaFragmentFuncs saft_fasta_join_funcs =
+{
+  saft_fasta_join_begin,
+  saft_fasta_join_feed,
+  saft_fasta_join_end
+};
+
+/* Hands the reads of FASTQ files over as fragments */
+typedef struct _SaftFastaSink SaftFastaSink;
+
+struct _SaftFastaSink
+{
+  const SaftFastaFragmentFuncs *funcs;
+  void                         *data;
+  size_t                        n_sequences;
+};
+
+static int  saft_fasta_sink_sequence (SaftSequence *seq,
+                                      void         *data);
+
+
+static size_t saft_fasta_iter_mapped (const char        *map,
+                                      const char        *start,
+                                      const char        *max,
+                                      SaftFastaIterFunc  func,
+                                      void              *data);
+
+static size_t saft_fastq_iter_mapped (const char        *map,
+                                      const char        *start,
+                                      const char        *max,
+                                      unsigned int       min_quality,
+                                      SaftFastaIterFunc  func,
+                                      void              *data);
+
+static size_t saft_fasta_fragments_mapped (const char                   *map,
+                                           const char                   *start,
+                                           const char                   *max,
+                                           const SaftFastaFragmentFuncs *funcs,
+                                           void                         *data);
+
+static const char* saft_fasta_map_file (const char  *filename,
+                                        int         *fd,
+                                        size_t      *size);
+
+static void   saft_fasta_prefetch    (const char        *map,
+                                      const char        *start,
+                                      const char        *max,
+                                      const char       **prefetched);
+
+static const char* saft_fasta_map_lines (const char    *line,
+                                         const char    *max,
+                                         char           stop,
+                                         SaftSequence  *seq,
+                                         char         **buffer,
+                                         size_t        *buffer_alloc);
+
+static void   saft_fastq_mask        (char              *seq,
+                                      const char        *quality,
+                                      size_t             length,
+                                      unsigned int       min_quality);
+
+static inline size_t saft_fasta_line_length (const char *line,
+                                             const char *end);
+
+
+/* Where the sequences that are not mapped are read from */
+typedef struct _SaftFastaSource SaftFastaSource;
+
+struct _SaftFastaSource
+{
+  int            fd;
+  SaftBgzf      *bgzf;
+  /* gzip data is inflated from in, plain data is first taken from the bytes
+   * of in read to recognise the format */
+  z_stream      *zstream;
+  unsigned char *in;
+  size_t         n_in;
+  size_t         in_pos;
+  int            member_ended;
+  /* Where the data is handed to the parsers, READ_CHUNK bytes */
+  char          *buffer;
+
+  /* A thread reads the next block in next while the parsers work on buffer,
+   * and the two are swapped by saft_fasta_source_next */
+  pthread_t        reader;
+  pthread_mutex_t  lock;
+  pthread_cond_t   cond;
+  char            *next;
+  ssize_t          next_status;
+  int              next_ready;
+  int              reading;
+  int              stop;
+  /* Wakes the reader up when it waits for a pipe and the parsing stopped */
+  int              wake[2];
+};
+
+static int     saft_fasta_open        (const char        *filename);
+
+static void    saft_fasta_iter_input  (int                     fd,
+                                       const char             *filename,
+                                       const SaftFastaOptions *options,
+                                       SaftFastaIterFunc       func,
+                                       void                   *data);
+
+static size_t  saft_fasta_fragments_input (int                           fd,
+                                           const char                   *filename,
+                                           const SaftFastaOptions       *options,
+                                           const SaftFastaFragmentFuncs *funcs,
+                                           void                         *data);
+
+static void    saft_fasta_iter_stream (SaftFastaSource   *source,
+                                       const char        *filename,
+                                       unsigned int       min_quality,
+                                       SaftFastaIterFunc  func,
+                                       void              *data);
+
+static size_t  saft_fasta_fragments_stream (SaftFastaSource              *source,
+                                            ssize_t                       status,
+                                            const char                   *filename,
+                                            const SaftFastaFragmentFuncs *funcs,
+                                            void                         *data);
+
+static void    saft_fastq_iter_stream (SaftFastaSource   *source,
+                                       ssize_t            status,
+                                       const char        *filename,
+                                       unsigned int       min_quality,
+                                       SaftFastaIterFunc  func,
+                                       void              *data);
+
+static int     saft_fasta_source_init (SaftFastaSource   *source,
+                                       int                fd,
+                                       unsigned int       n_threads);
+
+static void    saft_fasta_source_free (SaftFastaSource   *source);
+
+static ssize_t saft_fasta_source_next (SaftFastaSource   *source);
+
+static void*   saft_fasta_reader      (void              *data);
+
+static ssize_t saft_fasta_read_source (SaftFastaSource   *source,
+                                       char              *buffer,
+                                       size_t             size);
+
+static ssize_t saft_fasta_inflate     (SaftFastaSource   *source,
+                                       char              *buffer,
+                                       size_t             size);
+
+static ssize_t saft_fasta_read_input  (SaftFastaSource   *source,
+                                       void              *buffer,
+                                       size_t             size);
+
+static int     saft_fasta_compressed  (int                fd);
+
+static int     saft_fasta_fastq       (int                fd);
+
+
+/* Used when no options are given */
+static const SaftFastaOptions saft_fasta_default_options =
+{
+  1,
+  0
+};
+
+
+typedef struct _SaftFastaParallelData SaftFastaParallelData;
+
+struct _SaftFastaParallelData
+{
+  SaftFastaParallelFunc  func;
+  void                  *data;
+  const char            *map;
+  size_t                 size;
+  size_t                 n_ranges;
+};
+
+typedef struct _SaftFastaRangeData SaftFastaRangeData;
+
+struct _SaftFastaRangeData
+{
+  SaftFastaParallelData *parallel;
+  size_t                 range;
+  unsigned int           thread;
+};
+
+static const char* saft_fasta_next_header (const char   *map,
+                                           const char   *start,
+                                           const char   *max);
+
+static const char* saft_fasta_range_start (const char   *map,
+                                           size_t        size,
+                                           size_t        range,
+                                           size_t        n_ranges);
+
+static void        saft_fasta_range_func  (size_t        task,
+                                           unsigned int  thread,
+                                           void         *data);
+
+static int         saft_fasta_range_iter  (SaftSequence *seq,
+                                           void         *data);
+
+
+SaftSequence**
+saft_fasta_read (const char             *filename,
+                 const SaftFastaOptions *options,
+                 unsigned int           *n)
+{
+  SaftFastaParseData data;
+
+  data.seqs  = malloc (FASTA_CHUNK * sizeof (*data.seqs));
+  data.alloc =  FASTA_CHUNK;
+  data.idx   = 0;
+
+  saft_fasta_iter (filename,
+                   options,
+                   (SaftFastaIterFunc)saft_fasta_append,
+                   &data);
+
+  data.seqs[data.idx] = NULL;
+  if (n)
+    *n = data.idx;
+
+  return data.seqs;
+}
+
 SaftSequence**
-saft_fasta_read (const char   *filename,
-                 unsigned int *n)
+saft_fasta_read_fd (int                     fd,
+                    const SaftFastaOptions *options,
+                    unsigned int           *n)
+{
+  SaftFastaParseData data;
+
+  data.seqs  = malloc (FASTA_CHUNK * sizeof (*data.seqs));
+  data.alloc =  FASTA_CHUNK;
+  data.idx   = 0;
+
+  saft_fasta_iter_fd (fd,
+                      options,
+                      (SaftFastaIterFunc)saft_fasta_append,
+                      &data);
+
+  data.seqs[data.idx] = NULL;
+  if (n)
+    *n = data.idx;
+
+  return data.seqs;
+}
+
+static int
+saft_fasta_append (SaftSequence       *seq,
+                   SaftFastaParseData *data)
+{
+  SaftSequence *new_seq;
+
+  new_seq = saft_sequence_copy (seq);
+
+  /* Add +1 to make space for the terminal NULL */
+  if (data->idx + 1 >= data->alloc)
+    {
+      data->alloc <<= 1;
+      data->seqs    = realloc (data->seqs, data->alloc * sizeof (*data->seqs));
+    }
+  data->seqs[data->idx] = new_seq;
+  data->idx++;
+
+  return 1;
+}
+
+size_t
+saft_fasta_iter_shard (const char             *filename,
+                       const SaftFastaOptions *options,
+                       unsigned int            shard,
+                       unsigned int            n_shards,
+                       SaftFastaIterFunc       func,
+                       void                   *data)
+{
+  SaftFastaShardData  shard_data;
+  SaftFastaIndex     *index;
+
+  /* With an index, a shard is a run of consecutive sequences, and only its
+   * part of the file is read */
+  if (n_shards > 1 && (index = saft_fasta_index_load (filename)))
+    {
+      size_t   n_sequences = 0;
+      size_t   first;
+      size_t   last;
+
+      saft_fasta_index_split (index, shard, n_shards, &first, &last);
+      if (first < last)
+        n_sequences = saft_fasta_iter_range (filename,
+                                             first > 0 ? index->records[first - 1].offset : 0,
+                                             last < index->n_records ? index->records[last - 1].offset : UINT64_MAX,
+                                             func,
+                                             data);
+      saft_fasta_index_free (index);
+
+      return n_sequences;
+    }
+
+  shard_data.func        = func;
+  shard_data.data        = data;
+  shard_data.rank        = 0;
+  shard_data.n_sequences = 0;
+  shard_data.shard       = shard;
+  shard_data.n_shards    = n_shards ? n_shards : 1;
+
+  saft_fasta_iter (filename,
+                   options,
+                   (SaftFastaIterFunc)saft_fasta_shard,
+                   &shard_data);
+
+  return shard_data.n_sequences;
+}
+
+static int
+saft_fasta_shard (SaftSequence       *seq,
+                  SaftFastaShardData *data)
+{
+  const size_t rank = data->rank;
+
+  data->rank++;
+  if (rank % data->n_shards != data->shard)
+    return 1;
+
+  data->n_sequences++;
+  return data->func (seq, data->data);
+}
+
+size_t
+saft_fasta_iter_fragments (const char                   *filename,
+                           const SaftFastaOptions       *options,
+                           const SaftFastaFragmentFuncs *funcs,
+                           void                         *data)
+{
+  size_t n_sequences;
+  int    in;
+
+  if ((in = saft_fasta_open (filename)) == -1)
+    return 0;
+  n_sequences = saft_fasta_fragments_input (in, filename, options, funcs, data);
+  close (in);
+
+  return n_sequences;
+}
+
+size_t
+saft_fasta_iter_shard_fragments (const char                   *filename,
+                                 const SaftFastaOptions       *options,
+                                 unsigned int                  shard,
+                                 unsigned int                  n_shards,
+                                 const SaftFastaFragmentFuncs *funcs,
+                                 void                         *data)
+{
+  SaftFastaFragmentShardData  shard_data;
+  SaftFastaIndex             *index;
+
+  /* The shards are split as in saft_fasta_iter_shard */
+  if (n_shards > 1 && (index = saft_fasta_index_load (filename)))
+    {
+      size_t      n_sequences = 0;
+      size_t      first;
+      size_t      last;
+      size_t      size;
+      const char *map;
+      int         in;
+
+      saft_fasta_index_split (index, shard, n_shards, &first, &last);
+      if (first < last && (map = saft_fasta_map_file (filename, &in, &size)))
+        {
+          const uint64_t start = first > 0 ? index->records[first - 1].offset : 0;
+          const uint64_t end   = last < index->n_records ? index->records[last - 1].offset : size;
+
+          n_sequences = saft_fasta_fragments_mapped (map,
+                                                     saft_fasta_next_header (map, map + (start < size ? start : size), map + size),
+                                                     saft_fasta_next_header (map, map + (end < size ? end : size), map + size),
+                                                     funcs,
+                                                     data);
+          munmap ((void*)map, size);
+          close (in);
+        }
+      saft_fasta_index_free (index);
+
+      return n_sequences;
+    }
+  if (n_shards <= 1)
+    return saft_fasta_iter_fragments (filename, options, funcs, data);
+
+  shard_data.funcs    = funcs;
+  shard_data.data     = data;
+  shard_data.rank     = 0;
+  shard_data.shard    = shard;
+  shard_data.n_shards = n_shards;
+
+  return saft_fasta_iter_fragments (filename, options, &saft_fasta_shard_funcs, &shard_data);
+}
+
+static int
+saft_fasta_shard_begin (const char *name,
+                        size_t      name_length,
+                        void       *data)
+{
+  SaftFastaFragmentShardData *shard_data = data;
+  const size_t                rank       = shard_data->rank;
+
+  shard_data->rank++;
+  if (rank % shard_data->n_shards != shard_data->shard)
+    return 0;
+
+  return shard_data->funcs->begin (name, name_length, shard_data->data);
+}
+
+static void
+saft_fasta_shard_feed (const char *letters,
+                       size_t      length,
+                       void       *data)
+{
+  SaftFastaFragmentShardData *shard_data = data;
+
+  shard_data->funcs->feed (letters, length, shard_data->data);
+}
+
+static int
+saft_fasta_shard_end (void *data)
+{
+  SaftFastaFragmentShardData *shard_data = data;
+
+  return shard_data->funcs->end (shard_data->data);
+}
+
+void
+saft_fasta_iter (const char             *filename,
+                 const SaftFastaOptions *options,
+                 SaftFastaIterFunc       func,
+                 void                   *data)
+{
+  int in;
+
+  if ((in = saft_fasta_open (filename)) == -1)
+    return;
+  saft_fasta_iter_input (in, filename, options, func, data);
+  close (in);
+}
+
+void
+saft_fasta_iter_fd (int                     fd,
+                    const SaftFastaOptions *options,
+                    SaftFastaIterFunc       func,
+                    void                   *data)
+{
+  char name[32];
+
+  snprintf (name, sizeof (name), "file descriptor %d", fd);
+  saft_fasta_iter_input (fd, name, options, func, data);
+}
+
+/* The filename `-' stands for the standard input, which is duplicated so
+ * that the descriptor returned can always be closed */
+static int
+saft_fasta_open (const char *filename)
+{
+  int fd;
+
+  if (strcmp (filename, "-") == 0)
+    fd = dup (STDIN_FILENO);
+  else
+    fd = open (filename, O_RDONLY);
+  if (fd == -1)
+    saft_error ("Couldn't open `%s'", filename);
+
+  return fd;
+}
+
+static void
+saft_fasta_iter_input (int                     fd,
+                       const char             *filename,
+                       const SaftFastaOptions *options,
+                       SaftFastaIterFunc       func,
+                       void                   *data)
+{
+  SaftFastaSource  source;
+  struct stat      st;
+
+  if (!options)
+    options = &saft_fasta_default_options;
+
+  /* Regular files read from their beginning are mapped, anything else is
+   * read as it comes */
+  if (fstat (fd, &st) == 0 && S_ISREG (st.st_mode) && st.st_size > 0 &&
+      lseek (fd, 0, SEEK_CUR) == 0 && !saft_fasta_compressed (fd))
+    {
+      void *map;
+
+      map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map != MAP_FAILED)
+        {
+          madvise (map, st.st_size, MADV_SEQUENTIAL);
+          if (*(char*)map == '@')
+            saft_fastq_iter_mapped (map, map, (char*)map + st.st_size, options->min_quality, func, data);
+          else
+            saft_fasta_iter_mapped (map, map, (char*)map + st.st_size, func, data);
+          munmap (map, st.st_size);
+          return;
+        }
+    }
+
+  if (saft_fasta_source_init (&source, fd, options->n_threads))
+    saft_error ("Couldn't read `%s'", filename);
+  else
+    saft_fasta_iter_stream (&source, filename, options->min_quality, func, data);
+  saft_fasta_source_free (&source);
+}
+
+/* Same as saft_fasta_iter_input, the reads of FASTQ files being fed at once */
+static size_t
+saft_fasta_fragments_input (int                           fd,
+                            const char                   *filename,
+                            const SaftFastaOptions       *options,
+                            const SaftFastaFragmentFuncs *funcs,
+                            void                         *data)
+{
+  SaftFastaSource  source;
+  SaftFastaSink    sink;
+  struct stat      st;
+  ssize_t          status;
+
+  if (!options)
+    options = &saft_fasta_default_options;
+  sink.funcs       = funcs;
+  sink.data        = data;
+  sink.n_sequences = 0;
+
+  if (fstat (fd, &st) == 0 && S_ISREG (st.st_mode) && st.st_size > 0 &&
+      lseek (fd, 0, SEEK_CUR) == 0 && !saft_fasta_compressed (fd))
+    {
+      void *map;
+
+      map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map != MAP_FAILED)
+        {
+          madvise (map, st.st_size, MADV_SEQUENTIAL);
+          if (*(char*)map == '@')
+            saft_fastq_iter_mapped (map, map, (char*)map + st.st_size, options->min_quality, saft_fasta_sink_sequence, &sink);
+          else
+            sink.n_sequences = saft_fasta_fragments_mapped (map, map, (char*)map + st.st_size, funcs, data);
+          munmap (map, st.st_size);
+          return sink.n_sequences;
+        }
+    }
+
+  if (saft_fasta_source_init (&source, fd, options->n_threads))
+    saft_error ("Couldn't read `%s'", filename);
+  else
+    {
+      status = saft_fasta_source_next (&source);
+      if (status > 0 && source.buffer[0] == '@')
+        saft_fastq_iter_stream (&source, status, filename, options->min_quality, saft_fasta_sink_sequence, &sink);
+      else
+        sink.n_sequences = saft_fasta_fragments_stream (&source, status, filename, funcs, data);
+    }
+  saft_fasta_source_free (&source);
+
+  return sink.n_sequences;
+}
+
+static int
+saft_fasta_sink_sequence (SaftSequence *seq,
+                          void         *data)
+{
+  SaftFastaSink *sink = data;
+
+  if (!sink->funcs->begin (seq->name, seq->name_length, sink->data))
+    return 1;
+  sink->n_sequences++;
+  if (seq->seq_length > 0)
+    sink->funcs->feed (seq->seq, seq->seq_length, sink->data);
+
+  return sink->funcs->end (sink->data);
+}
+
+/* gzip and BGZF files start with the same magic number */
+static int
+saft_fasta_compressed (int fd)
+{
+  unsigned char magic[2];
+
+  return (pread (fd, magic, sizeof (magic), 0) == sizeof (magic) &&
+          magic[0] == 0x1f && magic[1] == 0x8b);
+}
+
+static int
+saft_fasta_fastq (int fd)
+{
+  char first;
+
+  return pread (fd, &first, 1, 0) == 1 && first == '@';
+}
+
+/* BGZF files are only recognised at the beginning of regular files, other
+ * gzip data is inflated sequentially. The reader thread is started once the
+ * format is known, the source being read synchronously if it cannot be */
+static int
+saft_fasta_source_init (SaftFastaSource *source,
+                        int              fd,
+                        unsigned int     n_threads)
+{
+  ssize_t n = 0;
+
+  memset (source, 0, sizeof (*source));
+  source->fd      = fd;
+  source->wake[0] = -1;
+  source->wake[1] = -1;
+  if (posix_memalign ((void**)&source->buffer, READ_ALIGN, READ_CHUNK))
+    {
+      source->buffer = NULL;
+      return -1;
+    }
+  if (lseek (fd, 0, SEEK_CUR) == 0 && saft_bgzf_check (fd))
+    {
+      source->bgzf = saft_bgzf_new (fd, n_threads > 0 ? n_threads : 1);
+      if (!source->bgzf)
+        return -1;
+    }
+  else
+    {
+      /* Peeking at the magic number would consume it on a pipe */
+      source->in = malloc (GZIP_BUFFER);
+      while (source->n_in < 2 &&
+             (n = saft_fasta_read_input (source, source->in + source->n_in,
+                                         GZIP_BUFFER - source->n_in)) > 0)
+        source->n_in += n;
+      if (n == -1)
+        return -1;
+
+      if (source->n_in >= 2 && source->in[0] == 0x1f && source->in[1] == 0x8b)
+        {
+          source->zstream = calloc (1, sizeof (*source->zstream));
+          /* 16 only accepts gzip headers */
+          if (inflateInit2 (source->zstream, 15 + 16) != Z_OK)
+            {
+              free (source->zstream);
+              source->zstream = NULL;
+              return -1;
+            }
+          source->zstream->next_in  = source->in;
+          source->zstream->avail_in = source->n_in;
+        }
+    }
+
+  if (posix_memalign ((void**)&source->next, READ_ALIGN, READ_CHUNK))
+    {
+      source->next = NULL;
+      return 0;
+    }
+  if (pipe (source->wake) == -1)
+    {
+      source->wake[0] = -1;
+      source->wake[1] = -1;
+      return 0;
+    }
+  pthread_mutex_init (&source->lock, NULL);
+  pthread_cond_init (&source->cond, NULL);
+  source->reading = pthread_create (&source->reader, NULL, saft_fasta_reader, source) == 0;
+  if (!source->reading)
+    {
+      pthread_mutex_destroy (&source->lock);
+      pthread_cond_destroy (&source->cond);
+    }
+
+  return 0;
+}
+
+/* The reader thread is stopped first, which may interrupt a read on a pipe */
+static void
+saft_fasta_source_free (SaftFastaSource *source)
+{
+  if (source->reading)
+    {
+      const char byte = 0;
+
+      pthread_mutex_lock (&source->lock);
+      source->stop = 1;
+      pthread_cond_signal (&source->cond);
+      pthread_mutex_unlock (&source->lock);
+      if (write (source->wake[1], &byte, 1) == -1)
+        saft_error ("Couldn't stop reading the input");
+      pthread_join (source->reader, NULL);
+      pthread_mutex_destroy (&source->lock);
+      pthread_cond_destroy (&source->cond);
+    }
+  if (source->wake[0] != -1)
+    {
+      close (source->wake[0]);
+      close (source->wake[1]);
+    }
+  free (source->next);
+  if (source->zstream)
+    {
+      inflateEnd (source->zstream);
+      free (source->zstream);
+    }
+  free (source->in);
+  free (source->buffer);
+  saft_bgzf_free (source->bgzf);
+}
+
+/* Hands the next block over in source->buffer, and returns its size, 0 at
+ * the end of the data and -1 on errors */
+static ssize_t
+saft_fasta_source_next (SaftFastaSource *source)
+{
+  ssize_t status;
+
+  if (!source->reading)
+    return saft_fasta_read_source (source, source->buffer, READ_CHUNK);
+
+  pthread_mutex_lock (&source->lock);
+  while (!source->next_ready)
+    pthread_cond_wait (&source->cond, &source->lock);
+  status = source->next_status;
+  /* The reader is done after the last block */
+  if (status > 0)
+    {
+      char *buffer = source->buffer;
+
+      source->buffer     = source->next;
+      source->next       = buffer;
+      source->next_ready = 0;
+      pthread_cond_signal (&source->cond);
+    }
+  pthread_mutex_unlock (&source->lock);
+
+  return status;
+}
+
+static void*
+saft_fasta_reader (void *data)
+{
+  SaftFastaSource *source = data;
+  ssize_t          status;
+
+  do
+    {
+      char *next;
+      int   stop;
+
+      pthread_mutex_lock (&source->lock);
+      while (source->next_ready && !source->stop)
+        pthread_cond_wait (&source->cond, &source->lock);
+      next = source->next;
+      stop = source->stop;
+      pthread_mutex_unlock (&source->lock);
+      if (stop)
+        break;
+
+      status = saft_fasta_read_source (source, next, READ_CHUNK);
+
+      pthread_mutex_lock (&source->lock);
+      source->next_status = status;
+      source->next_ready  = 1;
+      pthread_cond_signal (&source->cond);
+      pthread_mutex_unlock (&source->lock);
+    }
+  while (status > 0);
+
+  return NULL;
+}
+
+static ssize_t
+saft_fasta_read_source (SaftFastaSource *source,
+                        char            *buffer,
+                        size_t           size)
+{
+  if (source->bgzf)
+    return saft_bgzf_read (source->bgzf, buffer, size);
+  if (source->zstream)
+    return saft_fasta_inflate (source, buffer, size);
+  if (source->in_pos < source->n_in)
+    {
+      if (size > source->n_in - source->in_pos)
+        size = source->n_in - source->in_pos;
+      memcpy (buffer, source->in + source->in_pos, size);
+      source->in_pos += size;
+      return size;
+    }
+  return saft_fasta_read_input (source, buffer, size);
+}
+
+/* Returns as soon as some data is inflated rather than waiting for the whole
+ * buffer, so that records coming through a pipe are not held back.
+ * Concatenated gzip members are read one after the other */
+static ssize_t
+saft_fasta_inflate (SaftFastaSource *source,
+                    char            *buffer,
+                    size_t           size)
+{
+  z_stream *zstream = source->zstream;
+
+  zstream->next_out  = (unsigned char*) buffer;
+  zstream->avail_out = size;
+  while (zstream->avail_out == size)
+    {
+      int ret;
+
+      if (zstream->avail_in == 0)
+        {
+          ssize_t n;
+
+          n = saft_fasta_read_input (source, source->in, GZIP_BUFFER);
+          if (n == -1)
+            return -1;
+          /* A truncated member is an error */
+          if (n == 0)
+            return source->member_ended ? 0 : -1;
+          zstream->next_in  = source->in;
+          zstream->avail_in = n;
+        }
+      if (source->member_ended)
+        {
+          inflateReset (zstream);
+          source->member_ended = 0;
+        }
+      ret = inflate (zstream, Z_NO_FLUSH);
+      if (ret == Z_STREAM_END)
+        source->member_ended = 1;
+      else if (ret != Z_OK && ret != Z_BUF_ERROR)
+        return -1;
+    }
+
+  return size - zstream->avail_out;
+}
+
+/* Waits for the data on the reader thread, unless the parsing stopped */
+static ssize_t
+saft_fasta_read_input (SaftFastaSource *source,
+                       void            *buffer,
+                       size_t           size)
 {
-  SaftFastaParseData data;
+  ssize_t n;
 
-  data.seqs  = malloc (FASTA_CHUNK * sizeof (*data.seqs));
-  data.alloc =  FASTA_CHUNK;
-  data.idx   = 0;
+  if (source->wake[0] != -1)
+    {
+      struct pollfd fds[2];
 
-  saft_fasta_iter (filename,
-                   (SaftFastaIterFunc)saft_fasta_append,
-                   &data);
+      fds[0].fd     = source->fd;
+      fds[0].events = POLLIN;
+      fds[1].fd     = source->wake[0];
+      fds[1].events = POLLIN;
+      while ((n = poll (fds, 2, -1)) == -1 && errno == EINTR)
+        ;
+      if (n == -1 || fds[1].revents)
+        return -1;
+    }
+  while ((n = read (source->fd, buffer, size)) == -1 && errno == EINTR)
+    ;
 
-  data.seqs[data.idx] = NULL;
-  if (n)
-    *n = data.idx;
+  return n;
+}
 
-  return data.seqs;
+size_t
+saft_fasta_iter_range (const char        *filename,
+                       uint64_t           start,
+                       uint64_t           end,
+                       SaftFastaIterFunc  func,
+                       void              *data)
+{
+  const char  *map;
+  size_t       size;
+  size_t       n_sequences;
+  int          in;
+
+  if (!(map = saft_fasta_map_file (filename, &in, &size)))
+    return 0;
+  if (end > size)
+    end = size;
+  if (start > end)
+    start = end;
+
+  n_sequences = saft_fasta_iter_mapped (map,
+                                        saft_fasta_next_header (map, map + start, map + size),
+                                        saft_fasta_next_header (map, map + end, map + size),
+                                        func,
+                                        data);
+  munmap ((void*)map, size);
+  close (in);
+
+  return n_sequences;
 }
 
-static int
-saft_fasta_append (SaftSequence       *seq,
-                   SaftFastaParseData *data)
+/* Maps an uncompressed regular FASTA file, the descriptor being left open in
+ * *fd, and returns NULL on failure */
+static const char*
+saft_fasta_map_file (const char *filename,
+                     int        *fd,
+                     size_t     *size)
 {
-  SaftSequence *new_seq;
+  struct stat  st;
+  const char  *map;
+  int          in;
 
-  new_seq = saft_sequence_copy (seq);
+  if ((in = saft_fasta_open (filename)) == -1)
+    return NULL;
+  if (fstat (in, &st) == -1 || !S_ISREG (st.st_mode) || saft_fasta_compressed (in))
+    {
+      saft_error ("`%s' is not an uncompressed regular file", filename);
+      close (in);
+      return NULL;
+    }
+  if (saft_fasta_fastq (in))
+    {
+      saft_error ("FASTQ files like `%s' cannot be read from an offset", filename);
+      close (in);
+      return NULL;
+    }
+  if (st.st_size == 0)
+    {
+      close (in);
+      return NULL;
+    }
 
-  /* Add +1 to make space for the terminal NULL */
-  if (data->idx + 1 >= data->alloc)
+  map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, in, 0);
+  if (map == MAP_FAILED)
     {
-      data->alloc <<= 1;
-      data->seqs    = realloc (data->seqs, data->alloc * sizeof (*data->seqs));
+      saft_error ("Couldn't map `%s'", filename);
+      close (in);
+      return NULL;
     }
-  data->seqs[data->idx] = new_seq;
-  data->idx++;
+  madvise ((void*)map, st.st_size, MADV_SEQUENTIAL);
+  *fd   = in;
+  *size = st.st_size;
 
-  return 1;
+  return map;
 }
 
 void
-saft_fasta_iter (const char        *filename,
-                 SaftFastaIterFunc  func,
-                 void              *data)
+saft_fasta_iter_parallel (const char             *filename,
+                          const SaftFastaOptions *options,
+                          SaftPool               *pool,
+                          size_t                  n_ranges,
+                          SaftFastaParallelFunc   func,
+                          void                   *data)
 {
-  char           buffer[READ_CHUNK];
-  SaftSequence  *seq              = NULL;
-  int            in               = -1;
-  int            status           = -1;
-  char           in_header        =  0;
-  char           started          =  0;
+  SaftFastaParallelData parallel;
+  struct stat           st;
+  void                 *map = MAP_FAILED;
+  int                   in;
 
-  if ((in = open (filename, O_RDONLY | O_NONBLOCK)) == -1)
+  parallel.func     = func;
+  parallel.data     = data;
+  parallel.n_ranges = n_ranges ? n_ranges : 1;
+
+  if ((in = saft_fasta_open (filename)) == -1)
+    return;
+  if (fstat (in, &st) == 0 && S_ISREG (st.st_mode) && st.st_size > 0 &&
+      !saft_fasta_compressed (in) && !saft_fasta_fastq (in))
+    map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, in, 0);
+
+  /* What cannot be mapped is parsed sequentially, as a single range. So are
+   * FASTQ files, as quality lines can start like a header and records
+   * cannot be found from an arbitrary offset */
+  if (map == MAP_FAILED)
     {
-      saft_error ("Couldn't open `%s'", filename);
+      SaftFastaRangeData range_data;
+
+      close (in);
+      range_data.parallel = &parallel;
+      range_data.range    = 0;
+      range_data.thread   = 0;
+      saft_fasta_iter (filename, options, saft_fasta_range_iter, &range_data);
       return;
     }
 
+  madvise (map, st.st_size, MADV_SEQUENTIAL);
+  parallel.map  = map;
+  parallel.size = st.st_size;
+  saft_pool_run (pool, parallel.n_ranges, saft_fasta_range_func, &parallel);
+
+  munmap (map, st.st_size);
+  close (in);
+}
+
+/* Snaps the start of a range to the next header, the first range starting at
+ * the beginning of the map */
+static const char*
+saft_fasta_range_start (const char *map,
+                        size_t      size,
+                        size_t      range,
+                        size_t      n_ranges)
+{
+  const char *max   = map + size;
+  const char *start = map + (size / n_ranges) * range + (size % n_ranges) * range / n_ranges;
+
+  if (range == 0)
+    return map;
+  if (range >= n_ranges)
+    return max;
+
+  return saft_fasta_next_header (map, start, max);
+}
+
+/* Returns the first header starting in [start, max), or max */
+static const char*
+saft_fasta_next_header (const char *map,
+                        const char *start,
+                        const char *max)
+{
+  if (start > map && start[-1] != '\n')
+    {
+      start = memchr (start, '\n', max - start);
+      if (!start)
+        return max;
+      start++;
+    }
+  while (start < max && *start != '>')
+    {
+      start = memchr (start, '\n', max - start);
+      if (!start)
+        return max;
+      start++;
+    }
+
+  return start;
+}
+
+static void
+saft_fasta_range_func (size_t        task,
+                       unsigned int  thread,
+                       void         *data)
+{
+  SaftFastaParallelData *parallel = data;
+  SaftFastaRangeData     range_data;
+  const char            *start;
+  const char            *max;
+
+  start = saft_fasta_range_start (parallel->map, parallel->size, task, parallel->n_ranges);
+  max   = saft_fasta_range_start (parallel->map, parallel->size, task + 1, parallel->n_ranges);
+  if (start >= max)
+    return;
+
+  range_data.parallel = parallel;
+  range_data.range    = task;
+  range_data.thread   = thread;
+  saft_fasta_iter_mapped (parallel->map, start, max, saft_fasta_range_iter, &range_data);
+}
+
+static int
+saft_fasta_range_iter (SaftSequence *seq,
+                       void         *data)
+{
+  SaftFastaRangeData *range_data = data;
+
+  return range_data->parallel->func (seq,
+                                     range_data->range,
+                                     range_data->thread,
+                                     range_data->parallel->data);
+}
+
+/* Parses the sequences in [start, max), max being either the end of the map
+ * or the start of a header, and returns their number */
+static size_t
+saft_fasta_iter_mapped (const char        *map,
+                        const char        *start,
+                        const char        *max,
+                        SaftFastaIterFunc  func,
+                        void              *data)
+{
+  SaftSequence *seq;
+  const char   *prefetched  = start;
+  char         *buffer;
+  size_t        buffer_alloc;
+  size_t        n_sequences = 0;
+
+  start = memchr (start, '>', max - start);
+  if (!start)
+    return 0;
+
+  seq             = saft_sequence_new ();
+  seq->name_alloc = NAME_INIT_SIZE;
+  seq->name       = malloc (seq->name_alloc);
+  buffer_alloc    = SEQ_INIT_SIZE;
+  buffer          = malloc (buffer_alloc);
+
+  /* start is on the '>' of a header */
+  while (start < max)
+    {
+      const char *line = start + 1;
+      const char *end;
+      size_t      length;
+
+      saft_fasta_prefetch (map, start, max, &prefetched);
+
+      end = memchr (line, '\n', max - line);
+      if (!end)
+        end = max;
+      length = saft_fasta_line_length (line, end);
+      if (seq->name_alloc < length + 1)
+        {
+          while (seq->name_alloc < length + 1)
+            seq->name_alloc <<= 1;
+          seq->name = realloc (seq->name, seq->name_alloc);
+        }
+      memcpy (seq->name, line, length);
+      seq->name[length] = '\0';
+      seq->name_length  = length;
+
+      line = saft_fasta_map_lines (end + (end < max), max, '>', seq, &buffer, &buffer_alloc);
+      n_sequences++;
+      if (!func (seq, data))
+        break;
+      start = line;
+    }
+
+  seq->seq = buffer;
+  saft_sequence_free (seq);
+
+  return n_sequences;
+}
+
+/* Same as saft_fasta_iter_mapped, every line of a sequence being fed as it is
+ * parsed */
+static size_t
+saft_fasta_fragments_mapped (const char                   *map,
+                             const char                   *start,
+                             const char                   *max,
+                             const SaftFastaFragmentFuncs *funcs,
+                             void                         *data)
+{
+  const char *prefetched  = start;
+  size_t      n_sequences = 0;
+
+  start = memchr (start, '>', max - start);
+  if (!start)
+    return 0;
+
+  /* start is on the '>' of a header */
+  while (start < max)
+    {
+      const char *line = start + 1;
+      const char *end;
+      int         keep;
+
+      saft_fasta_prefetch (map, start, max, &prefetched);
+
+      end  = memchr (line, '\n', max - line);
+      if (!end)
+        end = max;
+      keep = funcs->begin (line, saft_fasta_line_length (line, end), data);
+      for (line = end + (end < max); line < max && *line != '>'; line = end + (end < max))
+        {
+          size_t length;
+
+          end    = memchr (line, '\n', max - line);
+          if (!end)
+            end = max;
+          length = saft_fasta_line_length (line, end);
+          if (keep && length > 0)
+            funcs->feed (line, length, data);
+        }
+      start = line;
+      if (!keep)
+        continue;
+      n_sequences++;
+      if (!funcs->end (data))
+        break;
+    }
+
+  return n_sequences;
+}
+
+/* The records are a header starting with '@', the lines of the sequence, a
+ * line starting with '+' and the lines of the quality, which are only read
+ * when the bases with a low quality are masked */
+static size_t
+saft_fastq_iter_mapped (const char        *map,
+                        const char        *start,
+                        const char        *max,
+                        unsigned int       min_quality,
+                        SaftFastaIterFunc  func,
+                        void              *data)
+{
+  SaftSequence *seq;
+  const char   *prefetched  = start;
+  char         *buffer;
+  size_t        buffer_alloc;
+  size_t        n_sequences = 0;
+
   seq             = saft_sequence_new ();
   seq->name_alloc = NAME_INIT_SIZE;
-  seq->seq_alloc  = SEQ_INIT_SIZE;
   seq->name       = malloc (seq->name_alloc);
-  seq->seq        = malloc (seq->seq_alloc);
+  buffer_alloc    = SEQ_INIT_SIZE;
+  buffer          = malloc (buffer_alloc);
+
+  while (start < max)
+    {
+      const char *line = start + 1;
+      const char *end;
+      size_t      length;
+      size_t      n_quality;
+
+      /* Blank lines between records */
+      if (*start != '@')
+        {
+          end   = memchr (start, '\n', max - start);
+          start = end ? end + 1 : max;
+          continue;
+        }
+
+      saft_fasta_prefetch (map, start, max, &prefetched);
+
+      end = memchr (line, '\n', max - line);
+      if (!end)
+        end = max;
+      length = saft_fasta_line_length (line, end);
+      if (seq->name_alloc < length + 1)
+        {
+          while (seq->name_alloc < length + 1)
+            seq->name_alloc <<= 1;
+          seq->name = realloc (seq->name, seq->name_alloc);
+        }
+      memcpy (seq->name, line, length);
+      seq->name[length] = '\0';
+      seq->name_length  = length;
+
+      line = saft_fasta_map_lines (end + (end < max), max, '+', seq, &buffer, &buffer_alloc);
+      if (line >= max)
+        {
+          saft_error ("Truncated FASTQ record `%s'", seq->name);
+          break;
+        }
+      end  = memchr (line, '\n', max - line);
+      line = end ? end + 1 : max;
+
+      /* Masked bases cannot be written in the map */
+      if (min_quality > 0 && seq->seq != buffer)
+        {
+          if (buffer_alloc < seq->seq_length + 1)
+            {
+              while (buffer_alloc < seq->seq_length + 1)
+                buffer_alloc <<= 1;
+              buffer = realloc (buffer, buffer_alloc);
+            }
+          memcpy (buffer, seq->seq, seq->seq_length);
+          buffer[seq->seq_length] = '\0';
+          seq->seq                = buffer;
+        }
+      /* The quality can be split on several lines too */
+      for (n_quality = 0; n_quality < seq->seq_length && line < max; line = end + (end < max))
+        {
+          end = memchr (line, '\n', max - line);
+          if (!end)
+            end = max;
+          length = saft_fasta_line_length (line, end);
+          if (length > seq->seq_length - n_quality)
+            length = seq->seq_length - n_quality;
+          if (min_quality > 0)
+            saft_fastq_mask (seq->seq + n_quality, line, length, min_quality);
+          n_quality += length;
+        }
+      if (n_quality < seq->seq_length)
+        {
+          saft_error ("Truncated FASTQ record `%s'", seq->name);
+          break;
+        }
+
+      n_sequences++;
+      if (!func (seq, data))
+        break;
+      start = line;
+    }
+
+  seq->seq = buffer;
+  saft_sequence_free (seq);
+
+  return n_sequences;
+}
+
+/* Returns the length of the line ending at end, leaving out the '\r' of the
+ * "\r\n" line ends. A '\r' is never part of a name or of a sequence, so it
+ * is also left out at the end of the pieces of lines read from streams */
+static inline size_t
+saft_fasta_line_length (const char *line,
+                        const char *end)
+{
+  return end - line - (end > line && end[-1] == '\r');
+}
+
+/* The offsets of prefetched are multiples of the page size */
+static void
+saft_fasta_prefetch (const char  *map,
+                     const char  *start,
+                     const char  *max,
+                     const char **prefetched)
+{
+  size_t length;
+
+  if (start < *prefetched)
+    return;
+
+  *prefetched = map + ((start - map) / MAP_PREFETCH) * MAP_PREFETCH;
+  length      = max - *prefetched < MAP_PREFETCH ? max - *prefetched : MAP_PREFETCH;
+  madvise ((void*)*prefetched, length, MADV_WILLNEED);
+  *prefetched += length;
+}
+
+/* Reads the lines of a sequence up to the first one starting with stop, and
+ * returns the start of that line. A sequence held on a single line is handed
+ * out as a view into the map, the lines of other sequences are joined in the
+ * buffer */
+static const char*
+saft_fasta_map_lines (const char    *line,
+                      const char    *max,
+                      char           stop,
+                      SaftSequence  *seq,
+                      char         **buffer,
+                      size_t        *buffer_alloc)
+{
+  const char *view    = NULL;
+  const char *end;
+  size_t      n_lines = 0;
+
+  seq->seq_length = 0;
+  for (; line < max && *line != stop; line = end + (end < max))
+    {
+      size_t length;
+
+      end = memchr (line, '\n', max - line);
+      if (!end)
+        end = max;
+      length = saft_fasta_line_length (line, end);
+      if (length == 0)
+        continue;
+
+      n_lines++;
+      if (n_lines == 1)
+        {
+          view            = line;
+          seq->seq_length = length;
+          continue;
+        }
+      if (*buffer_alloc < seq->seq_length + length + 1)
+        {
+          while (*buffer_alloc < seq->seq_length + length + 1)
+            *buffer_alloc <<= 1;
+          *buffer = realloc (*buffer, *buffer_alloc);
+        }
+      if (n_lines == 2)
+        memcpy (*buffer, view, seq->seq_length);
+      memcpy (*buffer + seq->seq_length, line, length);
+      seq->seq_length += length;
+    }
+
+  if (n_lines == 1)
+    seq->seq = (char*)view;
+  else
+    {
+      (*buffer)[seq->seq_length] = '\0';
+      seq->seq                   = *buffer;
+    }
+
+  return line;
+}
+
+static void
+saft_fastq_mask (char         *seq,
+                 const char   *quality,
+                 size_t        length,
+                 unsigned int  min_quality)
+{
+  const unsigned int min = min_quality + FASTQ_OFFSET;
+  size_t             i;
+
+  for (i = 0; i < length; i++)
+    if ((unsigned char)quality[i] < min)
+      seq[i] = FASTQ_MASK;
+}
+
+static void
+saft_fasta_iter_stream (SaftFastaSource   *source,
+                        const char        *filename,
+                        unsigned int       min_quality,
+                        SaftFastaIterFunc  func,
+                        void              *data)
+{
+  SaftFastaJoinData  join;
+  ssize_t            status;
+
+  /* FASTQ files are recognised by their first byte */
+  status = saft_fasta_source_next (source);
+  if (status > 0 && source->buffer[0] == '@')
+    {
+      saft_fastq_iter_stream (source, status, filename, min_quality, func, data);
+      return;
+    }
+
+  join.func            = func;
+  join.data            = data;
+  join.seq             = saft_sequence_new ();
+  join.seq->name_alloc = NAME_INIT_SIZE;
+  join.seq->seq_alloc  = SEQ_INIT_SIZE;
+  join.seq->name       = malloc (join.seq->name_alloc);
+  join.seq->seq        = malloc (join.seq->seq_alloc);
+
+  saft_fasta_fragments_stream (source, status, filename, &saft_fasta_join_funcs, &join);
+  saft_sequence_free (join.seq);
+}
+
+static int
+saft_fasta_join_begin (const char *name,
+                       size_t      name_length,
+                       void       *data)
+{
+  SaftSequence *seq = ((SaftFastaJoinData*)data)->seq;
+
+  /* Check against name_length + 1 to make room for the terminating '\0' */
+  if (seq->name_alloc < name_length + 1)
+    {
+      while (seq->name_alloc < name_length + 1)
+        seq->name_alloc <<= 1;
+      seq->name = realloc (seq->name, seq->name_alloc);
+    }
+  memcpy (seq->name, name, name_length);
+  seq->name[name_length] = '\0';
+  seq->name_length       = name_length;
+  seq->seq_length        = 0;
+
+  return 1;
+}
+
+static void
+saft_fasta_join_feed (const char *letters,
+                      size_t      length,
+                      void       *data)
+{
+  SaftSequence *seq = ((SaftFastaJoinData*)data)->seq;
+
+  /* Check against length + 1 to make room for the terminating '\0' */
+  if (seq->seq_alloc < seq->seq_length + length + 1)
+    {
+      while (seq->seq_alloc < seq->seq_length + length + 1)
+        seq->seq_alloc <<= 1;
+      seq->seq = realloc (seq->seq, seq->seq_alloc);
+    }
+  memcpy (seq->seq + seq->seq_length, letters, length);
+  seq->seq_length += length;
+}
+
+static int
+saft_fasta_join_end (void *data)
+{
+  SaftFastaJoinData *join = data;
 
-  while ((status = read (in, buffer, READ_CHUNK)) > 0)
+  join->seq->seq[join->seq->seq_length] = '\0';
+
+  return join->func (join->seq, join->data);
+}
+
+/* The source's buffer holds the first status bytes of the data, and then the
+ * following blocks. A header is handed to begin once it is complete */
+static size_t
+saft_fasta_fragments_stream (SaftFastaSource              *source,
+                             ssize_t                       status,
+                             const char                   *filename,
+                             const SaftFastaFragmentFuncs *funcs,
+                             void                         *data)
+{
+  char    *name;
+  size_t   name_alloc  = NAME_INIT_SIZE;
+  size_t   name_length = 0;
+  size_t   n_sequences = 0;
+  char     in_header   = 0;
+  char     started     = 0;
+  int      keep        = 0;
+
+  name = malloc (name_alloc);
+  for (; status > 0; status = saft_fasta_source_next (source))
     {
-      char *max = buffer + status;
+      char *buffer = source->buffer;
+      char *max    = buffer + status;
       char *start;
 
       start = buffer;
       if (!started)
         {
-          start = memchr (buffer, '>', READ_CHUNK);
+          start = memchr (buffer, '>', status);
           if (!start)
             continue;
 
@@ -132,7 +1622,6 @@ saft_fasta_iter (const char        *filename,
 
       while (start < max)
         {
-          /* TODO handle '\r' */
           char   *end = memchr (start, '\n', max - start);
           size_t  size;
           int     has_eol = 0;
@@ -141,69 +1630,188 @@ saft_fasta_iter (const char        *filename,
             has_eol = 1;
           else
             end = max;
-          size = end - start;
-          if (size == 0)
-            {
-              start = end + 1;
-              continue;
-            }
+          size = saft_fasta_line_length (start, end);
 
           if (in_header)
             {
-              /* Check against size + 1 to make room for the terminating '\0' */
-              if (seq->name_alloc < seq->name_length + size + 1)
+              if (name_alloc < name_length + size)
                 {
-                  while (seq->name_alloc < seq->name_length + size)
-                    seq->name_alloc <<= 1;
-                  seq->name = realloc (seq->name, seq->name_alloc);
+                  while (name_alloc < name_length + size)
+                    name_alloc <<= 1;
+                  name = realloc (name, name_alloc);
                 }
+              memcpy (name + name_length, start, size);
+              name_length += size;
               if (has_eol)
+                {
                   in_header = 0;
-              memcpy (seq->name + seq->name_length, start, size);
-              seq->name_length += size;
+                  keep      = funcs->begin (name, name_length, data);
+                  n_sequences += keep != 0;
+                }
             }
-          else
+          else if (*start == '>')
             {
-              if (*start == '>')
+              if (keep && !funcs->end (data))
                 {
-                  seq->name[seq->name_length] = '\0';
-                  seq->seq[seq->seq_length]   = '\0';
-                  if(!func (seq, data))
-                    {
-                      saft_sequence_free (seq);
-                      /* TODO print an error message */
-                      close(in);
-                      return;
-                    }
-                  seq->name_length = 0;
-                  seq->seq_length  = 0;
-                  ++start;
-                  in_header = 1;
-                  continue;
+                  free (name);
+                  return n_sequences;
                 }
-              /* Check against size + 1 to make room for the terminating '\0' */
-              if (seq->seq_alloc < seq->seq_length + size + 1)
+              keep        = 0;
+              name_length = 0;
+              in_header   = 1;
+              ++start;
+              continue;
+            }
+          else if (keep && size > 0)
+            funcs->feed (start, size, data);
+          start = end + 1;
+        }
+    }
+  if (status == -1)
+    saft_error ("An IO error occured while reading `%s'", filename);
+  if (in_header)
+    {
+      keep = funcs->begin (name, name_length, data);
+      n_sequences += keep != 0;
+    }
+  if (keep)
+    funcs->end (data);
+  free (name);
+
+  return n_sequences;
+}
+
+typedef enum
+{
+  FASTQ_START,
+  FASTQ_HEADER,
+  FASTQ_SEQ,
+  FASTQ_PLUS,
+  FASTQ_QUALITY
+}
+SaftFastqState;
+
+/* The source's buffer holds the first status bytes of the data, and then the
+ * following blocks. The records are parsed as they arrive, and a record is
+ * handed out as soon as its last quality line is read */
+static void
+saft_fastq_iter_stream (SaftFastaSource   *source,
+                        ssize_t            status,
+                        const char        *filename,
+                        unsigned int       min_quality,
+                        SaftFastaIterFunc  func,
+                        void              *data)
+{
+  SaftSequence   *seq;
+  SaftFastqState  state      = FASTQ_START;
+  size_t          n_quality  = 0;
+  int             line_start = 1;
+
+  seq             = saft_sequence_new ();
+  seq->name_alloc = NAME_INIT_SIZE;
+  seq->seq_alloc  = SEQ_INIT_SIZE;
+  seq->name       = malloc (seq->name_alloc);
+  seq->seq        = malloc (seq->seq_alloc);
+
+  for (; status > 0; status = saft_fasta_source_next (source))
+    {
+      char *start = source->buffer;
+      char *max   = source->buffer + status;
+
+      while (start < max)
+        {
+          char   *end;
+          size_t  size;
+
+          if (state == FASTQ_START)
+            {
+              /* Blank lines between records */
+              if (*start == '@')
                 {
-                  while (seq->seq_alloc < seq->seq_length + size)
-                    seq->seq_alloc <<= 1;
-                  seq->seq = realloc (seq->seq, seq->seq_alloc);
+                  seq->name_length = 0;
+                  seq->seq_length  = 0;
+                  state            = FASTQ_HEADER;
                 }
-              memcpy (seq->seq + seq->seq_length, start, size);
-              seq->seq_length += size;
+              ++start;
+              continue;
             }
-          start = end + 1;
+          if (state == FASTQ_SEQ && line_start && *start == '+')
+            state = FASTQ_PLUS;
+
+          end = memchr (start, '\n', max - start);
+          if (!end)
+            end = max;
+          size = saft_fasta_line_length (start, end);
+
+          switch (state)
+            {
+              case FASTQ_HEADER:
+                  /* Check against size + 1 to make room for the terminating '\0' */
+                  if (seq->name_alloc < seq->name_length + size + 1)
+                    {
+                      while (seq->name_alloc < seq->name_length + size + 1)
+                        seq->name_alloc <<= 1;
+                      seq->name = realloc (seq->name, seq->name_alloc);
+                    }
+                  memcpy (seq->name + seq->name_length, start, size);
+                  seq->name_length += size;
+                  if (end < max)
+                    state = FASTQ_SEQ;
+                  break;
+              case FASTQ_SEQ:
+                  if (seq->seq_alloc < seq->seq_length + size + 1)
+                    {
+                      while (seq->seq_alloc < seq->seq_length + size + 1)
+                        seq->seq_alloc <<= 1;
+                      seq->seq = realloc (seq->seq, seq->seq_alloc);
+                    }
+                  memcpy (seq->seq + seq->seq_length, start, size);
+                  seq->seq_length += size;
+                  break;
+              case FASTQ_PLUS:
+                  if (end < max)
+                    {
+                      state     = FASTQ_QUALITY;
+                      n_quality = 0;
+                    }
+                  break;
+              default:
+                  /* FASTQ_QUALITY */
+                  if (size > seq->seq_length - n_quality)
+                    size = seq->seq_length - n_quality;
+                  if (min_quality > 0)
+                    saft_fastq_mask (seq->seq + n_quality, start, size, min_quality);
+                  n_quality += size;
+                  if (end < max && n_quality == seq->seq_length)
+                    {
+                      seq->name[seq->name_length] = '\0';
+                      seq->seq[seq->seq_length]   = '\0';
+                      if (!func (seq, data))
+                        {
+                          saft_sequence_free (seq);
+                          return;
+                        }
+                      state = FASTQ_START;
+                    }
+                  break;
+            }
+          line_start = end < max;
+          start      = end + 1;
         }
     }
   if (status == -1)
     saft_error ("An IO error occured while reading `%s'", filename);
-  if (started)
+
+  /* The last quality line may not end with a '\n' */
+  if (state == FASTQ_QUALITY && n_quality == seq->seq_length)
     {
       seq->name[seq->name_length] = '\0';
       seq->seq[seq->seq_length]   = '\0';
       func (seq, data);
-      saft_sequence_free (seq);
     }
-  close (in);
+  else if (state != FASTQ_START)
+    saft_error ("Truncated FASTQ record in `%s'", filename);
+  saft_sequence_free (seq);
 }
 
 /* vim:ft=c:expandtab:sw=4:ts=4:sts=4:cinoptions={.5s^-2n-2(0:
@@ -22,6 +22,10 @@
 #ifndef __SAFT_FASTA_H__
 #define __SAFT_FASTA_H__
 
+#include <stddef.h>
+#include <stdint.h>
+
+#include <saftpool.h>
 #include <saftsequence.h>
 
 #ifdef __cplusplus
@@ -32,12 +36,121 @@ extern "C"
 typedef int    (*SaftFastaIterFunc) (SaftSequence      *sequence,
                                      void              *data);
 
-SaftSequence** saft_fasta_read      (const char        *filename,
-                                     unsigned int      *n);
+/* How the files are read. The functions taking options accept NULL, which
+ * stands for a single thread and all the bases kept */
+typedef struct _SaftFastaOptions SaftFastaOptions;
 
-void           saft_fasta_iter      (const char        *filename,
-                                     SaftFastaIterFunc  func,
-                                     void              *data);
+struct _SaftFastaOptions
+{
+  /* Threads decompressing BGZF files */
+  unsigned int n_threads;
+  /* Quality (Phred score, encoded with an offset of 33) below which the
+   * bases of FASTQ reads are replaced by 'N', 0 keeping all the bases */
+  unsigned int min_quality;
+};
+
+SaftSequence** saft_fasta_read      (const char             *filename,
+                                     const SaftFastaOptions *options,
+                                     unsigned int           *n);
+
+/* Reads the sequences from a file descriptor, which is left open */
+SaftSequence** saft_fasta_read_fd   (int                     fd,
+                                     const SaftFastaOptions *options,
+                                     unsigned int           *n);
+
+/* The sequence given to func is only valid during the call. Uncompressed
+ * regular files are mapped in memory, and the sequence can then point
+ * directly into the file: use seq_length, as seq is not always terminated by
+ * a '\0'. gzip and BGZF files are decompressed on the fly. The filename `-'
+ * stands for the standard input. Files starting with a '@' are read as
+ * FASTQ, the name of a read being its header without the '@' */
+void           saft_fasta_iter      (const char             *filename,
+                                     const SaftFastaOptions *options,
+                                     SaftFastaIterFunc       func,
+                                     void                   *data);
+
+/* Same as saft_fasta_iter, the descriptor being left open. Pipes and sockets
+ * are read as the data arrives: func is called on a sequence as soon as the
+ * header of the next one, or the end of the input, is read */
+void           saft_fasta_iter_fd   (int                     fd,
+                                     const SaftFastaOptions *options,
+                                     SaftFastaIterFunc       func,
+                                     void                   *data);
+
+/* Only calls func on the sequences whose header starts in [start, end),
+ * and returns their number. Only works on uncompressed regular FASTA files,
+ * which need no options */
+size_t         saft_fasta_iter_range (const char        *filename,
+                                      uint64_t           start,
+                                      uint64_t           end,
+                                      SaftFastaIterFunc  func,
+                                      void              *data);
+
+/* range is the index of the part of the file the sequence comes from, and
+ * thread that of the thread of the pool parsing it */
+typedef int    (*SaftFastaParallelFunc) (SaftSequence      *sequence,
+                                         size_t             range,
+                                         unsigned int       thread,
+                                         void              *data);
+
+/* Splits the file in n_ranges parts starting on a header, parsed
+ * concurrently by the threads of the pool. The sequences of a range are
+ * given in the order of the file, hence the original order is kept by
+ * concatenating what was gathered for each range in the order of the ranges.
+ * func returning 0 only stops the parsing of its range. Files that cannot be
+ * mapped in memory are parsed as a single range by the calling thread */
+void           saft_fasta_iter_parallel (const char             *filename,
+                                         const SaftFastaOptions *options,
+                                         SaftPool               *pool,
+                                         size_t                  n_ranges,
+                                         SaftFastaParallelFunc   func,
+                                         void                   *data);
+
+/* Only calls func on the sequences whose rank in the file, modulo n_shards,
+ * is shard, and returns the number of such sequences. If the file has an
+ * up to date index (see saftfastaindex.h), the shards are instead runs of
+ * consecutive sequences holding about the same number of letters */
+size_t         saft_fasta_iter_shard (const char             *filename,
+                                      const SaftFastaOptions *options,
+                                      unsigned int            shard,
+                                      unsigned int            n_shards,
+                                      SaftFastaIterFunc       func,
+                                      void                   *data);
+
+/* Sequences can also be read as fragments, so that their letters can be used
+ * as they are parsed, without ever being joined in memory */
+typedef struct _SaftFastaFragmentFuncs SaftFastaFragmentFuncs;
+
+struct _SaftFastaFragmentFuncs
+{
+  /* Called on the header of every sequence, the name is not terminated by a
+   * '\0'. Returning 0 skips the sequence */
+  int  (*begin) (const char *name,
+                 size_t      name_length,
+                 void       *data);
+  /* Called on consecutive pieces of the letters of the sequence, which are
+   * only valid during the call and never hold a line break */
+  void (*feed)  (const char *letters,
+                 size_t      length,
+                 void       *data);
+  /* Called at the end of the sequence. Returning 0 stops the iteration */
+  int  (*end)   (void       *data);
+};
+
+/* Same as saft_fasta_iter, and returns the number of sequences that were not
+ * skipped. The reads of FASTQ files are fed in one piece */
+size_t         saft_fasta_iter_fragments       (const char                   *filename,
+                                                const SaftFastaOptions       *options,
+                                                const SaftFastaFragmentFuncs *funcs,
+                                                void                         *data);
+
+/* Same as saft_fasta_iter_shard, for fragments */
+size_t         saft_fasta_iter_shard_fragments (const char                   *filename,
+                                                const SaftFastaOptions       *options,
+                                                unsigned int                  shard,
+                                                unsigned int                  n_shards,
+                                                const SaftFastaFragmentFuncs *funcs,
+                                                void                         *data);
 
 #ifdef __cplusplus
 }
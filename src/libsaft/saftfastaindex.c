@@ -0,0 +1,444 @@
+/* saftfastaindex.c
+ * Copyright (C) 2008  Sylvain FORET
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *                                                                       
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *                                                                       
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ *
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "safterror.h"
+#include "saftfastaindex.h"
+
+#define RECORDS_CHUNK  256
+#define FETCH_CHUNK    (1 << 16)
+/* Length of the line ending at end, without the '\r' of a "\r\n" line end,
+ * as read by saft_fasta_iter */
+#define SAFT_LINE_LENGTH(line, end) ((size_t)((end) - (line)) - ((end) > (line) && (end)[-1] == '\r'))
+
+
+static SaftFastaIndex*  saft_fasta_index_new        (const char     *filename);
+
+static SaftFastaRecord* saft_fasta_index_add        (SaftFastaIndex *index);
+
+static char*            saft_fasta_index_path       (const char     *filename);
+
+static size_t           saft_fasta_index_boundary   (SaftFastaIndex *index,
+                                                     unsigned int    part,
+                                                     unsigned int    n_parts);
+
+
+SaftFastaIndex*
+saft_fasta_index_build (const char *filename)
+{
+  SaftFastaIndex *index;
+  struct stat     st;
+  const char     *map   = NULL;
+  const char     *max;
+  const char     *start = NULL;
+  int             in;
+
+  if ((in = open (filename, O_RDONLY)) == -1)
+    {
+      saft_error ("Couldn't open `%s'", filename);
+      return NULL;
+    }
+  if (fstat (in, &st) == -1 || !S_ISREG (st.st_mode))
+    {
+      saft_error ("`%s' is not a regular file", filename);
+      close (in);
+      return NULL;
+    }
+  if (st.st_size > 0)
+    {
+      unsigned char magic[2];
+
+      if (pread (in, magic, sizeof (magic), 0) == sizeof (magic) &&
+          magic[0] == 0x1f && magic[1] == 0x8b)
+        {
+          saft_error ("Compressed files like `%s' cannot be indexed", filename);
+          close (in);
+          return NULL;
+        }
+      if (magic[0] == '@')
+        {
+          saft_error ("FASTQ files like `%s' cannot be indexed", filename);
+          close (in);
+          return NULL;
+        }
+      map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, in, 0);
+      if (map == MAP_FAILED)
+        {
+          saft_error ("Couldn't map `%s'", filename);
+          close (in);
+          return NULL;
+        }
+      madvise ((void*)map, st.st_size, MADV_SEQUENTIAL);
+      start = memchr (map, '>', st.st_size);
+    }
+  max   = map + st.st_size;
+  index = saft_fasta_index_new (filename);
+
+  /* The sequences are delimited as in saft_fasta_iter */
+  while (start && start < max)
+    {
+      SaftFastaRecord *record = saft_fasta_index_add (index);
+      const char      *line   = start + 1;
+      const char      *end;
+      size_t           previous = 0;
+      size_t           n_lines  = 0;
+      int              regular  = 1;
+      int              gap      = 0;
+
+      end = memchr (line, '\n', max - line);
+      if (!end)
+        end = max;
+      record->name   = strndup (line, SAFT_LINE_LENGTH (line, end));
+      record->offset = end + (end < max) - map;
+
+      for (line = end + (end < max); line < max && *line != '>'; line = end + (end < max))
+        {
+          size_t length;
+
+          end = memchr (line, '\n', max - line);
+          if (!end)
+            end = max;
+          length = SAFT_LINE_LENGTH (line, end);
+          if (length == 0)
+            {
+              gap = n_lines > 0;
+              continue;
+            }
+
+          if (n_lines == 0)
+            {
+              record->offset       = line - map;
+              record->line_letters = length;
+              record->line_bytes   = end + (end < max) - line;
+            }
+          /* Only the last line can be shorter than the others */
+          else if (gap || previous != record->line_letters || length > record->line_letters)
+            regular = 0;
+          record->length += length;
+          previous        = length;
+          n_lines++;
+        }
+      if (!regular)
+        {
+          record->line_letters = 0;
+          record->line_bytes   = 0;
+        }
+      index->length += record->length;
+      start          = line;
+    }
+
+  if (map)
+    munmap ((void*)map, st.st_size);
+  close (in);
+
+  return index;
+}
+
+SaftFastaIndex*
+saft_fasta_index_load (const char *filename)
+{
+  SaftFastaIndex *index;
+  struct stat     st;
+  struct stat     index_st;
+  FILE           *stream;
+  char           *path;
+  char           *line   = NULL;
+  size_t          size   = 0;
+  unsigned long   lineno = 0;
+  int             error  = 0;
+
+  path = saft_fasta_index_path (filename);
+  if (stat (filename, &st) == -1 ||
+      stat (path, &index_st) == -1 ||
+      index_st.st_mtime < st.st_mtime ||
+      !(stream = fopen (path, "r")))
+    {
+      free (path);
+      return NULL;
+    }
+
+  index = saft_fasta_index_new (filename);
+  while (getline (&line, &size, stream) != -1)
+    {
+      SaftFastaRecord *record;
+      char            *fields = line + strlen (line);
+      int              n_tabs = 0;
+
+      lineno++;
+      /* The name can hold tabs, the fields are read from the end */
+      while (fields > line && n_tabs < 4)
+        if (*--fields == '\t')
+          n_tabs++;
+      if (n_tabs < 4)
+        {
+          error = 1;
+          break;
+        }
+
+      record = saft_fasta_index_add (index);
+      if (sscanf (fields, "\t%" SCNu64 "\t%" SCNu64 "\t%u\t%u",
+                  &record->length,
+                  &record->offset,
+                  &record->line_letters,
+                  &record->line_bytes) != 4)
+        {
+          error = 1;
+          break;
+        }
+      record->name   = strndup (line, fields - line);
+      index->length += record->length;
+    }
+  if (error || ferror (stream))
+    {
+      saft_error ("`%s' line %lu: malformed index", path, lineno);
+      saft_fasta_index_free (index);
+      index = NULL;
+    }
+
+  if (line)
+    free (line);
+  fclose (stream);
+  free (path);
+
+  return index;
+}
+
+int
+saft_fasta_index_write (SaftFastaIndex *index)
+{
+  FILE   *stream;
+  char   *path;
+  size_t  i;
+  int     ret = 0;
+
+  path = saft_fasta_index_path (index->filename);
+  if (!(stream = fopen (path, "w")))
+    {
+      saft_error ("Couldn't open `%s'", path);
+      free (path);
+      return 1;
+    }
+
+  for (i = 0; i < index->n_records; i++)
+    fprintf (stream, "%s\t%" PRIu64 "\t%" PRIu64 "\t%u\t%u\n",
+             index->records[i].name,
+             index->records[i].length,
+             index->records[i].offset,
+             index->records[i].line_letters,
+             index->records[i].line_bytes);
+
+  if (ferror (stream) | fclose (stream))
+    {
+      saft_error ("An IO error occured while writing `%s'", path);
+      ret = 1;
+    }
+  free (path);
+
+  return ret;
+}
+
+void
+saft_fasta_index_free (SaftFastaIndex *index)
+{
+  size_t i;
+
+  if (!index)
+    return;
+
+  for (i = 0; i < index->n_records; i++)
+    if (index->records[i].name)
+      free (index->records[i].name);
+  if (index->records)
+    free (index->records);
+  if (index->fd != -1)
+    close (index->fd);
+  free (index->filename);
+  free (index);
+}
+
+SaftSequence*
+saft_fasta_index_fetch (SaftFastaIndex *index,
+                        size_t          rank)
+{
+  SaftFastaRecord *record;
+  SaftSequence    *seq;
+  char            *buffer;
+  size_t           chunk = FETCH_CHUNK;
+  off_t            offset;
+
+  if (rank >= index->n_records)
+    return NULL;
+  if (index->fd == -1 && (index->fd = open (index->filename, O_RDONLY)) == -1)
+    {
+      saft_error ("Couldn't open `%s'", index->filename);
+      return NULL;
+    }
+
+  record           = index->records + rank;
+  seq              = saft_sequence_new ();
+  seq->name        = strdup (record->name);
+  seq->name_length = strlen (record->name);
+  seq->name_alloc  = seq->name_length + 1;
+  seq->seq_alloc   = record->length + 1;
+  seq->seq         = malloc (seq->seq_alloc);
+
+  /* With regular lines, the sequence is read at once */
+  if (record->line_letters > 0 && record->length > 0)
+    chunk = record->length + (record->length - 1) / record->line_letters *
+                             (record->line_bytes - record->line_letters);
+  buffer = malloc (chunk);
+  offset = record->offset;
+
+  while (seq->seq_length < record->length)
+    {
+      const char *start;
+      const char *max;
+      ssize_t     status;
+
+      status = pread (index->fd, buffer, chunk, offset);
+      if (status <= 0)
+        {
+          saft_error ("An IO error occured while reading `%s'", index->filename);
+          saft_sequence_free (seq);
+          seq = NULL;
+          break;
+        }
+      offset += status;
+
+      for (start = buffer, max = buffer + status; start < max && seq->seq_length < record->length; )
+        {
+          const char *end = memchr (start, '\n', max - start);
+          size_t      size;
+
+          if (!end)
+            end = max;
+          size = SAFT_LINE_LENGTH (start, end);
+          if (size > record->length - seq->seq_length)
+            size = record->length - seq->seq_length;
+          memcpy (seq->seq + seq->seq_length, start, size);
+          seq->seq_length += size;
+          start            = end + (end < max);
+        }
+    }
+  if (seq)
+    seq->seq[seq->seq_length] = '\0';
+  free (buffer);
+
+  return seq;
+}
+
+void
+saft_fasta_index_split (SaftFastaIndex *index,
+                        unsigned int    part,
+                        unsigned int    n_parts,
+                        size_t         *first,
+                        size_t         *last)
+{
+  *first = saft_fasta_index_boundary (index, part, n_parts);
+  *last  = saft_fasta_index_boundary (index, part + 1, n_parts);
+}
+
+/* A sequence goes to the part holding its middle letter */
+static size_t
+saft_fasta_index_boundary (SaftFastaIndex *index,
+                           unsigned int    part,
+                           unsigned int    n_parts)
+{
+  uint64_t letters = 0;
+  double   target;
+  size_t   i;
+
+  if (part == 0)
+    return 0;
+  if (part >= n_parts)
+    return index->n_records;
+  if (index->length == 0)
+    return index->n_records * part / n_parts;
+
+  target = (double)index->length * part / n_parts;
+  for (i = 0; i < index->n_records; i++)
+    {
+      if (letters + index->records[i].length / 2.0 >= target)
+        break;
+      letters += index->records[i].length;
+    }
+
+  return i;
+}
+
+static SaftFastaIndex*
+saft_fasta_index_new (const char *filename)
+{
+  SaftFastaIndex *index;
+
+  index            = malloc (sizeof (*index));
+  index->filename  = strdup (filename);
+  index->records   = NULL;
+  index->n_records = 0;
+  index->length    = 0;
+  index->fd        = -1;
+
+  return index;
+}
+
+static SaftFastaRecord*
+saft_fasta_index_add (SaftFastaIndex *index)
+{
+  SaftFastaRecord *record;
+
+  if (index->n_records % RECORDS_CHUNK == 0)
+    index->records = realloc (index->records,
+                              (index->n_records + RECORDS_CHUNK) * sizeof (*index->records));
+  record               = index->records + index->n_records;
+  record->name         = NULL;
+  record->length       = 0;
+  record->offset       = 0;
+  record->line_letters = 0;
+  record->line_bytes   = 0;
+  index->n_records++;
+
+  return record;
+}
+
+static char*
+saft_fasta_index_path (const char *filename)
+{
+  char *path;
+
+  path = malloc (strlen (filename) + sizeof (SAFT_FASTA_INDEX_SUFFIX));
+  strcpy (path, filename);
+  strcat (path, SAFT_FASTA_INDEX_SUFFIX);
+
+  return path;
+}
+
+/* vim:ft=c:expandtab:sw=4:ts=4:sts=4:cinoptions={.5s^-2n-2(0:
+ */
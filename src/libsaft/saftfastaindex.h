@@ -0,0 +1,104 @@
+/* saftfastaindex.h
+ * Copyright (C) 2008  Sylvain FORET
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *                                                                       
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *                                                                       
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Index of the sequences of a FASTA file, in the spirit of the .fai files of
+ * samtools. The index is a text file named after the FASTA file with the
+ * SAFT_FASTA_INDEX_SUFFIX suffix, with one line per sequence:
+ *
+ *   NAME<TAB>LENGTH<TAB>OFFSET<TAB>LINE_LETTERS<TAB>LINE_BYTES
+ *
+ * NAME is the whole header, as given by saft_fasta_iter, OFFSET that of the
+ * first letter of the sequence in the file, and LINE_LETTERS and LINE_BYTES
+ * the number of letters and of bytes of every line but the last one. Both
+ * are 0 when the lines of the sequence are not all of the same length.
+ */
+
+#ifndef __SAFT_FASTA_INDEX_H__
+#define __SAFT_FASTA_INDEX_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <saftsequence.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define SAFT_FASTA_INDEX_SUFFIX ".sfai"
+
+typedef struct _SaftFastaRecord SaftFastaRecord;
+
+struct _SaftFastaRecord
+{
+  char         *name;
+  uint64_t      length;
+  uint64_t      offset;
+  unsigned int  line_letters;
+  unsigned int  line_bytes;
+};
+
+typedef struct _SaftFastaIndex SaftFastaIndex;
+
+struct _SaftFastaIndex
+{
+  char            *filename;
+  SaftFastaRecord *records;
+  size_t           n_records;
+  /* Total number of letters of the file */
+  uint64_t         length;
+
+  /* Only opened to fetch sequences */
+  int              fd;
+};
+
+/* Parses the whole file */
+SaftFastaIndex* saft_fasta_index_build  (const char     *filename);
+
+/* Returns NULL if the index of the file does not exist, or is older than
+ * the file */
+SaftFastaIndex* saft_fasta_index_load   (const char     *filename);
+
+/* Writes the index next to the file it indexes, and returns 0 on success */
+int             saft_fasta_index_write  (SaftFastaIndex *index);
+
+void            saft_fasta_index_free   (SaftFastaIndex *index);
+
+/* Reads the sequence of the given rank in the file without parsing the
+ * sequences before it */
+SaftSequence*   saft_fasta_index_fetch  (SaftFastaIndex *index,
+                                         size_t          rank);
+
+/* Splits the sequences in n_parts runs of consecutive sequences holding as
+ * many letters as possible, and returns in [*first, *last) the ranks of the
+ * sequences of the given part */
+void            saft_fasta_index_split  (SaftFastaIndex *index,
+                                         unsigned int    part,
+                                         unsigned int    n_parts,
+                                         size_t         *first,
+                                         size_t         *last);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __SAFT_FASTA_INDEX_H__ */
+
+/* vim:ft=c:expandtab:sw=4:ts=4:sts=4:cinoptions={.5s^-2n-2(0:
+ */
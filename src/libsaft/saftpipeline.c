@@ -0,0 +1,395 @@
+/* saftpipeline.c
+ * Copyright (C) 2008  Sylvain FORET
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *                                                                       
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *                                                                       
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ *
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "safterror.h"
+#include "saftfasta.h"
+#include "saftpipeline.h"
+#include "saftqueue.h"
+
+/* A batch is sent down the pipeline when either limit is reached */
+#define PIPELINE_BATCH_SEQS     256
+#define PIPELINE_BATCH_BASES    (1 << 20)
+/* Number of batches allowed in the pipeline, per worker */
+#define PIPELINE_BATCHES_PER_WORKER 4
+
+
+typedef struct _SaftPipelineWorker SaftPipelineWorker;
+
+struct _SaftPipelineWorker
+{
+  SaftPipeline *pipeline;
+  pthread_t     thread;
+  unsigned int  index;
+};
+
+struct _SaftPipeline
+{
+  /* Current run */
+  const char             *filename;
+  const SaftFastaOptions *options;
+  unsigned int            shard;
+  unsigned int            n_shards;
+  size_t                  n_sequences;
+  SaftPipelineWorkFunc    work;
+  SaftPipelineOutputFunc  output;
+  void                   *data;
+
+  SaftQueue              *input;
+  SaftQueue              *results;
+
+  /* Batch being filled by the reader */
+  SaftSequenceBatch      *batch;
+  size_t                  batch_bases;
+
+  /* Sequences put in batches so far */
+  size_t                  n_batched;
+  /* Batches that were read, and written out, so far */
+  size_t                  n_read;
+  size_t                  n_written;
+  size_t                  max_batches;
+
+  /* Batches that are done but wait for a previous one, indexed by rank */
+  SaftSequenceBatch     **pending;
+
+  SaftPipelineWorker     *workers;
+  pthread_t               reader;
+  unsigned int            n_workers;
+
+  /* The threads wait for the next run on start_cond, and the reader for the
+   * output to catch up on written_cond */
+  pthread_mutex_t         mutex;
+  pthread_cond_t          start_cond;
+  pthread_cond_t          written_cond;
+  unsigned long           generation;
+
+  unsigned int            quit: 1;
+};
+
+
+static void*              saft_pipeline_reader_main (void              *data);
+
+static int                saft_pipeline_read        (SaftSequence      *sequence,
+                                                     void              *data);
+
+static void               saft_pipeline_send        (SaftPipeline      *pipeline);
+
+static void*              saft_pipeline_worker_main (void              *data);
+
+static SaftSequenceBatch* saft_sequence_batch_new   (size_t             index,
+                                                     size_t             first);
+
+static void               saft_sequence_batch_free  (SaftSequenceBatch *batch);
+
+
+SaftPipeline*
+saft_pipeline_new (unsigned int n_workers)
+{
+  SaftPipeline *pipeline;
+  unsigned int  i;
+
+  if (n_workers < 1)
+    n_workers = 1;
+
+  pipeline              = malloc (sizeof (*pipeline));
+  pipeline->filename    = NULL;
+  pipeline->n_sequences = 0;
+  pipeline->batch       = NULL;
+  pipeline->n_workers   = n_workers;
+  pipeline->max_batches = PIPELINE_BATCHES_PER_WORKER * n_workers;
+  pipeline->input       = saft_queue_new (pipeline->max_batches);
+  /* The workers also send one end marker each */
+  pipeline->results     = saft_queue_new (pipeline->max_batches + n_workers);
+  pipeline->pending     = calloc (pipeline->max_batches, sizeof (*pipeline->pending));
+  pipeline->generation  = 0;
+  pipeline->quit        = 0;
+
+  pthread_mutex_init (&pipeline->mutex, NULL);
+  pthread_cond_init (&pipeline->start_cond, NULL);
+  pthread_cond_init (&pipeline->written_cond, NULL);
+
+  pipeline->workers = malloc (n_workers * sizeof (*pipeline->workers));
+  for (i = 0; i < n_workers; i++)
+    {
+      pipeline->workers[i].pipeline = pipeline;
+      pipeline->workers[i].index    = i;
+      if (pthread_create (&pipeline->workers[i].thread, NULL, saft_pipeline_worker_main, pipeline->workers + i))
+        {
+          saft_error ("Could not start pipeline thread");
+          exit (1);
+        }
+    }
+  if (pthread_create (&pipeline->reader, NULL, saft_pipeline_reader_main, pipeline))
+    {
+      saft_error ("Could not start pipeline thread");
+      exit (1);
+    }
+
+  return pipeline;
+}
+
+void
+saft_pipeline_free (SaftPipeline *pipeline)
+{
+  unsigned int i;
+
+  if (!pipeline)
+    return;
+
+  pthread_mutex_lock (&pipeline->mutex);
+  pipeline->quit = 1;
+  pthread_cond_broadcast (&pipeline->start_cond);
+  pthread_mutex_unlock (&pipeline->mutex);
+
+  pthread_join (pipeline->reader, NULL);
+  for (i = 0; i < pipeline->n_workers; i++)
+    pthread_join (pipeline->workers[i].thread, NULL);
+
+  pthread_cond_destroy (&pipeline->written_cond);
+  pthread_cond_destroy (&pipeline->start_cond);
+  pthread_mutex_destroy (&pipeline->mutex);
+  free (pipeline->workers);
+  free (pipeline->pending);
+  saft_queue_free (pipeline->results);
+  saft_queue_free (pipeline->input);
+  free (pipeline);
+}
+
+size_t
+saft_pipeline_run (SaftPipeline            *pipeline,
+                   const char              *filename,
+                   const SaftFastaOptions  *options,
+                   unsigned int             shard,
+                   unsigned int             n_shards,
+                   SaftPipelineWorkFunc     work,
+                   SaftPipelineOutputFunc   output,
+                   void                    *data)
+{
+  unsigned int n_done = 0;
+
+  pipeline->filename    = filename;
+  pipeline->options     = options;
+  pipeline->shard       = shard;
+  pipeline->n_shards    = n_shards;
+  pipeline->n_sequences = 0;
+  pipeline->work        = work;
+  pipeline->output      = output;
+  pipeline->data        = data;
+  pipeline->batch       = NULL;
+  pipeline->batch_bases = 0;
+  pipeline->n_batched   = 0;
+  pipeline->n_read      = 0;
+  pipeline->n_written   = 0;
+
+  pthread_mutex_lock (&pipeline->mutex);
+  pipeline->generation++;
+  pthread_cond_broadcast (&pipeline->start_cond);
+  pthread_mutex_unlock (&pipeline->mutex);
+
+  while (n_done < pipeline->n_workers)
+    {
+      SaftSequenceBatch *batch = saft_queue_pop (pipeline->results);
+
+      if (!batch)
+        {
+          n_done++;
+          continue;
+        }
+      pipeline->pending[batch->index % pipeline->max_batches] = batch;
+
+      while ((batch = pipeline->pending[pipeline->n_written % pipeline->max_batches]))
+        {
+          pipeline->pending[pipeline->n_written % pipeline->max_batches] = NULL;
+          output (batch, data);
+          saft_sequence_batch_free (batch);
+
+          pthread_mutex_lock (&pipeline->mutex);
+          pipeline->n_written++;
+          pthread_cond_signal (&pipeline->written_cond);
+          pthread_mutex_unlock (&pipeline->mutex);
+        }
+    }
+
+  return pipeline->n_sequences;
+}
+
+size_t
+saft_pipeline_fasta (const char              *filename,
+                     const SaftFastaOptions  *options,
+                     unsigned int             shard,
+                     unsigned int             n_shards,
+                     unsigned int             n_workers,
+                     SaftPipelineWorkFunc     work,
+                     SaftPipelineOutputFunc   output,
+                     void                    *data)
+{
+  SaftPipeline *pipeline;
+  size_t        n_sequences;
+
+  pipeline    = saft_pipeline_new (n_workers);
+  n_sequences = saft_pipeline_run (pipeline, filename, options, shard, n_shards, work, output, data);
+  saft_pipeline_free (pipeline);
+
+  return n_sequences;
+}
+
+static void*
+saft_pipeline_reader_main (void *data)
+{
+  SaftPipeline  *pipeline   = data;
+  unsigned long  generation = 0;
+  unsigned int   i;
+
+  while (1)
+    {
+      pthread_mutex_lock (&pipeline->mutex);
+      while (!pipeline->quit && pipeline->generation == generation)
+        pthread_cond_wait (&pipeline->start_cond, &pipeline->mutex);
+      if (pipeline->quit)
+        {
+          pthread_mutex_unlock (&pipeline->mutex);
+          break;
+        }
+      generation = pipeline->generation;
+      pthread_mutex_unlock (&pipeline->mutex);
+
+      pipeline->n_sequences = saft_fasta_iter_shard (pipeline->filename,
+                                                     pipeline->options,
+                                                     pipeline->shard,
+                                                     pipeline->n_shards,
+                                                     saft_pipeline_read,
+                                                     pipeline);
+      if (pipeline->batch)
+        saft_pipeline_send (pipeline);
+
+      for (i = 0; i < pipeline->n_workers; i++)
+        saft_queue_push (pipeline->input, NULL);
+    }
+
+  return NULL;
+}
+
+static int
+saft_pipeline_read (SaftSequence *sequence,
+                    void         *data)
+{
+  SaftPipeline      *pipeline = data;
+  SaftSequenceBatch *batch;
+
+  if (!pipeline->batch)
+    {
+      pipeline->batch       = saft_sequence_batch_new (pipeline->n_read,
+                                                       pipeline->n_batched);
+      pipeline->batch_bases = 0;
+    }
+  batch = pipeline->batch;
+
+  batch->sequences[batch->n_sequences] = saft_sequence_copy (sequence);
+  batch->n_sequences++;
+  pipeline->n_batched++;
+  pipeline->batch_bases += sequence->seq_length;
+
+  if (batch->n_sequences == PIPELINE_BATCH_SEQS ||
+      pipeline->batch_bases >= PIPELINE_BATCH_BASES)
+    saft_pipeline_send (pipeline);
+
+  return 1;
+}
+
+static void
+saft_pipeline_send (SaftPipeline *pipeline)
+{
+  /* Do not get further ahead of the output than it can keep track of */
+  pthread_mutex_lock (&pipeline->mutex);
+  while (pipeline->n_read - pipeline->n_written >= pipeline->max_batches)
+    pthread_cond_wait (&pipeline->written_cond, &pipeline->mutex);
+  pthread_mutex_unlock (&pipeline->mutex);
+
+  saft_queue_push (pipeline->input, pipeline->batch);
+  pipeline->batch = NULL;
+  pipeline->n_read++;
+}
+
+static void*
+saft_pipeline_worker_main (void *data)
+{
+  SaftPipelineWorker *worker     = data;
+  SaftPipeline       *pipeline   = worker->pipeline;
+  SaftSequenceBatch  *batch;
+  unsigned long       generation = 0;
+
+  /* Each worker takes a single end marker per run, and waits for the next
+   * run before taking batches again */
+  while (1)
+    {
+      pthread_mutex_lock (&pipeline->mutex);
+      while (!pipeline->quit && pipeline->generation == generation)
+        pthread_cond_wait (&pipeline->start_cond, &pipeline->mutex);
+      if (pipeline->quit)
+        {
+          pthread_mutex_unlock (&pipeline->mutex);
+          break;
+        }
+      generation = pipeline->generation;
+      pthread_mutex_unlock (&pipeline->mutex);
+
+      while ((batch = saft_queue_pop (pipeline->input)))
+        {
+          pipeline->work (batch, worker->index, pipeline->data);
+          saft_queue_push (pipeline->results, batch);
+        }
+      saft_queue_push (pipeline->results, NULL);
+    }
+
+  return NULL;
+}
+
+static SaftSequenceBatch*
+saft_sequence_batch_new (size_t index,
+                         size_t first)
+{
+  SaftSequenceBatch *batch;
+
+  batch              = malloc (sizeof (*batch));
+  batch->sequences   = malloc (PIPELINE_BATCH_SEQS * sizeof (*batch->sequences));
+  batch->n_sequences = 0;
+  batch->index       = index;
+  batch->first       = first;
+  batch->data        = NULL;
+
+  return batch;
+}
+
+static void
+saft_sequence_batch_free (SaftSequenceBatch *batch)
+{
+  size_t i;
+
+  for (i = 0; i < batch->n_sequences; i++)
+    saft_sequence_free (batch->sequences[i]);
+  free (batch->sequences);
+  free (batch);
+}
+
+/* vim:ft=c:expandtab:sw=4:ts=4:sts=4:cinoptions={.5s^-2n-2(0:
+ */
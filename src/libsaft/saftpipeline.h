@@ -0,0 +1,94 @@
+/* saftpipeline.h
+ * Copyright (C) 2008  Sylvain FORET
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *                                                                       
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *                                                                       
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Streams the sequences of a FASTA file through a pipeline of threads: a
+ * reader parses the file into batches, a number of workers process the
+ * batches, and the results are handed back, in file order, to the calling
+ * thread. The stages are connected by bounded queues, so that parsing,
+ * computations and output overlap and the memory used stays bounded.
+ */
+
+#ifndef __SAFT_PIPELINE_H__
+#define __SAFT_PIPELINE_H__
+
+#include <saftsequence.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+typedef struct _SaftSequenceBatch SaftSequenceBatch;
+
+struct _SaftSequenceBatch
+{
+  SaftSequence **sequences;
+  size_t         n_sequences;
+  /* Rank of the batch in the file */
+  size_t         index;
+  /* Rank of the first sequence of the batch among those read */
+  size_t         first;
+  /* Left to the workers to pass their results to the output */
+  void          *data;
+};
+
+/* Called from the worker threads, worker is in [0, n_workers) */
+typedef void (*SaftPipelineWorkFunc)   (SaftSequenceBatch  *batch,
+                                        unsigned int        worker,
+                                        void               *data);
+
+/* Called from the calling thread, in the order of the batches */
+typedef void (*SaftPipelineOutputFunc) (SaftSequenceBatch  *batch,
+                                        void               *data);
+
+typedef struct _SaftPipeline SaftPipeline;
+
+/* The threads are started once, and sleep between the runs */
+SaftPipeline*  saft_pipeline_new      (unsigned int             n_workers);
+
+void           saft_pipeline_free     (SaftPipeline            *pipeline);
+
+/* Only the sequences of the given shard are read, as with
+ * saft_fasta_iter_shard, and their number is returned */
+size_t         saft_pipeline_run      (SaftPipeline            *pipeline,
+                                       const char              *filename,
+                                       const SaftFastaOptions  *options,
+                                       unsigned int             shard,
+                                       unsigned int             n_shards,
+                                       SaftPipelineWorkFunc     work,
+                                       SaftPipelineOutputFunc   output,
+                                       void                    *data);
+
+/* Same as saft_pipeline_run, on a pipeline created for the call */
+size_t         saft_pipeline_fasta    (const char              *filename,
+                                       const SaftFastaOptions  *options,
+                                       unsigned int             shard,
+                                       unsigned int             n_shards,
+                                       unsigned int             n_workers,
+                                       SaftPipelineWorkFunc     work,
+                                       SaftPipelineOutputFunc   output,
+                                       void                    *data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __SAFT_PIPELINE_H__ */
+
+/* vim:ft=c:expandtab:sw=4:ts=4:sts=4:cinoptions={.5s^-2n-2(0:
+ */
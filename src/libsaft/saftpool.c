@@ -0,0 +1,319 @@
+/* saftpool.c
+ * Copyright (C) 2008  Sylvain FORET
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *                                                                       
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *                                                                       
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ *
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "safterror.h"
+#include "saftpool.h"
+
+/* Keeps the task ranges of the threads on different cache lines */
+#define POOL_CACHE_LINE 64
+
+
+/* The tasks [next, end) left to a thread, packed in a single word so that
+ * they can be updated with a compare and swap */
+typedef union _SaftPoolRange SaftPoolRange;
+
+union _SaftPoolRange
+{
+  uint64_t tasks;
+  char     pad[POOL_CACHE_LINE];
+};
+
+#define POOL_RANGE(next, end) (((uint64_t)(end) << 32) | (uint32_t)(next))
+#define POOL_RANGE_NEXT(r)    ((uint32_t)(r))
+#define POOL_RANGE_END(r)     ((uint32_t)((r) >> 32))
+
+typedef struct _SaftPoolWorker SaftPoolWorker;
+
+struct _SaftPoolWorker
+{
+  SaftPool     *pool;
+  pthread_t     thread;
+  unsigned int  index;
+};
+
+struct _SaftPool
+{
+  SaftPoolWorker  *workers;
+  SaftPoolRange   *ranges;
+
+  pthread_mutex_t  mutex;
+  pthread_cond_t   start_cond;
+  pthread_cond_t   done_cond;
+
+  /* Current job */
+  SaftPoolFunc     func;
+  void            *data;
+  size_t           n_tasks;
+
+  unsigned long    generation;
+  unsigned int     n_busy;
+  unsigned int     n_threads;
+
+  unsigned int     quit: 1;
+};
+
+
+static void* saft_pool_worker_main (void         *data);
+
+static void  saft_pool_run_tasks   (SaftPool     *pool,
+                                    unsigned int  thread);
+
+static int   saft_pool_next_task   (SaftPool     *pool,
+                                    unsigned int  thread,
+                                    size_t       *task);
+
+static int   saft_pool_steal       (SaftPool     *pool,
+                                    unsigned int  thread);
+
+
+SaftPool*
+saft_pool_new (unsigned int n_threads)
+{
+  SaftPool     *pool;
+  unsigned int  i;
+
+  if (n_threads < 1)
+    n_threads = 1;
+
+  pool             = malloc (sizeof (*pool));
+  pool->workers    = NULL;
+  pool->func       = NULL;
+  pool->data       = NULL;
+  pool->n_tasks    = 0;
+  pool->generation = 0;
+  pool->n_busy     = 0;
+  pool->n_threads  = 1;
+  pool->quit       = 0;
+
+  pthread_mutex_init (&pool->mutex, NULL);
+  pthread_cond_init (&pool->start_cond, NULL);
+  pthread_cond_init (&pool->done_cond, NULL);
+
+  if (n_threads > 1)
+    pool->workers = malloc ((n_threads - 1) * sizeof (*pool->workers));
+  pool->ranges = malloc (n_threads * sizeof (*pool->ranges));
+  for (i = 1; i < n_threads; i++)
+    {
+      SaftPoolWorker *worker = pool->workers + i - 1;
+
+      worker->pool  = pool;
+      worker->index = i;
+      if (pthread_create (&worker->thread, NULL, saft_pool_worker_main, worker))
+        {
+          saft_error ("Could only start %u threads", pool->n_threads);
+          break;
+        }
+      pool->n_threads++;
+    }
+
+  return pool;
+}
+
+void
+saft_pool_free (SaftPool *pool)
+{
+  unsigned int i;
+
+  if (!pool)
+    return;
+
+  pthread_mutex_lock (&pool->mutex);
+  pool->quit = 1;
+  pthread_cond_broadcast (&pool->start_cond);
+  pthread_mutex_unlock (&pool->mutex);
+
+  for (i = 1; i < pool->n_threads; i++)
+    pthread_join (pool->workers[i - 1].thread, NULL);
+
+  pthread_cond_destroy (&pool->done_cond);
+  pthread_cond_destroy (&pool->start_cond);
+  pthread_mutex_destroy (&pool->mutex);
+  if (pool->workers)
+    free (pool->workers);
+  free (pool->ranges);
+  free (pool);
+}
+
+unsigned int
+saft_pool_n_threads (SaftPool *pool)
+{
+  return pool->n_threads;
+}
+
+void
+saft_pool_run (SaftPool     *pool,
+               size_t        n_tasks,
+               SaftPoolFunc  func,
+               void         *data)
+{
+  unsigned int i;
+
+  if (n_tasks == 0)
+    return;
+
+  /* Not worth waking anybody up */
+  if (pool->n_threads == 1 || n_tasks == 1)
+    {
+      size_t i;
+
+      for (i = 0; i < n_tasks; i++)
+        func (i, 0, data);
+      return;
+    }
+
+  if (n_tasks > UINT32_MAX)
+    {
+      saft_error ("Too many tasks for the thread pool: %lu", (unsigned long)n_tasks);
+      exit (1);
+    }
+
+  /* Each thread starts with a contiguous share of the tasks, so that
+   * neighbouring tasks, which often use the same data, run on the same
+   * thread */
+  for (i = 0; i < pool->n_threads; i++)
+    pool->ranges[i].tasks = POOL_RANGE (n_tasks * i / pool->n_threads,
+                                        n_tasks * (i + 1) / pool->n_threads);
+
+  pthread_mutex_lock (&pool->mutex);
+  pool->func      = func;
+  pool->data      = data;
+  pool->n_tasks   = n_tasks;
+  pool->n_busy    = pool->n_threads - 1;
+  pool->generation++;
+  pthread_cond_broadcast (&pool->start_cond);
+  pthread_mutex_unlock (&pool->mutex);
+
+  saft_pool_run_tasks (pool, 0);
+
+  pthread_mutex_lock (&pool->mutex);
+  while (pool->n_busy > 0)
+    pthread_cond_wait (&pool->done_cond, &pool->mutex);
+  pool->func = NULL;
+  pool->data = NULL;
+  pthread_mutex_unlock (&pool->mutex);
+}
+
+static void*
+saft_pool_worker_main (void *data)
+{
+  SaftPoolWorker *worker     = data;
+  SaftPool       *pool       = worker->pool;
+  unsigned long   generation = 0;
+
+  while (1)
+    {
+      pthread_mutex_lock (&pool->mutex);
+      while (!pool->quit && pool->generation == generation)
+        pthread_cond_wait (&pool->start_cond, &pool->mutex);
+      if (pool->quit)
+        {
+          pthread_mutex_unlock (&pool->mutex);
+          break;
+        }
+      generation = pool->generation;
+      pthread_mutex_unlock (&pool->mutex);
+
+      saft_pool_run_tasks (pool, worker->index);
+
+      pthread_mutex_lock (&pool->mutex);
+      pool->n_busy--;
+      if (pool->n_busy == 0)
+        pthread_cond_signal (&pool->done_cond);
+      pthread_mutex_unlock (&pool->mutex);
+    }
+
+  return NULL;
+}
+
+static void
+saft_pool_run_tasks (SaftPool     *pool,
+                     unsigned int  thread)
+{
+  size_t task;
+
+  /* Once a thread is done with its own tasks, it steals half of the tasks
+   * left to another one, so that uneven tasks do not leave threads idle */
+  do
+    while (saft_pool_next_task (pool, thread, &task))
+      pool->func (task, thread, pool->data);
+  while (saft_pool_steal (pool, thread));
+}
+
+/* Takes the first task left to the thread */
+static int
+saft_pool_next_task (SaftPool     *pool,
+                     unsigned int  thread,
+                     size_t       *task)
+{
+  uint64_t *range = &pool->ranges[thread].tasks;
+  uint64_t  r     = __atomic_load_n (range, __ATOMIC_ACQUIRE);
+
+  while (POOL_RANGE_NEXT (r) < POOL_RANGE_END (r))
+    {
+      if (__atomic_compare_exchange_n (range, &r, POOL_RANGE (POOL_RANGE_NEXT (r) + 1, POOL_RANGE_END (r)), 0,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+          *task = POOL_RANGE_NEXT (r);
+          return 1;
+        }
+    }
+
+  return 0;
+}
+
+/* Moves the last half of the tasks of another thread to this one, whose
+ * range is empty. Returns 0 once all the threads are out of tasks */
+static int
+saft_pool_steal (SaftPool     *pool,
+                 unsigned int  thread)
+{
+  unsigned int i;
+
+  for (i = 1; i < pool->n_threads; i++)
+    {
+      uint64_t *range = &pool->ranges[(thread + i) % pool->n_threads].tasks;
+      uint64_t  r     = __atomic_load_n (range, __ATOMIC_ACQUIRE);
+
+      while (POOL_RANGE_NEXT (r) < POOL_RANGE_END (r))
+        {
+          const uint32_t next   = POOL_RANGE_NEXT (r);
+          const uint32_t end    = POOL_RANGE_END (r);
+          const uint32_t middle = end - (end - next + 1) / 2;
+
+          if (__atomic_compare_exchange_n (range, &r, POOL_RANGE (next, middle), 0,
+                                           __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            {
+              __atomic_store_n (&pool->ranges[thread].tasks, POOL_RANGE (middle, end),
+                                __ATOMIC_RELEASE);
+              return 1;
+            }
+        }
+    }
+
+  return 0;
+}
+
+/* vim:ft=c:expandtab:sw=4:ts=4:sts=4:cinoptions={.5s^-2n-2(0:
+ */
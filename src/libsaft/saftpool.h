@@ -0,0 +1,64 @@
+/* saftpool.h
+ * Copyright (C) 2008  Sylvain FORET
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *                                                                       
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *                                                                       
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * A minimal pool of worker threads: a job is a number of independent tasks
+ * that are distributed dynamically among the threads of the pool. Each thread
+ * starts with a contiguous range of tasks, and steals from the others when
+ * it runs out.
+ */
+
+#ifndef __SAFT_POOL_H__
+#define __SAFT_POOL_H__
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/* task is the index of the task within the job, and thread the index of the
+ * thread running it, in [0, n_threads) */
+typedef void (*SaftPoolFunc)  (size_t        task,
+                               unsigned int  thread,
+                               void         *data);
+
+typedef struct _SaftPool SaftPool;
+
+/* The calling thread is used as the first thread of the pool, hence only
+ * n_threads - 1 threads are spawned */
+SaftPool*    saft_pool_new       (unsigned int  n_threads);
+
+void         saft_pool_free      (SaftPool     *pool);
+
+unsigned int saft_pool_n_threads (SaftPool     *pool);
+
+/* Returns once all the tasks of the job are done */
+void         saft_pool_run       (SaftPool     *pool,
+                                  size_t        n_tasks,
+                                  SaftPoolFunc  func,
+                                  void         *data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __SAFT_POOL_H__ */
+
+/* vim:ft=c:expandtab:sw=4:ts=4:sts=4:cinoptions={.5s^-2n-2(0:
+ */
@@ -0,0 +1,248 @@
+/* saftqueue.c
+ * Copyright (C) 2008  Sylvain FORET
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *                                                                       
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *                                                                       
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Each cell carries a sequence number telling whether it is ready to be
+ * written or read for a given position, so that producers and consumers only
+ * need to compete for their own end of the queue with a compare and swap.
+ * A thread that has to wait sleeps on a condition variable, which the others
+ * only signal when somebody is waiting, so that the lock is left alone as
+ * long as the queue is neither full nor empty.
+ */
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "saftqueue.h"
+
+/* Keeps the two ends of the queue on different cache lines */
+#define QUEUE_CACHE_LINE 64
+/* Attempts made before sleeping, as the other end is often about to move */
+#define QUEUE_SPINS      64
+
+
+typedef struct _SaftQueueCell SaftQueueCell;
+
+struct _SaftQueueCell
+{
+  size_t  sequence;
+  void   *item;
+};
+
+struct _SaftQueue
+{
+  SaftQueueCell   *cells;
+  size_t           mask;
+  char             pad0[QUEUE_CACHE_LINE];
+  size_t           head;
+  char             pad1[QUEUE_CACHE_LINE];
+  size_t           tail;
+  char             pad2[QUEUE_CACHE_LINE];
+  /* Threads sleeping until the queue changes */
+  unsigned int     n_waiting;
+  pthread_mutex_t  mutex;
+  pthread_cond_t   changed;
+};
+
+
+static int  queue_try_push (SaftQueue  *queue,
+                            void       *item);
+
+static int  queue_try_pop  (SaftQueue  *queue,
+                            void      **item);
+
+static void queue_wake     (SaftQueue  *queue);
+
+
+SaftQueue*
+saft_queue_new (size_t capacity)
+{
+  SaftQueue *queue;
+  size_t     size = 2;
+  size_t     i;
+
+  while (size < capacity)
+    size <<= 1;
+
+  queue        = malloc (sizeof (*queue));
+  queue->cells = malloc (size * sizeof (*queue->cells));
+  queue->mask  = size - 1;
+  queue->head  = 0;
+  queue->tail  = 0;
+  queue->n_waiting = 0;
+  pthread_mutex_init (&queue->mutex, NULL);
+  pthread_cond_init (&queue->changed, NULL);
+  for (i = 0; i < size; i++)
+    {
+      queue->cells[i].sequence = i;
+      queue->cells[i].item     = NULL;
+    }
+
+  return queue;
+}
+
+void
+saft_queue_free (SaftQueue *queue)
+{
+  if (!queue)
+    return;
+  pthread_cond_destroy (&queue->changed);
+  pthread_mutex_destroy (&queue->mutex);
+  free (queue->cells);
+  free (queue);
+}
+
+int
+saft_queue_try_push (SaftQueue *queue,
+                     void      *item)
+{
+  if (!queue_try_push (queue, item))
+    return 0;
+  queue_wake (queue);
+
+  return 1;
+}
+
+int
+saft_queue_try_pop (SaftQueue  *queue,
+                    void      **item)
+{
+  if (!queue_try_pop (queue, item))
+    return 0;
+  queue_wake (queue);
+
+  return 1;
+}
+
+void
+saft_queue_push (SaftQueue *queue,
+                 void      *item)
+{
+  unsigned int i;
+
+  for (i = 0; i < QUEUE_SPINS; i++)
+    if (saft_queue_try_push (queue, item))
+      return;
+
+  pthread_mutex_lock (&queue->mutex);
+  __atomic_add_fetch (&queue->n_waiting, 1, __ATOMIC_SEQ_CST);
+  while (!queue_try_push (queue, item))
+    pthread_cond_wait (&queue->changed, &queue->mutex);
+  __atomic_sub_fetch (&queue->n_waiting, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock (&queue->mutex);
+  queue_wake (queue);
+}
+
+void*
+saft_queue_pop (SaftQueue *queue)
+{
+  void         *item;
+  unsigned int  i;
+
+  for (i = 0; i < QUEUE_SPINS; i++)
+    if (saft_queue_try_pop (queue, &item))
+      return item;
+
+  pthread_mutex_lock (&queue->mutex);
+  __atomic_add_fetch (&queue->n_waiting, 1, __ATOMIC_SEQ_CST);
+  while (!queue_try_pop (queue, &item))
+    pthread_cond_wait (&queue->changed, &queue->mutex);
+  __atomic_sub_fetch (&queue->n_waiting, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock (&queue->mutex);
+  queue_wake (queue);
+
+  return item;
+}
+
+static int
+queue_try_push (SaftQueue *queue,
+                void      *item)
+{
+  SaftQueueCell *cell;
+  size_t         pos;
+
+  pos = __atomic_load_n (&queue->tail, __ATOMIC_RELAXED);
+  while (1)
+    {
+      ptrdiff_t diff;
+
+      cell = queue->cells + (pos & queue->mask);
+      diff = (ptrdiff_t)(__atomic_load_n (&cell->sequence, __ATOMIC_ACQUIRE) - pos);
+      if (diff == 0)
+        {
+          if (__atomic_compare_exchange_n (&queue->tail, &pos, pos + 1, 1,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
+        }
+      else if (diff < 0)
+        return 0;
+      else
+        pos = __atomic_load_n (&queue->tail, __ATOMIC_RELAXED);
+    }
+  cell->item = item;
+  __atomic_store_n (&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+
+  return 1;
+}
+
+static int
+queue_try_pop (SaftQueue  *queue,
+               void      **item)
+{
+  SaftQueueCell *cell;
+  size_t         pos;
+
+  pos = __atomic_load_n (&queue->head, __ATOMIC_RELAXED);
+  while (1)
+    {
+      ptrdiff_t diff;
+
+      cell = queue->cells + (pos & queue->mask);
+      diff = (ptrdiff_t)(__atomic_load_n (&cell->sequence, __ATOMIC_ACQUIRE) - (pos + 1));
+      if (diff == 0)
+        {
+          if (__atomic_compare_exchange_n (&queue->head, &pos, pos + 1, 1,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
+        }
+      else if (diff < 0)
+        return 0;
+      else
+        pos = __atomic_load_n (&queue->head, __ATOMIC_RELAXED);
+    }
+  *item = cell->item;
+  __atomic_store_n (&cell->sequence, pos + queue->mask + 1, __ATOMIC_RELEASE);
+
+  return 1;
+}
+
+/* The waiting threads count themselves before trying again, under the
+ * mutex, so either they see the change or it sees them */
+static void
+queue_wake (SaftQueue *queue)
+{
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+  if (!__atomic_load_n (&queue->n_waiting, __ATOMIC_RELAXED))
+    return;
+  pthread_mutex_lock (&queue->mutex);
+  pthread_cond_broadcast (&queue->changed);
+  pthread_mutex_unlock (&queue->mutex);
+}
+
+/* vim:ft=c:expandtab:sw=4:ts=4:sts=4:cinoptions={.5s^-2n-2(0:
+ */
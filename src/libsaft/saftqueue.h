@@ -0,0 +1,61 @@
+/* saftqueue.h
+ * Copyright (C) 2008  Sylvain FORET
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *                                                                       
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *                                                                       
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * A bounded queue of pointers that can be shared by several producers and
+ * several consumers without locks. Pushing to a full queue and popping from
+ * an empty one retry for a little while, then sleep until the queue changes.
+ */
+
+#ifndef __SAFT_QUEUE_H__
+#define __SAFT_QUEUE_H__
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+typedef struct _SaftQueue SaftQueue;
+
+/* The capacity is rounded up to a power of two */
+SaftQueue* saft_queue_new      (size_t     capacity);
+
+void       saft_queue_free     (SaftQueue *queue);
+
+void       saft_queue_push     (SaftQueue *queue,
+                                void      *item);
+
+void*      saft_queue_pop      (SaftQueue *queue);
+
+/* Returns 0 instead of waiting when the queue is full */
+int        saft_queue_try_push (SaftQueue *queue,
+                                void      *item);
+
+/* Returns 0 instead of waiting when the queue is empty */
+int        saft_queue_try_pop  (SaftQueue *queue,
+                                void     **item);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __SAFT_QUEUE_H__ */
+
+/* vim:ft=c:expandtab:sw=4:ts=4:sts=4:cinoptions={.5s^-2n-2(0:
+ */
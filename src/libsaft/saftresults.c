@@ -0,0 +1,222 @@
+/* saftresults.c
+ * Copyright (C) 2008  Sylvain FORET
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *                                                                       
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *                                                                       
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ *
+ */
+
+#define _GNU_SOURCE
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "safterror.h"
+#include "saftresults.h"
+
+#define PARTIAL_MAGIC "# saft partial results 2"
+
+
+static char* saft_results_chomp (char *line);
+
+
+void
+saft_results_write (FILE        *stream,
+                    SaftOptions *options,
+                    SaftSearch  *search)
+{
+  unsigned int i;
+
+  fprintf (stream, "Query: %s program: %s word size: %ld\n",
+           search->name,
+           saft_program_names[options->program],
+           (long)options->word_size);
+
+  saft_search_adjust_pvalues (search);
+  for (i = 0; i < search->n_results; i++)
+    {
+      fprintf (stream, "  Hit: %s D2: %" PRIu64 " adj.p.val: %.5e p.val: %.5e\n",
+               search->results[i].name,
+               search->results[i].d2,
+               search->results[i].p_value_adj,
+               search->results[i].p_value);
+    }
+  if (i == 0)
+    fprintf (stream, "No hit found\n");
+}
+
+void
+saft_results_write_partial_header (FILE        *stream,
+                                   SaftOptions *options)
+{
+  fprintf (stream, PARTIAL_MAGIC "\n");
+  fprintf (stream, "program %s\n", saft_program_names[options->program]);
+  fprintf (stream, "word_size %lu\n", (unsigned long)options->word_size);
+  fprintf (stream, "max_results %d\n", options->max_results);
+  fprintf (stream, "shard %u/%u\n", options->shard + 1, options->n_shards);
+}
+
+void
+saft_results_write_partial (FILE       *stream,
+                            const char *name,
+                            size_t      n_tests,
+                            SaftSearch *search,
+                            size_t      first_subject,
+                            size_t      subject_step)
+{
+  unsigned int i;
+
+  fprintf (stream, "query %lu %s\n", (unsigned long)n_tests, name);
+  if (!search)
+    return;
+
+  /* Full precision and the ranks in the whole database, so that merging
+   * shards gives the same results, ties included, as a single search */
+  for (i = 0; i < search->n_results; i++)
+    fprintf (stream, "hit %lu %" PRIu64 " %.17g %.17g %.17g %s\n",
+             (unsigned long)(first_subject + search->results[i].subject * subject_step),
+             search->results[i].d2,
+             search->results[i].mean,
+             search->results[i].var,
+             search->results[i].p_value,
+             search->results[i].name);
+}
+
+SaftSearch*
+saft_results_read_partial (const char  *filename,
+                           SaftOptions *options,
+                           int         *error)
+{
+  FILE          *stream;
+  SaftSearch    *searches = NULL;
+  char          *line     = NULL;
+  size_t         size     = 0;
+  unsigned long  lineno   = 0;
+
+  *error = 0;
+  if (!(stream = fopen (filename, "r")))
+    {
+      saft_error ("Couldn't open `%s'", filename);
+      *error = 1;
+      return NULL;
+    }
+
+  while (getline (&line, &size, stream) != -1)
+    {
+      unsigned long  value;
+      unsigned int   shard;
+      unsigned int   n_shards;
+      int            offset;
+
+      lineno++;
+      saft_results_chomp (line);
+
+      if (lineno == 1)
+        {
+          if (strcmp (line, PARTIAL_MAGIC))
+            break;
+        }
+      else if (!strncmp (line, "hit ", 4))
+        {
+          SaftResult *result;
+
+          if (!searches)
+            break;
+          result = saft_result_new ();
+          if (sscanf (line + 4, "%lu %" SCNu64 " %lg %lg %lg %n",
+                      &value,
+                      &result->d2,
+                      &result->mean,
+                      &result->var,
+                      &result->p_value,
+                      &offset) < 5)
+            {
+              saft_result_free (result);
+              break;
+            }
+          result->subject = value;
+          result->name    = strdup (line + 4 + offset);
+          saft_search_add_result (searches, result);
+        }
+      else if (sscanf (line, "query %lu %n", &value, &offset) == 1)
+        {
+          SaftSearch *search;
+
+          search          = saft_search_new (options->max_results);
+          search->name    = strdup (line + offset);
+          search->n_tests = value;
+          search->next    = searches;
+          searches        = search;
+        }
+      else if (searches)
+        break;
+      else if (!strncmp (line, "program ", 8))
+        {
+          for (options->program = 0; options->program < NB_SAFT_PROGRAMS; options->program++)
+            if (!strcmp (line + 8, saft_program_names[options->program]))
+              break;
+          if (options->program == NB_SAFT_PROGRAMS)
+            break;
+        }
+      else if (sscanf (line, "word_size %lu", &value) == 1)
+        options->word_size = value;
+      else if (sscanf (line, "max_results %lu", &value) == 1 && value > 0)
+        options->max_results = value;
+      else if (sscanf (line, "shard %u/%u", &shard, &n_shards) == 2 &&
+               shard >= 1 && shard <= n_shards)
+        {
+          options->shard    = shard - 1;
+          options->n_shards = n_shards;
+        }
+      else
+        break;
+    }
+
+  if (!feof (stream) || ferror (stream))
+    {
+      if (lineno == 0 || ferror (stream))
+        saft_error ("An IO error occured while reading `%s'", filename);
+      else
+        saft_error ("`%s' line %lu: malformed partial results", filename, lineno);
+      saft_search_free_all (searches);
+      searches = NULL;
+      *error   = 1;
+    }
+  else if (lineno == 0)
+    {
+      saft_error ("`%s' is empty", filename);
+      *error = 1;
+    }
+  if (line)
+    free (line);
+  fclose (stream);
+
+  return saft_search_reverse (searches);
+}
+
+static char*
+saft_results_chomp (char *line)
+{
+  size_t length = strlen (line);
+
+  while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+    line[--length] = '\0';
+
+  return line;
+}
+
+/* vim:ft=c:expandtab:sw=4:ts=4:sts=4:cinoptions={.5s^-2n-2(0:
+ */
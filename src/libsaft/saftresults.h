@@ -0,0 +1,86 @@
+/* saftresults.h
+ * Copyright (C) 2008  Sylvain FORET
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *                                                                       
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *                                                                       
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Reading and writing search results.
+ *
+ * A search can be split in shards of the database, which write partial
+ * results that can later be merged into the results of the whole search.
+ * Partial results are text files starting with a header:
+ *
+ *   # saft partial results 2
+ *   program saftn
+ *   word_size 7
+ *   max_results 50
+ *   shard 1/4
+ *
+ * followed, for every query in the order of the query file, by a line
+ *
+ *   query N_TESTS NAME
+ *
+ * and by one line per hit of that query in the shard
+ *
+ *   hit RANK D2 MEAN VAR P_VALUE NAME
+ *
+ * where RANK is the rank of the subject in the whole database.
+ */
+
+#ifndef __SAFT_RESULTS_H__
+#define __SAFT_RESULTS_H__
+
+#include <stdio.h>
+
+#include "saftsearch.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/* Adjusts the p-values of the search and writes its hits */
+void        saft_results_write                (FILE        *stream,
+                                               SaftOptions *options,
+                                               SaftSearch  *search);
+
+void        saft_results_write_partial_header (FILE        *stream,
+                                               SaftOptions *options);
+
+/* search can be NULL if the query had no hit. The subject of rank i in the
+ * shard has rank first_subject + i * subject_step in the database (see
+ * saft_search_engine_db_ranks) */
+void        saft_results_write_partial        (FILE        *stream,
+                                               const char  *name,
+                                               size_t       n_tests,
+                                               SaftSearch  *search,
+                                               size_t       first_subject,
+                                               size_t       subject_step);
+
+/* Returns the searches of every query of the file, in order, and sets the
+ * program, word size, maximum number of results and shard of options.
+ * Returns NULL and sets *error on failure */
+SaftSearch* saft_results_read_partial         (const char  *filename,
+                                               SaftOptions *options,
+                                               int         *error);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __SAFT_RESULTS_H__ */
+
+/* vim:ft=c:expandtab:sw=4:ts=4:sts=4:cinoptions={.5s^-2n-2(0:
+ */
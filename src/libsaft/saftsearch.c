@@ -39,21 +39,35 @@ const char *saft_program_names[NB_SAFT_PROGRAMS] =
   [TSAFTX] = "tsaftx"
 };
 
+const char *saft_freq_type_names[NB_SAFT_FREQUENCIES] =
+{
+  [SAFT_FREQ_QUERY]          = "query",
+  [SAFT_FREQ_SUBJECTS]       = "subjects",
+  [SAFT_FREQ_QUERY_SUBJECTS] = "query_subjects",
+  [SAFT_FREQ_USER]           = "user",
+  [SAFT_FREQ_UNIFORM]        = "uniform"
+};
+
+
+/* Priority queue functions and macros, zero-based */
 
-/* Priority queue functions and macros */
+#define results_heap_parent(i) (((i) - 1) / 2)
 
-#define results_heap_parent(i) ((i) / 2)
+#define results_heap_left(i)   (2 * (i) + 1)
 
-#define results_heap_left(i)   (2 * (i))
+#define results_heap_right(i)  (2 * (i) + 2)
 
-#define results_heap_right(i)  (2 * (i) + 1)
+static int         results_worse        (const SaftResult *a,
+                                         const SaftResult *b);
 
-static void results_heap_insert      (SaftSearch *search,
-                                      SaftResult *result);
+static SaftResult* results_heap_reserve (SaftSearch       *search,
+                                         const SaftResult *result);
 
-static void results_heap_heapify     (SaftSearch *search);
+static void        results_heap_insert  (SaftSearch       *search);
 
-static void results_heap_sort        (SaftSearch *search);
+static void        results_heap_heapify (SaftSearch       *search);
+
+static void        results_heap_sort    (SaftSearch       *search);
 
 
 /******************/
@@ -76,6 +90,10 @@ saft_options_new ()
   options->word_size                    = 0;
   options->verbosity                    = 0;
   options->max_results                  = 50;
+  options->n_threads                    = 1;
+  options->shard                        = 0;
+  options->n_shards                     = 1;
+  options->min_quality                  = 0;
   options->program                      = SAFT_UNKNOWN_PROGRAM;
   options->freq_type                    = SAFT_FREQ_UNIFORM;
   options->cache_db                     = 0;
@@ -116,8 +134,12 @@ saft_result_new ()
   result               = malloc (sizeof (*result));
   result->name         = NULL;
   result->d2           = 0;
+  result->mean         = 0;
+  result->var          = 0;
   result->p_value      = 1;
   result->p_value_adj  = 1;
+  result->subject      = 0;
+  result->frame        = 0;
 
   return result;
 }
@@ -143,9 +165,12 @@ saft_search_new (unsigned int max_results)
 {
   SaftSearch *search;
 
+  /* The results are only allocated with the first one, most queries having
+   * no hits */
   search                 = malloc (sizeof (*search));
-  search->results        = calloc (max_results, sizeof (*search->results));
+  search->results        = NULL;
   search->name           = NULL;
+  search->n_tests        = 0;
   search->n_results      = 0;
   search->max_results    = max_results;
 
@@ -162,11 +187,11 @@ saft_search_free (SaftSearch *search)
 
       if (search->results)
         {
-          int i;
+          unsigned int i;
 
-          for (i = 0; i < search->max_results; i++)
-            if (search->results[i])
-              saft_result_free (search->results[i]);
+          for (i = 0; i < search->n_results; i++)
+            if (search->results[i].name)
+              free (search->results[i].name);
 
           free (search->results);
         }
@@ -210,23 +235,103 @@ void
 saft_search_add_result (SaftSearch *search,
                         SaftResult *result)
 {
-  /* TODO Deal with ties */
+  SaftResult *slot;
 
-  if (search->n_results == search->max_results)
+  if ((slot = results_heap_reserve (search, result)))
+    {
+      *slot = *result;
+      results_heap_insert (search);
+    }
+  else if (result->name)
+    free (result->name);
+  free (result);
+}
+
+void
+saft_search_add_hit (SaftSearch *search,
+                     size_t      subject,
+                     const char *name,
+                     uint64_t    d2,
+                     double      mean,
+                     double      var,
+                     double      p_value)
+{
+  SaftResult *slot;
+  SaftResult  hit;
+
+  hit.name        = (char*) name;
+  hit.p_value     = p_value;
+  hit.p_value_adj = 1;
+  hit.d2          = d2;
+  hit.mean        = mean;
+  hit.var         = var;
+  hit.subject     = subject;
+  hit.frame       = 0;
+  if (!(slot = results_heap_reserve (search, &hit)))
+    return;
+  *slot      = hit;
+  slot->name = strdup (name);
+  results_heap_insert (search);
+}
+
+void
+saft_search_add_subject (SaftSearch *search,
+                         size_t      subject,
+                         uint64_t    d2,
+                         double      mean,
+                         double      var,
+                         double      p_value)
+{
+  SaftResult *slot;
+  SaftResult  hit;
+
+  hit.name        = NULL;
+  hit.p_value     = p_value;
+  hit.p_value_adj = 1;
+  hit.d2          = d2;
+  hit.mean        = mean;
+  hit.var         = var;
+  hit.subject     = subject;
+  hit.frame       = 0;
+  if (!(slot = results_heap_reserve (search, &hit)))
+    return;
+  *slot = hit;
+  results_heap_insert (search);
+}
+
+void
+saft_search_resolve_names (SaftSearch          *search,
+                           SaftSubjectNameFunc  func,
+                           void                *data)
+{
+  unsigned int i;
+
+  for (i = 0; i < search->n_results; i++)
+    if (!search->results[i].name)
+      search->results[i].name = strdup (func (search->results[i].subject, data));
+}
+
+void
+saft_search_merge (SaftSearch *search,
+                   SaftSearch *other)
+{
+  unsigned int i;
+
+  for (i = 0; i < other->n_results; i++)
     {
-      if (result->p_value > search->results[0]->p_value)
+      SaftResult *slot;
+
+      if ((slot = results_heap_reserve (search, other->results + i)))
         {
-          saft_result_free (result);
-          return;
+          *slot = other->results[i];
+          results_heap_insert (search);
         }
-      saft_result_free (search->results[0]);
-      search->results[0] = search->results[search->n_results - 1];
-      search->results[search->n_results - 1] = NULL;
-      search->n_results--;
-      results_heap_heapify (search);
+      else if (other->results[i].name)
+        free (other->results[i].name);
     }
-  /* Insert new value */
-  results_heap_insert (search, result);
+  search->n_tests += other->n_tests;
+  other->n_results = 0;
+  saft_search_free (other);
 }
 
 void
@@ -241,72 +346,106 @@ saft_search_adjust_pvalues (SaftSearch *search)
 
   /* FIXME Make sure the direction of the sorting is correct */
   /* FIXME Have a conservative adjustment of the first p-value */
-  search->results[search->n_results - 1]->p_value_adj = search->results[search->n_results - 1]->p_value;
+  search->results[search->n_results - 1].p_value_adj = search->results[search->n_results - 1].p_value;
   for (i = search->n_results - 2; i >= 0; i--)
-    search->results[i]->p_value_adj = saft_stats_BH_element (search->results[i]->p_value,
-                                                                    search->results[i + 1]->p_value_adj,
-                                                                    i,
-                                                                    search->n_results);
+    search->results[i].p_value_adj = saft_stats_BH_element (search->results[i].p_value,
+                                                            search->results[i + 1].p_value_adj,
+                                                            i,
+                                                            search->n_results);
 }
 
 /* TODO Try alternative data structure for the results, maybe a Fibonacci heap */
 
-/* FIXME Fix up the indices to have a consistent zero-based indexing system.
- * Importantly, make sure that this does not break the parent/left/right macros
- * */
+/* The worst result, of the largest p-value, is at the root, so that a new
+ * result is checked against it before anything is copied. The room is made
+ * for the result by results_heap_reserve, which returns NULL if it would not
+ * be kept, and results_heap_insert then moves it up */
 
-static void
-results_heap_insert (SaftSearch *search,
-                     SaftResult *result)
+/* Ties on the p-value are broken on D2, then on the rank of the subject, so
+ * that the hits kept do not depend on the order they were added in */
+static int
+results_worse (const SaftResult *a,
+               const SaftResult *b)
 {
-  int i;
-  int p;
+  if (a->p_value != b->p_value)
+    return a->p_value > b->p_value;
+  if (a->d2 != b->d2)
+    return a->d2 < b->d2;
+  if (a->subject != b->subject)
+    return a->subject > b->subject;
+  if (a->name && b->name)
+    return strcmp (a->name, b->name) > 0;
+  return 0;
+}
 
-  search->results[search->n_results] = result;
-  search->n_results++;
+static SaftResult*
+results_heap_reserve (SaftSearch       *search,
+                      const SaftResult *result)
+{
+  if (search->n_results == search->max_results)
+    {
+      if (search->max_results == 0 || !results_worse (search->results, result))
+        return NULL;
+      if (search->results[0].name)
+        free (search->results[0].name);
+      search->results[0] = search->results[search->n_results - 1];
+      search->n_results--;
+      results_heap_heapify (search);
+    }
+  else if (!search->results)
+    search->results = malloc (search->max_results * sizeof (*search->results));
+
+  return search->results + search->n_results;
+}
+
+static void
+results_heap_insert (SaftSearch *search)
+{
+  unsigned int i;
+  unsigned int p;
 
   /* Heap-Increase-Key */
-  i = search->n_results;
+  i = search->n_results++;
   p = results_heap_parent (i);
-  while (i > 1 && search->results[p - 1]->p_value < search->results[i - 1]->p_value)
+  while (i > 0 && results_worse (search->results + i, search->results + p))
     {
-      SaftResult *tmp;
+      SaftResult tmp;
 
-      tmp                    = search->results[i - 1];
-      search->results[i - 1] = search->results[p - 1];
-      search->results[p - 1] = tmp;
-      i                      = p;
-      p                      = results_heap_parent (i);
+      tmp                = search->results[i];
+      search->results[i] = search->results[p];
+      search->results[p] = tmp;
+      i                  = p;
+      p                  = results_heap_parent (i);
     }
 }
 
 static void
 results_heap_heapify (SaftSearch *search)
 {
-  int i;
+  unsigned int i;
 
-  i = 1;
-  while (i <= search->n_results)
+  i = 0;
+  while (i < search->n_results)
     {
-      const int l   = results_heap_left (i);
-      const int r   = results_heap_right (i);
-      int       max = i;
+      const unsigned int l   = results_heap_left (i);
+      const unsigned int r   = results_heap_right (i);
+      unsigned int       max = i;
 
-      if (l <= search->n_results && search->results[l - 1]->p_value > search->results[i - 1]->p_value)
+      if (l < search->n_results && results_worse (search->results + l, search->results + i))
         max = l;
-      if (r <= search->n_results && search->results[r - 1]->p_value > search->results[max - 1]->p_value)
+      if (r < search->n_results && results_worse (search->results + r, search->results + max))
         max = r;
 
       if (max == i)
         break;
       else
         {
-          SaftResult *tmp;
+          SaftResult tmp;
 
-          tmp                      = search->results[i - 1];
-          search->results[i - 1]   = search->results[max - 1];
-          search->results[max - 1] = tmp;
-          i                        = max;
+          tmp                  = search->results[i];
+          search->results[i]   = search->results[max];
+          search->results[max] = tmp;
+          i                    = max;
         }
     }
 }
@@ -314,12 +453,12 @@ results_heap_heapify (SaftSearch *search)
 static void
 results_heap_sort (SaftSearch *search)
 {
-  const int n = search->n_results;
-  int       i;
+  const unsigned int n = search->n_results;
+  unsigned int       i;
 
   for (i = n; i >= 2; i--)
     {
-      SaftResult *tmp;
+      SaftResult tmp;
 
       tmp                    = search->results[i - 1];
       search->results[i - 1] = search->results[0];
@@ -337,6 +476,8 @@ results_heap_sort (SaftSearch *search)
 SaftSearchEngine*
 saft_search_engine_new (SaftOptions *options)
 {
+  SaftSearchEngine *engine = NULL;
+
   if (options->program == SAFTN)
     {
       /* Note, while SearchEngineDNAArray would work for k = 8, it is slower
@@ -344,12 +485,12 @@ saft_search_engine_new (SaftOptions *options)
       if (options->word_size < 8)
         {
           /* Array based DNA engine */
-          return saft_search_engine_dna_array_new (options);
+          engine = saft_search_engine_dna_array_new (options);
         }
       else
         {
           /* Hash-Table based DNA engine */
-          return saft_search_engine_dna_hash_new (options);
+          engine = saft_search_engine_dna_hash_new (options);
         }
     }
   else
@@ -357,7 +498,10 @@ saft_search_engine_new (SaftOptions *options)
       /* Generic engine */
       saft_error ("Only DNA alphabet is implemented");
     }
-  return NULL;
+  if (engine)
+    saft_search_engine_fasta_options (options, &engine->fasta_options);
+
+  return engine;
 }
 
 void
@@ -384,11 +528,119 @@ saft_search_all (SaftSearchEngine *engine,
                  const char       *query_path,
                  const char       *db_path)
 {
-  if (engine->search_all)
-    return engine->search_all (engine,
-                               query_path,
+  if (!engine->search_all)
+    return NULL;
+
+  return engine->search_all (engine,
+                             query_path,
+                             db_path);
+}
+
+int
+saft_search_engine_write_db (SaftSearchEngine *engine,
+                             const char       *db_path,
+                             const char       *out_path,
+                             int               append)
+{
+  if (!engine->write_db)
+    {
+      saft_error ("This search engine can't write databases");
+      return 1;
+    }
+
+  return engine->write_db (engine,
+                           db_path,
+                           out_path,
+                           append);
+}
+
+int
+saft_search_engine_load_db (SaftSearchEngine *engine,
+                            const char       *db_path)
+{
+  if (!engine->load_db)
+    {
+      saft_error ("This search engine can't load databases");
+      return 1;
+    }
+
+  return engine->load_db (engine,
+                          db_path);
+}
+
+SaftSearch*
+saft_search_loaded (SaftSearchEngine *engine,
+                    int               query_fd)
+{
+  if (!engine->search_loaded)
+    return NULL;
+
+  return engine->search_loaded (engine,
+                                query_fd,
+                                NULL);
+}
+
+SaftSearch*
+saft_search_loaded_queries (SaftSearchEngine  *engine,
+                            SaftSequence     **queries)
+{
+  if (!engine->search_loaded)
+    return NULL;
+
+  return engine->search_loaded (engine,
+                                -1,
+                                queries);
+}
+
+SaftDatabase*
+saft_database_new (SaftSearchEngine *engine)
+{
+  return saft_database_new_from_path (engine, NULL);
+}
+
+SaftDatabase*
+saft_database_new_from_path (SaftSearchEngine *engine,
+                             const char       *db_path)
+{
+  if (!engine->database_new)
+    {
+      saft_error ("This search engine can't keep databases in memory");
+      return NULL;
+    }
+
+  return engine->database_new (engine,
                                db_path);
-  return NULL;
+}
+
+int
+saft_database_add_sequence (SaftDatabase *database,
+                            SaftSequence *sequence)
+{
+  return database->engine->database_add (database,
+                                         sequence);
+}
+
+void
+saft_database_free (SaftDatabase *database)
+{
+  if (database)
+    database->engine->database_free (database);
+}
+
+SaftSearch*
+saft_search_engine_query (SaftSearchEngine  *engine,
+                          SaftDatabase      *database,
+                          SaftSequence     **queries)
+{
+  if (database->engine != engine)
+    {
+      saft_error ("The database was not created by this search engine");
+      return NULL;
+    }
+
+  return engine->query (engine,
+                        database,
+                        queries);
 }
 
 /* vim:ft=c:expandtab:sw=4:ts=4:sts=4:cinoptions={.5s^-2n-2(0:
@@ -24,6 +24,7 @@
 
 #include <stdint.h>
 
+#include "saftfasta.h"
 #include "saftsequence.h"
 
 
@@ -50,6 +51,8 @@ typedef enum
 }
 SaftFreqType;
 
+extern const char *saft_freq_type_names[NB_SAFT_FREQUENCIES];
+
 typedef enum
 {
   /* Generic saft program type to deal with any possible alphabet. In this case
@@ -73,7 +76,9 @@ SaftProgramType;
 
 extern const char *saft_program_names[NB_SAFT_PROGRAMS];
 
-typedef uint16_t WordCount;
+/* 32 bits counts, so that a single word can occur more than 65535 times in
+ * chromosome-scale sequences */
+typedef uint32_t WordCount;
 
 /* TODO add an option for the type of p-value approximation.
  * Gamma is generally better, but a normal approximation might be desirable if
@@ -100,6 +105,13 @@ struct _SaftOptions
 
   unsigned int    verbosity;
   int             max_results;
+  unsigned int    n_threads;
+  /* Only the database sequences whose rank modulo n_shards is shard are
+   * searched */
+  unsigned int    shard;
+  unsigned int    n_shards;
+  /* Bases of FASTQ reads with a lower quality are masked */
+  unsigned int    min_quality;
 
   SaftProgramType program;
   SaftFreqType    freq_type;
@@ -130,7 +142,13 @@ struct _SaftResult
   char         *name;
   double        p_value;
   double        p_value_adj;
-  unsigned long d2;
+  uint64_t      d2;
+  /* Moments of D2 under the null hypothesis */
+  double        mean;
+  double        var;
+  /* Rank of the subject in the database searched, which breaks the ties
+   * between hits and finds the name while it is not resolved yet */
+  size_t        subject;
   char          frame;
 };
 
@@ -149,8 +167,12 @@ typedef struct _SaftSearch SaftSearch;
 struct _SaftSearch
 {
   SaftSearch    *next;
-  SaftResult   **results;
+  /* Kept inline, as a heap of the worst result first until
+   * saft_search_adjust_pvalues sorts them */
+  SaftResult    *results;
   char          *name;
+  /* Number of subjects the query was compared to */
+  size_t         n_tests;
   unsigned int   n_results;
   unsigned int   max_results;
 };
@@ -163,9 +185,42 @@ void        saft_search_free_all        (SaftSearch   *search);
 
 SaftSearch*  saft_search_reverse        (SaftSearch   *search);
 
+/* The result is copied into the search, which takes its name, and freed */
 void        saft_search_add_result      (SaftSearch   *search,
                                          SaftResult   *result);
 
+/* Same as saft_search_add_result, but nothing is allocated unless the hit is
+ * kept, so that the hits dropped straight away cost nothing. name is copied,
+ * and subject is the rank of the subject in the database */
+void        saft_search_add_hit         (SaftSearch   *search,
+                                         size_t        subject,
+                                         const char   *name,
+                                         uint64_t      d2,
+                                         double        mean,
+                                         double        var,
+                                         double        p_value);
+
+/* Same as saft_search_add_hit, the name of the subject being left to
+ * saft_search_resolve_names, once the hits kept are known */
+void        saft_search_add_subject     (SaftSearch   *search,
+                                         size_t        subject,
+                                         uint64_t      d2,
+                                         double        mean,
+                                         double        var,
+                                         double        p_value);
+
+typedef const char* (*SaftSubjectNameFunc) (size_t  subject,
+                                            void   *data);
+
+/* Copies the names of the subjects of saft_search_add_subject */
+void        saft_search_resolve_names   (SaftSearch          *search,
+                                         SaftSubjectNameFunc  func,
+                                         void                *data);
+
+/* Moves the results of other into search and frees other */
+void        saft_search_merge           (SaftSearch   *search,
+                                         SaftSearch   *other);
+
 void        saft_search_adjust_pvalues  (SaftSearch   *search);
 
 /********************/
@@ -174,19 +229,63 @@ void        saft_search_adjust_pvalues  (SaftSearch   *search);
 
 typedef struct _SaftSearchEngine SaftSearchEngine;
 
+/* A database counted once and kept in memory by the engine which created it,
+ * for the queries of saft_search_engine_query */
+
+typedef struct _SaftDatabase SaftDatabase;
+
+struct _SaftDatabase
+{
+  SaftSearchEngine *engine;
+};
+
+/* Called on the search of a query, which is freed after the call */
+typedef void (*SaftSearchDoneFunc) (SaftSearch *search,
+                                    void       *data);
+
 struct _SaftSearchEngine
 {
   /* Member variables */
-  SaftOptions  *options;
+  SaftOptions        *options;
+  /* How the queries and the database are read, from the options */
+  SaftFastaOptions    fasta_options;
+  /* Number of database sequences searched by the last search_all */
+  size_t              n_subjects;
+  /* If set, search_all hands the search of every query, even without hits,
+   * to search_done as soon as it is over, in the order of the queries, and
+   * returns NULL */
+  SaftSearchDoneFunc  search_done;
+  void               *search_done_data;
 
   /* Virtual methods table */
-  SaftSearch* (*search_two_sequences) (SaftSearchEngine *engine,
-                                       SaftSequence     *query,
-                                       SaftSequence     *subject);
-  SaftSearch* (*search_all)           (SaftSearchEngine *engine,
-                                       const char       *queries_path,
-                                       const char       *db_path);
-  void        (*free)                 (SaftSearchEngine *engine);
+  SaftSearch*   (*search_two_sequences) (SaftSearchEngine *engine,
+                                         SaftSequence     *query,
+                                         SaftSequence     *subject);
+  SaftSearch*   (*search_all)           (SaftSearchEngine *engine,
+                                         const char       *queries_path,
+                                         const char       *db_path);
+  /* Writes the counts of the database for saft_db_open, may be NULL */
+  int           (*write_db)             (SaftSearchEngine *engine,
+                                         const char       *db_path,
+                                         const char       *out_path,
+                                         int               append);
+  /* Caches or maps the database once for search_loaded, may be NULL */
+  int           (*load_db)              (SaftSearchEngine *engine,
+                                         const char       *db_path);
+  /* The queries are read from query_fd when queries is NULL */
+  SaftSearch*   (*search_loaded)        (SaftSearchEngine *engine,
+                                         int               query_fd,
+                                         SaftSequence    **queries);
+  /* The database is empty when db_path is NULL, may be NULL */
+  SaftDatabase* (*database_new)         (SaftSearchEngine *engine,
+                                         const char       *db_path);
+  int           (*database_add)         (SaftDatabase     *database,
+                                         SaftSequence     *sequence);
+  void          (*database_free)        (SaftDatabase     *database);
+  SaftSearch*   (*query)                (SaftSearchEngine *engine,
+                                         SaftDatabase     *database,
+                                         SaftSequence    **queries);
+  void          (*free)                 (SaftSearchEngine *engine);
 
 };
 
@@ -202,6 +301,54 @@ SaftSearch*       saft_search_all           (SaftSearchEngine *engine,
                                              const char       *query_path,
                                              const char       *db_path);
 
+/* Counts the words of the FASTA database db_path and writes them to out_path
+ * (see saftdb.h), or appends them to it as a new segment. Returns 0 on
+ * success */
+int               saft_search_engine_write_db (SaftSearchEngine *engine,
+                                               const char       *db_path,
+                                               const char       *out_path,
+                                               int               append);
+
+/* Caches the database db_path, or maps it if it was written by
+ * saft_search_engine_write_db, so that the queries of every
+ * saft_search_loaded are searched against it without reading it again.
+ * Returns 0 on success */
+int               saft_search_engine_load_db  (SaftSearchEngine *engine,
+                                               const char       *db_path);
+
+/* Same as saft_search_all, the queries being read from query_fd and the
+ * database being the one of saft_search_engine_load_db */
+SaftSearch*       saft_search_loaded          (SaftSearchEngine *engine,
+                                               int               query_fd);
+
+/* Same as saft_search_loaded, the queries being the NULL terminated array of
+ * sequences queries */
+SaftSearch*       saft_search_loaded_queries  (SaftSearchEngine *engine,
+                                               SaftSequence    **queries);
+
+/* An empty database, whose sequences are added by
+ * saft_database_add_sequence */
+SaftDatabase*     saft_database_new           (SaftSearchEngine *engine);
+
+/* Counts the sequences of the FASTA database db_path, or maps it if it was
+ * written by saft_search_engine_write_db. Returns NULL on failure */
+SaftDatabase*     saft_database_new_from_path (SaftSearchEngine *engine,
+                                               const char       *db_path);
+
+/* Counts the sequence, which can be freed afterwards. Returns 0 on success */
+int               saft_database_add_sequence  (SaftDatabase     *database,
+                                               SaftSequence     *sequence);
+
+/* The engine of the database must not be freed before it */
+void              saft_database_free          (SaftDatabase     *database);
+
+/* Same as saft_search_all, the queries being the NULL terminated array of
+ * sequences queries, as returned by saft_fasta_read, and the database being
+ * searched from memory. The database must have been created by engine */
+SaftSearch*       saft_search_engine_query    (SaftSearchEngine *engine,
+                                               SaftDatabase     *database,
+                                               SaftSequence    **queries);
+
 #ifdef __cplusplus
 }
 #endif
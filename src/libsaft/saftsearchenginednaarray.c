@@ -25,9 +25,14 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "saftdb.h"
+#include "safterror.h"
 #include "saftfasta.h"
+#include "saftpipeline.h"
+#include "saftpool.h"
 #include "saftsearchengines.h"
 #include "saftstats.h"
+#include "saftutils.h"
 
 
 /*********************************/
@@ -38,10 +43,14 @@ typedef struct _DNAArrayDBEntry DNAArrayDBEntry;
 
 struct _DNAArrayDBEntry
 {
-  DNAArrayDBEntry *next;
-  WordCount       *counts;
-  char            *name;
-  size_t           length;
+  DNAArrayDBEntry  *next;
+  WordCount        *counts;
+  char             *name;
+  /* Only set for cached queries when the frequencies depend on the query */
+  SaftStatsContext *stats_context;
+  size_t            length;
+  /* Only set for the database, as counted in its composition */
+  uint64_t          composition[NUC_NB];
 };
 
 static DNAArrayDBEntry* dna_array_db_entry_new      (void);
@@ -51,34 +60,142 @@ static void             dna_array_db_entry_free     (DNAArrayDBEntry *entry);
 static void             dna_array_db_entry_free_all (DNAArrayDBEntry *entry);
 
 
-typedef struct _SearchEngineDNAArray SearchEngineDNAArray;
+/* Number of queries searched in parallel, per thread */
+#define DNA_ARRAY_BATCH_PER_THREAD 8
+/* Number of cached queries scored by a task, when the queries are cached */
+#define DNA_ARRAY_QUERY_BLOCK      64
+/* Number of parts of the database parsed in parallel, per thread, when it
+ * is cached */
+#define DNA_ARRAY_RANGES_PER_THREAD 4
+/* Entries first allocated for a database filled by database_add */
+#define DNA_ARRAY_DB_ENTRIES_INIT  256
 
-struct _SearchEngineDNAArray
+
+/* Counts the words of a sequence from consecutive pieces of its letters */
+typedef struct _DNAArrayCounter DNAArrayCounter;
+
+struct _DNAArrayCounter
 {
-  SaftSearchEngine  search_engine;
+  WordCount       *counts;
+  /* Set instead of counts when the words are looked up in the counts of a
+   * query rather than counted, their counts in the query adding up to d2 */
+  const WordCount *query;
+  uint64_t         d2;
+  uint64_t         composition[NUC_NB];
+  size_t           length;
+  /* The letters fed since the last unknown one, a word ending on the last
+   * letter fed once there are k of them */
+  size_t           n_known;
+  /* The word ending on the last letter fed */
+  uint16_t         word;
+};
 
-  SaftStatsContext *stats_context;
+/* The state of the engine bound to its database, swapped with that of the
+ * engine while a SaftDatabase is counted or searched */
+typedef struct _DNAArrayDatabase DNAArrayDatabase;
 
-  DNAArrayDBEntry  *query_cache;
+struct _DNAArrayDatabase
+{
+  SaftDatabase      database;
+
+  SaftStatsContext *stats_context;
   DNAArrayDBEntry  *db_cache;
+  DNAArrayDBEntry **db_entries;
+  SaftDB           *db;
+  DNAArrayDBEntry  *db_mapped;
+  WordCount        *db_slab;
+  char             *db_names;
+  size_t            n_db_entries;
+  /* Only kept by the database, the engine's entries never being grown */
+  size_t            db_entries_alloc;
+  uint64_t          db_composition[NUC_NB];
+};
 
-  SaftSearch       *search;
-  SaftSearch      **search_array;
-  SaftSearch       *tmp_search;
-  WordCount        *tmp_counts;
+typedef struct _SearchEngineDNAArray SearchEngineDNAArray;
 
-  size_t            n_queries;
-  size_t            max_words;
-  size_t            tmp_length;
+struct _SearchEngineDNAArray
+{
+  SaftSearchEngine     search_engine;
+
+  SaftStatsContext    *stats_context;
+  SaftStatsContext    *tmp_stats_context;
+
+  DNAArrayDBEntry     *query_cache;
+  /* The query cache, indexed in the order of search_array */
+  DNAArrayDBEntry    **query_entries;
+  DNAArrayDBEntry     *db_cache;
+  /* The database cache, indexed in the order it is scanned */
+  DNAArrayDBEntry    **db_entries;
+  /* A database written by write_db, whose entries point into the map, or the
+   * database cache once packed, whose entries point into the slab */
+  SaftDB              *db;
+  DNAArrayDBEntry     *db_mapped;
+  WordCount           *db_slab;
+  char                *db_names;
+
+  SaftPool            *pool;
+  /* Streams the database when it is not cached, for a whole search */
+  SaftPipeline        *pipeline;
+  SaftPackedSequence **batch;
+  WordCount          **batch_counts;
+  /* The hits of each thread, when the queries are cached */
+  SaftSearch         **partial_searches;
+
+  SaftSearch          *search;
+  SaftSearch         **search_array;
+  SaftSearch          *tmp_search;
+  WordCount           *tmp_counts;
+  /* The database sequence counted as it is parsed */
+  SaftSequence        *subject;
+  DNAArrayCounter      subject_counter;
+
+  size_t               n_queries;
+  size_t               n_db_entries;
+  size_t               n_batch;
+  /* Database sequences scanned so far, whose ranks break the ties of hits */
+  size_t               n_scanned;
+  size_t               max_words;
+  size_t               tmp_length;
+
+  uint64_t             db_composition[NUC_NB];
 };
 
 
 static void          search_engine_dna_array_free                 (SaftSearchEngine     *engine);
 
 static WordCount*    search_engine_dna_array_hash_sequence        (SearchEngineDNAArray *engine,
-                                                                   SaftSequence         *sequence);
+                                                                   SaftSequence         *sequence,
+                                                                   uint64_t             *composition);
+
+static WordCount*    search_engine_dna_array_hash_packed          (SearchEngineDNAArray     *engine,
+                                                                   const SaftPackedSequence *sequence,
+                                                                   uint64_t                 *composition);
+
+static void          dna_array_counter_begin                      (SearchEngineDNAArray *engine,
+                                                                   DNAArrayCounter      *counter,
+                                                                   const WordCount      *query);
+
+static void          dna_array_counter_feed                       (SearchEngineDNAArray *engine,
+                                                                   DNAArrayCounter      *counter,
+                                                                   const char           *letters,
+                                                                   size_t                length);
+
+static WordCount*    dna_array_counter_end                        (SearchEngineDNAArray *engine,
+                                                                   DNAArrayCounter      *counter,
+                                                                   uint64_t             *composition);
+
+static int           dna_array_subject_begin                      (const char           *name,
+                                                                   size_t                name_length,
+                                                                   void                 *data);
+
+static void          dna_array_subject_feed                       (const char           *letters,
+                                                                   size_t                length,
+                                                                   void                 *data);
+
+static WordCount*    dna_array_subject_end                        (SearchEngineDNAArray *engine,
+                                                                   uint64_t             *composition);
 
-static unsigned long search_engine_dna_array_d2                   (SearchEngineDNAArray *engine,
+static uint64_t      search_engine_dna_array_d2                   (SearchEngineDNAArray *engine,
                                                                    WordCount            *counts1,
                                                                    WordCount            *counts2);
 
@@ -103,21 +220,138 @@ static SaftSearch*   search_engine_dna_array_search_all_dcached   (SearchEngineD
                                                                    const char           *query_path,
                                                                    const char           *db_path);
 
+static SaftSearch*   search_engine_dna_array_search_all_mapped    (SearchEngineDNAArray *engine,
+                                                                   const char           *query_path,
+                                                                   const char           *db_path);
+
+static void          search_engine_dna_array_cache_db             (SearchEngineDNAArray *engine,
+                                                                   const char           *db_path);
+
+static void          search_engine_dna_array_pack_db              (SearchEngineDNAArray *engine);
+
+static SaftSearch*   search_engine_dna_array_search_cached_db     (SearchEngineDNAArray *engine,
+                                                                   const char           *query_path,
+                                                                   int                   query_fd,
+                                                                   SaftSequence        **queries);
+
+static int           search_engine_dna_array_write_db             (SaftSearchEngine     *engine,
+                                                                   const char           *db_path,
+                                                                   const char           *out_path,
+                                                                   int                   append);
+
+static int           search_engine_dna_array_load_db              (SaftSearchEngine     *engine,
+                                                                   const char           *db_path);
+
+static SaftSearch*   search_engine_dna_array_search_loaded        (SaftSearchEngine     *engine,
+                                                                   int                   query_fd,
+                                                                   SaftSequence        **queries);
+
+static SaftDatabase* search_engine_dna_array_database_new         (SaftSearchEngine     *engine,
+                                                                   const char           *db_path);
+
+static int           search_engine_dna_array_database_add         (SaftDatabase         *database,
+                                                                   SaftSequence         *sequence);
+
+static void          search_engine_dna_array_database_free        (SaftDatabase         *database);
+
+static SaftSearch*   search_engine_dna_array_query                (SaftSearchEngine     *engine,
+                                                                   SaftDatabase         *database,
+                                                                   SaftSequence        **queries);
+
+static void          search_engine_dna_array_swap_database        (SearchEngineDNAArray *engine,
+                                                                   DNAArrayDatabase     *database);
+
+static int           search_engine_dna_array_map_db               (SearchEngineDNAArray *engine,
+                                                                   const char           *db_path);
+
+static void          search_engine_dna_array_unmap_db             (SearchEngineDNAArray *engine);
+
 static int           search_engine_dna_array_cache_sequence       (SaftSequence         *sequence,
                                                                    void                 *data);
 
+static int           search_engine_dna_array_cache_subject        (void                 *data);
+
+static void          search_engine_dna_array_cache_db_parallel    (SearchEngineDNAArray *engine,
+                                                                  const char           *db_path);
+
 static int           search_engine_dna_array_search_query         (SaftSequence         *sequence,
                                                                    void                 *data);
 
-static int           search_engine_dna_array_search_db            (SaftSequence         *sequence,
+static void          search_engine_dna_array_scan_db              (SearchEngineDNAArray *engine,
+                                                                   SaftSearch           *search,
+                                                                   WordCount            *counts,
+                                                                   size_t                length,
+                                                                   SaftStatsContext     *stats_context,
+                                                                   size_t                first,
+                                                                   size_t                last);
+
+static const char*   search_engine_dna_array_subject_name         (size_t                subject,
+                                                                   void                 *data);
+
+static int           search_engine_dna_array_batch_query          (SaftSequence         *sequence,
                                                                    void                 *data);
 
+static void          search_engine_dna_array_search_batch         (SearchEngineDNAArray *engine);
+
+static int           search_engine_dna_array_search_db            (void                 *data);
+
+static void          search_engine_dna_array_score_query          (SearchEngineDNAArray *engine,
+                                                                   SaftSearch          **search,
+                                                                   DNAArrayDBEntry      *entry,
+                                                                   WordCount            *counts,
+                                                                   size_t                subject,
+                                                                   const char           *name,
+                                                                   size_t                length);
+
+static int           search_engine_dna_array_block_db             (SaftSequence         *sequence,
+                                                                   void                 *data);
+
+static void          search_engine_dna_array_search_block         (SearchEngineDNAArray *engine);
+
 static int           search_engine_dna_array_queries_iter_func    (SaftSequence         *sequence,
                                                                    void                 *data);
 
-static int           search_engine_dna_array_db_iter_func         (SaftSequence         *sequence,
+static void          search_engine_dna_array_score_subject       (SearchEngineDNAArray *engine,
+                                                                   SaftSearch           *search,
+                                                                   SaftSequence         *sequence,
+                                                                   size_t                subject);
+
+static void          search_engine_dna_array_score_d2            (SearchEngineDNAArray *engine,
+                                                                   SaftSearch           *search,
+                                                                   uint64_t              d2,
+                                                                   SaftSequence         *sequence,
+                                                                   size_t                subject);
+
+static void          search_engine_dna_array_pipeline_work       (SaftSequenceBatch    *batch,
+                                                                   unsigned int          worker,
+                                                                   void                 *data);
+
+static void          search_engine_dna_array_pipeline_output     (SaftSequenceBatch    *batch,
                                                                    void                 *data);
 
+static int           search_engine_dna_array_db_iter_func         (void                 *data);
+
+/* The database is read in pieces when it is scanned sequentially */
+static const SaftFastaFragmentFuncs dna_array_scan_funcs =
+{
+  dna_array_subject_begin,
+  dna_array_subject_feed,
+  search_engine_dna_array_db_iter_func
+};
+
+static const SaftFastaFragmentFuncs dna_array_search_db_funcs =
+{
+  dna_array_subject_begin,
+  dna_array_subject_feed,
+  search_engine_dna_array_search_db
+};
+
+static const SaftFastaFragmentFuncs dna_array_cache_db_funcs =
+{
+  dna_array_subject_begin,
+  dna_array_subject_feed,
+  search_engine_dna_array_cache_subject
+};
 
 
 SaftSearchEngine*
@@ -129,19 +363,52 @@ saft_search_engine_dna_array_new (SaftOptions *options)
   engine->search_engine.options              = options;
   engine->search_engine.search_two_sequences = search_engine_dna_array_search_two_sequences;
   engine->search_engine.search_all           = search_engine_dna_array_search_all;
+  engine->search_engine.write_db             = search_engine_dna_array_write_db;
+  engine->search_engine.load_db              = search_engine_dna_array_load_db;
+  engine->search_engine.search_loaded        = search_engine_dna_array_search_loaded;
+  engine->search_engine.database_new         = search_engine_dna_array_database_new;
+  engine->search_engine.database_add         = search_engine_dna_array_database_add;
+  engine->search_engine.database_free        = search_engine_dna_array_database_free;
+  engine->search_engine.query                = search_engine_dna_array_query;
   engine->search_engine.free                 = search_engine_dna_array_free;
+  engine->search_engine.n_subjects           = 0;
+  engine->search_engine.search_done          = NULL;
+  engine->search_engine.search_done_data     = NULL;
 
-  engine->stats_context                      = saft_stats_context_new (options->word_size,
-                                                                       options->letter_frequencies, 4);
+  engine->stats_context                      = NULL;
+  engine->tmp_stats_context                  = NULL;
   engine->query_cache                        = NULL;
   engine->db_cache                           = NULL;
+  engine->db_entries                         = NULL;
+  engine->db                                 = NULL;
+  engine->db_mapped                          = NULL;
+  engine->db_slab                            = NULL;
+  engine->db_names                           = NULL;
+  engine->pool                               = NULL;
+  engine->pipeline                           = NULL;
+  engine->query_entries                      = NULL;
+  engine->batch                              = NULL;
+  engine->batch_counts                       = NULL;
+  engine->partial_searches                   = NULL;
   engine->search                             = NULL;
   engine->search_array                       = NULL;
   engine->tmp_search                         = NULL;
   engine->tmp_counts                         = NULL;
+  engine->subject                            = saft_sequence_new ();
   engine->n_queries                          = 0;
+  engine->n_db_entries                       = 0;
+  engine->n_batch                            = 0;
+  engine->n_scanned                          = 0;
   engine->max_words                          = 1 << (2 * options->word_size);
   engine->tmp_length                         = 0;
+  memset (engine->db_composition, 0, sizeof (engine->db_composition));
+
+  /* Otherwise, the context depends on the compositions of the sequences */
+  if (!saft_search_engine_query_composition_needed (options) &&
+      !saft_search_engine_db_composition_needed (options))
+    engine->stats_context = saft_search_engine_stats_context_new (options, NULL, NULL);
+  if (options->n_threads > 1)
+    engine->pool = saft_pool_new (options->n_threads);
 
   return (SaftSearchEngine*)engine;
 }
@@ -159,192 +426,296 @@ search_engine_dna_array_free (SaftSearchEngine *engine)
     dna_array_db_entry_free_all (se->query_cache);
   if (se->db_cache)
     dna_array_db_entry_free_all (se->db_cache);
+  if (se->db_entries)
+    free (se->db_entries);
+  search_engine_dna_array_unmap_db (se);
+  if (se->pool)
+    saft_pool_free (se->pool);
+  if (se->query_entries)
+    free (se->query_entries);
+  if (se->batch)
+    free (se->batch);
+  if (se->batch_counts)
+    free (se->batch_counts);
   if (se->search)
     saft_search_free (se->search);
   if (se->search_array)
     free (se->search_array);
+  saft_sequence_free (se->subject);
 
   free (se);
 }
 
+/**
+ * The letters of the sequence are tallied into composition as the words are
+ * counted
+ */
 static WordCount*
 search_engine_dna_array_hash_sequence (SearchEngineDNAArray *engine,
-                                       SaftSequence         *sequence)
+                                       SaftSequence         *sequence,
+                                       uint64_t             *composition)
 {
-  const size_t   k    = engine->search_engine.options->word_size;
-  const uint16_t mask = 0xffff >> (16 - (2 * k));
-  size_t         i;
-  uint16_t       w = 0;
+  DNAArrayCounter counter;
 
-  WordCount *counts __attribute__((aligned(1024))) = calloc (engine->max_words, sizeof (*counts));
-  //WordCount *counts  = calloc (engine->max_words, sizeof (*counts));
-  if (sequence->seq_length < k)
-    return counts;
+  dna_array_counter_begin (engine, &counter, NULL);
+  dna_array_counter_feed (engine, &counter, sequence->seq, sequence->seq_length);
 
-  /* TODO Compare speed of array lookup and switch conditional */
-  /* FIXME Check that the letters are in [ATGCatgc] */
-  /* FIXME Handle periodic boundary conditions */
-  for (i = 0; i < k; i++)
+  return dna_array_counter_end (engine, &counter, composition);
+}
+
+/**
+ * Same as search_engine_dna_array_hash_sequence, but the words are read
+ * straight from the 64 bits words of the packed sequence, each from the bits
+ * of its last base and the word before, rather than shifted in one base at a
+ * time. The composition is counted a whole word at a time.
+ */
+static WordCount*
+search_engine_dna_array_hash_packed (SearchEngineDNAArray     *engine,
+                                     const SaftPackedSequence *sequence,
+                                     uint64_t                 *composition)
+{
+  const size_t    k      = engine->search_engine.options->word_size;
+  const size_t    length = sequence->seq_length;
+  const uint16_t  mask   = 0xffff >> (16 - (2 * k));
+  DNAArrayCounter counter;
+  WordCount      *counts;
+  size_t          start  = 0;
+  size_t          r;
+
+  dna_array_counter_begin (engine, &counter, NULL);
+  saft_packed_sequence_composition (sequence, counter.composition);
+  counter.length = length;
+  counts         = counter.counts;
+
+  /* The words end k - 1 letters past the start of the sequence, or of the
+   * letters following a run of N */
+  for (r = 0; r <= sequence->n_n_runs; r++)
     {
-      const unsigned char c = SaftAlphabetDNA.codes[(int)sequence->seq[i]];
+      const size_t stop = r < sequence->n_n_runs ? sequence->n_runs[r].start : length;
+      size_t       last = start + k - 1;
 
-      w <<= 2;
-      w |= c;
+      while (last < stop)
+        {
+          const size_t   i    = last / NUCS_PER_WORD;
+          const uint64_t prev = i > 0 ? sequence->words[i - 1] : 0;
+          const uint64_t bits = sequence->words[i];
+          const size_t   end  = stop - i * NUCS_PER_WORD < NUCS_PER_WORD ?
+                                stop - i * NUCS_PER_WORD : NUCS_PER_WORD;
+          size_t         j    = last - i * NUCS_PER_WORD;
+
+          for (; j + 1 < k && j < end; j++)
+            ++counts[((bits >> (62 - 2 * j)) | (prev << (2 * j + 2))) & mask];
+          for (; j < end; j++)
+            ++counts[(bits >> (62 - 2 * j)) & mask];
+          last = i * NUCS_PER_WORD + end;
+        }
+      if (r < sequence->n_n_runs)
+        start = sequence->n_runs[r].start + sequence->n_runs[r].length;
     }
-  ++counts[w];
-  for (i = k; i < sequence->seq_length; i++)
+
+  return dna_array_counter_end (engine, &counter, composition);
+}
+
+/**
+ * When query is given, the words are streamed against the counts of the
+ * query and no counts are returned: D2 is left in counter->d2 instead
+ */
+static void
+dna_array_counter_begin (SearchEngineDNAArray *engine,
+                         DNAArrayCounter      *counter,
+                         const WordCount      *query)
+{
+  counter->counts  = query ? NULL : calloc (engine->max_words, sizeof (*counter->counts));
+  counter->query   = query;
+  counter->d2      = 0;
+  counter->length  = 0;
+  counter->n_known = 0;
+  counter->word    = 0;
+  memset (counter->composition, 0, sizeof (counter->composition));
+}
+
+/**
+ * The words spanning two pieces are carried over in counter->word. No word
+ * spans an unknown letter, such as the bases masked for their quality, and
+ * the unknown letters are left out of the composition
+ */
+static void
+dna_array_counter_feed (SearchEngineDNAArray *engine,
+                        DNAArrayCounter      *counter,
+                        const char           *letters,
+                        size_t                length)
+{
+  const size_t     k           = engine->search_engine.options->word_size;
+  const uint16_t   mask        = 0xffff >> (16 - (2 * k));
+  WordCount       *counts      = counter->counts;
+  const WordCount *query       = counter->query;
+  uint64_t         d2          = counter->d2;
+  uint64_t        *composition = counter->composition;
+  size_t           n_known     = counter->n_known;
+  uint16_t         w           = counter->word;
+  size_t           i;
+
+  /* FIXME Handle periodic boundary conditions */
+  for (i = 0; i < length; i++)
     {
-      const unsigned char c = SaftAlphabetDNA.codes[(int)sequence->seq[i]];
+      const unsigned char c = SaftNucleotideCodes[(unsigned char)letters[i]];
 
+      if (SAFT_UNLIKELY (c == NUC_UNKNOWN))
+        {
+          n_known = 0;
+          continue;
+        }
+      composition[c]++;
       w <<= 2;
       w |= c;
       w &= mask;
-      ++counts[w];
+      if (++n_known < k)
+        continue;
+      if (query)
+        d2 += query[w];
+      else
+        ++counts[w];
     }
-
-  return counts;
+  counter->d2      = d2;
+  counter->n_known = n_known;
+  counter->word    = w;
+  counter->length += length;
 }
 
-#ifdef __SSE2__
+/* Sequences shorter than a word are left out of the composition */
+static WordCount*
+dna_array_counter_end (SearchEngineDNAArray *engine,
+                       DNAArrayCounter      *counter,
+                       uint64_t             *composition)
+{
+  size_t i;
 
-#include <emmintrin.h>
+  if (counter->length >= engine->search_engine.options->word_size)
+    for (i = 0; i < NUC_NB; i++)
+      composition[i] += counter->composition[i];
 
-inline static long
-sse2_dot_prod (const uint16_t *p1,
-               const uint16_t *p2,
-               const size_t    size)
-{
-  unsigned long d2 = 0;
-  unsigned int  i;
+  return counter->counts;
+}
 
-  __m128i* mp1 = (__m128i *)p1;
-  __m128i* mp2 = (__m128i *)p2;
+static int
+dna_array_subject_begin (const char *name,
+                         size_t      name_length,
+                         void       *data)
+{
+  SearchEngineDNAArray *engine  = data;
+  SaftSequence         *subject = engine->subject;
 
-  for (i = 0; i < size; i += 8)
+  if (subject->name_alloc < name_length + 1)
     {
-      uint16_t res[8];
-      __m128i *pmres;
+      subject->name_alloc = name_length + 1;
+      subject->name       = realloc (subject->name, subject->name_alloc);
+    }
+  memcpy (subject->name, name, name_length);
+  subject->name[name_length] = '\0';
+  subject->name_length       = name_length;
+  /* Only set while a query is searched without caching */
+  dna_array_counter_begin (engine, &engine->subject_counter, engine->tmp_counts);
 
-      __m128i mtmp = _mm_mullo_epi16 (_mm_loadu_si128 (mp1),
-                                      _mm_loadu_si128 (mp2));
+  return 1;
+}
 
-      pmres = (__m128i*)res;
-      _mm_storeu_si128 (pmres, mtmp);
-      d2 += res[0]+res[1]+res[2]+res[3]+res[4]+res[5]+res[6]+res[7];
+static void
+dna_array_subject_feed (const char *letters,
+                        size_t      length,
+                        void       *data)
+{
+  SearchEngineDNAArray *engine = data;
 
-      mp1++;
-      mp2++;
-    }
+  dna_array_counter_feed (engine, &engine->subject_counter, letters, length);
+}
 
-  return d2;
+/* The subject gets the length of the sequence, but never its letters */
+static WordCount*
+dna_array_subject_end (SearchEngineDNAArray *engine,
+                       uint64_t             *composition)
+{
+  engine->subject->seq_length = engine->subject_counter.length;
+
+  return dna_array_counter_end (engine, &engine->subject_counter, composition);
 }
 
-/* FIXME The implementation below should be the best one if SSE4_1 is properly supported */
-#if 0
-#ifdef __SSE4_1__
-#include <smmintrin.h>
+/* The counts are 32 bits wide and their products can be as large as 2^64, so
+ * every product is widened to 64 bits before being accumulated: for
+ * chromosome-scale sequences, both the individual products and their sum go
+ * well beyond 2^32 */
+
+#ifdef __SSE2__
+
+#include <emmintrin.h>
 
-inline static short
-sse3_dot_prod (const uint16_t *p1,
-               const uint16_t *p2,
-               size_t          size)
+inline static uint64_t
+sse2_dot_prod (const WordCount *p1,
+               const WordCount *p2,
+               const size_t     size)
 {
-  unsigned long res[4];
-  unsigned int  i;
+  uint64_t res[2];
+  size_t   i;
 
-  __m128i* mp1  = (__m128i *)p1;
-  __m128i* mp2  = (__m128i *)p2;
-  __m128i  mres = _mm_set_epi32 (0, 0, 0, 0);
+  const __m128i *mp1  = (const __m128i *)p1;
+  const __m128i *mp2  = (const __m128i *)p2;
+  __m128i        mres = _mm_setzero_si128 ();
 
-  for (i = 0; i < size; i += 8)
+  for (i = 0; i < size; i += 4)
     {
+      const __m128i mreg1 = _mm_loadu_si128 (mp1);
+      const __m128i mreg2 = _mm_loadu_si128 (mp2);
 
-      __m128i mreg1 = _mm_loadu_si128 (mp1);
-      __m128i mreg2 = _mm_loadu_si128 (mp2);
-      __m128i xlo1  = _mm_unpacklo_epi16 (mreg1, _mm_set1_epi16 (0));
-      __m128i xlo2  = _mm_unpacklo_epi16 (mreg2, _mm_set1_epi16 (0));
-      __m128i mtmp  = _mm_mullo_epi32 (xlo1, xlo2);
-      mres          = _mm_add_epi32 (mres, mtmp);
-
-      __m128i xhi1 = _mm_unpackhi_epi16 (mreg1, _mm_set1_epi16 (0));
-      __m128i xhi2 = _mm_unpackhi_epi16 (mreg2, _mm_set1_epi16 (0));
-      mtmp         = _mm_mullo_epi32 (xhi1, xhi2);
-      mres         = _mm_add_epi32 (mres, mtmp);
-
-      /*
-      __m128i xlo1  = _mm_unpacklo_epi16 (_mm_loadu_si128 (mp1), _mm_set1_epi16 (0));
-      __m128i xlo2  = _mm_unpacklo_epi16 (_mm_loadu_si128 (mp2), _mm_set1_epi16 (0));
-      __m128i mtmp  = _mm_mullo_epi32 (xlo1, xlo2);
-      mres          = _mm_add_epi32 (mres, mtmp);
-
-      __m128i xhi1  = _mm_unpackhi_epi16 (_mm_loadu_si128 (mp1), _mm_set1_epi16 (0));
-      __m128i xhi2  = _mm_unpackhi_epi16 (_mm_loadu_si128 (mp2), _mm_set1_epi16 (0));
-      mtmp          = _mm_mullo_epi32 (xhi1, xhi2);
-      mres          = _mm_add_epi32 (mres, mtmp);
-      */
-
+      /* Lanes 0 and 2, then lanes 1 and 3, as 64 bits products */
+      mres = _mm_add_epi64 (mres, _mm_mul_epu32 (mreg1, mreg2));
+      mres = _mm_add_epi64 (mres, _mm_mul_epu32 (_mm_srli_epi64 (mreg1, 32),
+                                                 _mm_srli_epi64 (mreg2, 32)));
       mp1++;
       mp2++;
     }
 
-  __m128i* pmres = (__m128i *)res;
-  _mm_storeu_si128 (pmres, mres);
+  _mm_storeu_si128 ((__m128i *)res, mres);
 
-  return res[0]+res[1]+res[2]+res[3];
+  return res[0] + res[1];
 }
-#endif /* __SSE4_1__ */
-#endif /* 0 */
 
 #else /* !__SSE2__ */
 
-
-inline static long
-scalar_dot_prod (const uint16_t *p1,
-                 const uint16_t *p2,
-                 const size_t    size)
+inline static uint64_t
+scalar_dot_prod (const WordCount *p1,
+                 const WordCount *p2,
+                 const size_t     size)
 {
-      unsigned long d2 = 0;
-      int           i;
-
-      for (i = 0; i < engine->max_words; i += 4)
-        {
-          const unsigned int c11 = p1[i];
-          const unsigned int c12 = p1[i + 1];
-          const unsigned int c13 = p1[i + 2];
-          const unsigned int c14 = p1[i + 3];
-
-          const unsigned int c21 = p2[i];
-          const unsigned int c22 = p2[i + 1];
-          const unsigned int c23 = p2[i + 2];
-          const unsigned int c24 = p2[i + 3];
+  uint64_t d2 = 0;
+  size_t   i;
 
-          const unsigned long p1 = c11 * c21;
-          const unsigned long p2 = c12 * c22;
-          const unsigned long p3 = c13 * c23;
-          const unsigned long p4 = c14 * c24;
+  for (i = 0; i < size; i += 4)
+    {
+      const uint64_t prod1 = (uint64_t)p1[i]     * p2[i];
+      const uint64_t prod2 = (uint64_t)p1[i + 1] * p2[i + 1];
+      const uint64_t prod3 = (uint64_t)p1[i + 2] * p2[i + 2];
+      const uint64_t prod4 = (uint64_t)p1[i + 3] * p2[i + 3];
 
-          const unsigned long p12 = p1 + p2;
-          const unsigned long p34 = p3 + p4;
+      d2 += (prod1 + prod2) + (prod3 + prod4);
+    }
 
-          d2 += p12 + p34;
-        }
+  return d2;
 }
 
 #endif /* __SSE2__ */
 
 
-static unsigned long
+static uint64_t
 search_engine_dna_array_d2 (SearchEngineDNAArray *engine,
                             WordCount            *counts1,
                             WordCount            *counts2)
 {
   if (engine->max_words < 8)
     {
-      unsigned long d2 = 0;
-      int           i;
+      uint64_t d2 = 0;
+      size_t   i;
 
       for (i = 0; i < engine->max_words; i++)
-        d2 += counts1[i] * counts2[i];
+        d2 += (uint64_t)counts1[i] * counts2[i];
 
       return d2;
     }
@@ -364,24 +735,34 @@ search_engine_dna_array_search_two_sequences (SaftSearchEngine *engine,
   SearchEngineDNAArray *se;
   SaftSearch           *search;
   SaftResult           *result;
+  SaftStatsContext     *stats_context;
   WordCount            *counts_query;
   WordCount            *counts_subject;
+  uint64_t              composition_query[NUC_NB]   = {0};
+  uint64_t              composition_subject[NUC_NB] = {0};
   double                mean;
   double                var;
 
   se = (SearchEngineDNAArray*) engine;
 
-  counts_query         = search_engine_dna_array_hash_sequence (se, query);
-  counts_subject       = search_engine_dna_array_hash_sequence (se, subject);
+  counts_query         = search_engine_dna_array_hash_sequence (se, query, composition_query);
+  counts_subject       = search_engine_dna_array_hash_sequence (se, subject, composition_subject);
+  stats_context        = se->stats_context;
+  if (!stats_context)
+    stats_context      = saft_search_engine_stats_context_new (engine->options,
+                                                               composition_query,
+                                                               composition_subject);
   result               = saft_result_new ();
   result->d2           = search_engine_dna_array_d2 (se, counts_query, counts_subject);
-  mean                 = saft_stats_mean (se->stats_context,
+  mean                 = saft_stats_mean (stats_context,
                                           query->seq_length,
                                           subject->seq_length);
-  var                  = saft_stats_var (se->stats_context,
+  var                  = saft_stats_var (stats_context,
                                          query->seq_length,
                                          subject->seq_length);
   result->name         = strdup(subject->name);
+  result->mean         = mean;
+  result->var          = var;
   result->p_value      = saft_stats_pgamma_m_v (result->d2, mean, var);
   result->p_value_adj  = result->p_value;
   search               = saft_search_new (1);
@@ -390,6 +771,8 @@ search_engine_dna_array_search_two_sequences (SaftSearchEngine *engine,
 
   free (counts_query);
   free (counts_subject);
+  if (stats_context != se->stats_context)
+    saft_stats_context_free (stats_context);
 
   return search;
 }
@@ -405,7 +788,18 @@ search_engine_dna_array_search_all (SaftSearchEngine *engine,
 
   se = (SearchEngineDNAArray*) engine;
 
-  if (engine->options->cache_db)
+  /* A context built from the composition of another database is stale */
+  if (saft_search_engine_db_composition_needed (engine->options) && se->stats_context)
+    {
+      saft_stats_context_free (se->stats_context);
+      se->stats_context = NULL;
+    }
+  memset (se->db_composition, 0, sizeof (se->db_composition));
+
+  /* The database written by write_db is already counted, whatever is cached */
+  if (saft_db_is_db (db_path))
+    search = search_engine_dna_array_search_all_mapped (se, query_path, db_path);
+  else if (engine->options->cache_db)
     search = search_engine_dna_array_search_all_dcached (se, query_path, db_path);
   else if (engine->options->cache_queries)
     search = search_engine_dna_array_search_all_qcached (se, query_path, db_path);
@@ -421,9 +815,21 @@ search_engine_dna_array_search_all_no_cache (SearchEngineDNAArray *engine,
                                              const char           *query_path,
                                              const char           *db_path)
 {
+  SaftOptions *options = engine->search_engine.options;
+
+  if (saft_search_engine_db_composition_needed (options))
+    saft_search_engine_db_composition (options, db_path, engine->db_composition);
+  if (!engine->stats_context && !saft_search_engine_query_composition_needed (options))
+    engine->stats_context = saft_search_engine_stats_context_new (options, NULL, engine->db_composition);
+
+  if (options->n_threads > 1)
+    engine->pipeline = saft_pipeline_new (options->n_threads);
   saft_fasta_iter (query_path,
+                   &engine->search_engine.fasta_options,
                    search_engine_dna_array_queries_iter_func,
                    engine);
+  saft_pipeline_free (engine->pipeline);
+  engine->pipeline = NULL;
 
   engine->search = saft_search_reverse (engine->search);
 
@@ -435,98 +841,256 @@ search_engine_dna_array_queries_iter_func (SaftSequence *sequence,
                                            void         *data)
 {
   SearchEngineDNAArray *engine;
-
-  engine = (SearchEngineDNAArray*)data;
-
-  engine->tmp_counts       = search_engine_dna_array_hash_sequence (engine, sequence);
-  engine->tmp_length       = sequence->seq_length;
-  engine->tmp_search       = saft_search_new (engine->search_engine.options->max_results);
-  engine->tmp_search->name = strdup (sequence->name);
-
-  saft_fasta_iter (engine->search_engine.options->db_path,
-                   search_engine_dna_array_db_iter_func,
-                   engine);
+  SaftOptions          *options;
+  uint64_t              composition[NUC_NB] = {0};
+
+  engine  = (SearchEngineDNAArray*)data;
+  options = engine->search_engine.options;
+
+  engine->tmp_counts        = search_engine_dna_array_hash_sequence (engine, sequence, composition);
+  engine->tmp_length        = sequence->seq_length;
+  engine->n_scanned         = 0;
+  engine->tmp_search        = saft_search_new (engine->search_engine.options->max_results);
+  engine->tmp_search->name  = strdup (sequence->name);
+  engine->tmp_stats_context = engine->stats_context;
+  if (!engine->tmp_stats_context)
+    engine->tmp_stats_context = saft_search_engine_stats_context_new (engine->search_engine.options,
+                                                                      composition,
+                                                                      engine->db_composition);
+
+  if (engine->pipeline)
+    engine->search_engine.n_subjects = saft_pipeline_run (engine->pipeline,
+                                                          options->db_path,
+                                                          &engine->search_engine.fasta_options,
+                                                          options->shard,
+                                                          options->n_shards,
+                                                          search_engine_dna_array_pipeline_work,
+                                                          search_engine_dna_array_pipeline_output,
+                                                          engine);
+  else
+    engine->search_engine.n_subjects = saft_search_engine_db_iter_fragments (options,
+                                                                             options->db_path,
+                                                                             &dna_array_scan_funcs,
+                                                                             engine);
 
   free (engine->tmp_counts);
   engine->tmp_counts = NULL;
+  if (engine->tmp_stats_context != engine->stats_context)
+    saft_stats_context_free (engine->tmp_stats_context);
+  engine->tmp_stats_context = NULL;
 
-  if (engine->tmp_search->n_results == 0)
-    saft_search_free (engine->tmp_search);
-  else
-    {
-      engine->tmp_search->next = engine->search;
-      engine->search           = engine->tmp_search;
-    }
+  engine->search     = saft_search_engine_add_search (&engine->search_engine,
+                                                      engine->search,
+                                                      engine->tmp_search);
   engine->tmp_search = NULL;
 
   return 1;
 }
 
-static int
-search_engine_dna_array_db_iter_func (SaftSequence *sequence,
-                                      void         *data)
+/* The words of the subject are streamed against the counts of the query */
+static void
+search_engine_dna_array_score_subject (SearchEngineDNAArray *engine,
+                                       SaftSearch           *search,
+                                       SaftSequence         *sequence,
+                                       size_t                subject)
+{
+  DNAArrayCounter       counter;
+
+  dna_array_counter_begin (engine, &counter, engine->tmp_counts);
+  dna_array_counter_feed (engine, &counter, sequence->seq, sequence->seq_length);
+  search_engine_dna_array_score_d2 (engine, search, counter.d2, sequence, subject);
+}
+
+static void
+search_engine_dna_array_score_d2 (SearchEngineDNAArray *engine,
+                                  SaftSearch           *search,
+                                  uint64_t              d2,
+                                  SaftSequence         *sequence,
+                                  size_t                subject)
 {
-  SearchEngineDNAArray *engine;
-  WordCount            *counts;
-  unsigned long         d2;
   double                mean;
   double                var;
 
-  engine = (SearchEngineDNAArray*)data;
-  counts = search_engine_dna_array_hash_sequence (engine, sequence);
-  d2     = search_engine_dna_array_d2 (engine,
-                                       engine->tmp_counts,
-                                       counts);
-  mean   = saft_stats_mean (engine->stats_context,
+  mean   = saft_stats_mean (engine->tmp_stats_context,
                             sequence->seq_length,
                             engine->tmp_length);
-  var    = saft_stats_var (engine->stats_context,
+  var    = saft_stats_var (engine->tmp_stats_context,
                            sequence->seq_length,
                            engine->tmp_length);
-  free (counts);
 
   /* FIXME adjust this euristic depending on the user's required significance level */
   /* Fix this here and everywhere else in this file */
   if (d2 > mean + 2 * sqrt (var))
     {
-      SaftResult    *result;
-
-      result          = saft_result_new ();
-      result->d2      = d2;
-      result->p_value = saft_stats_pgamma_m_v (result->d2, mean, var);
-      result->name    = strdup(sequence->name);
-      saft_search_add_result (engine->tmp_search, result);
+      saft_search_add_hit (search, subject, sequence->name, d2, mean, var,
+                           saft_stats_pgamma_m_v (d2, mean, var));
     }
+}
+
+static int
+search_engine_dna_array_db_iter_func (void *data)
+{
+  SearchEngineDNAArray *engine              = (SearchEngineDNAArray*)data;
+  uint64_t              composition[NUC_NB] = {0};
+
+  dna_array_subject_end (engine, composition);
+  search_engine_dna_array_score_d2 (engine, engine->tmp_search,
+                                    engine->subject_counter.d2, engine->subject,
+                                    engine->n_scanned++);
 
   return 1;
 }
 
+/* Each batch of the database gets its own heap, which are merged in order */
+static void
+search_engine_dna_array_pipeline_work (SaftSequenceBatch *batch,
+                                       unsigned int       worker,
+                                       void              *data)
+{
+  SearchEngineDNAArray *engine = (SearchEngineDNAArray*)data;
+  SaftSearch           *search;
+  size_t                i;
+
+  search      = saft_search_new (engine->search_engine.options->max_results);
+  batch->data = search;
+  for (i = 0; i < batch->n_sequences; i++)
+    search_engine_dna_array_score_subject (engine, search, batch->sequences[i],
+                                           batch->first + i);
+}
+
+static void
+search_engine_dna_array_pipeline_output (SaftSequenceBatch *batch,
+                                         void              *data)
+{
+  SearchEngineDNAArray *engine = (SearchEngineDNAArray*)data;
+
+  saft_search_merge (engine->tmp_search, batch->data);
+  batch->data = NULL;
+}
+
 static int
 search_engine_dna_array_cache_sequence (SaftSequence *sequence,
                                         void         *data)
 {
   SearchEngineDNAArray *engine;
   DNAArrayDBEntry      *entry;
+  SaftOptions          *options;
+  uint64_t              composition[NUC_NB] = {0};
 
   engine        = (SearchEngineDNAArray*)data;
+  options       = engine->search_engine.options;
   entry         = dna_array_db_entry_new ();
-  entry->counts = search_engine_dna_array_hash_sequence (engine, sequence);
   entry->name   = strdup (sequence->name);
   entry->length = sequence->seq_length;
+  entry->counts = search_engine_dna_array_hash_sequence (engine, sequence, composition);
+  if (!engine->stats_context)
+    entry->stats_context = saft_search_engine_stats_context_new (options,
+                                                                 composition,
+                                                                 engine->db_composition);
+  entry->next         = engine->query_cache;
+  engine->query_cache = entry;
+  engine->n_queries++;
+
+  return 1;
+}
+
+static int
+search_engine_dna_array_cache_subject (void *data)
+{
+  SearchEngineDNAArray *engine;
+  DNAArrayDBEntry      *entry;
+  unsigned int          i;
+
+  engine           = (SearchEngineDNAArray*)data;
+  entry            = dna_array_db_entry_new ();
+  entry->counts    = dna_array_subject_end (engine, entry->composition);
+  entry->name      = strdup (engine->subject->name);
+  entry->length    = engine->subject->seq_length;
+  entry->next      = engine->db_cache;
+  engine->db_cache = entry;
+
+  /* The composition of the database is gathered while caching it, unless
+   * only a shard is cached and the composition was read beforehand */
+  if (engine->search_engine.options->n_shards == 1)
+    for (i = 0; i < NUC_NB; i++)
+      engine->db_composition[i] += entry->composition[i];
 
-  if (engine->search_engine.options->cache_db)
+  return 1;
+}
+
+typedef struct _DNAArrayCacheRanges DNAArrayCacheRanges;
+
+struct _DNAArrayCacheRanges
+{
+  SearchEngineDNAArray  *engine;
+  /* The entries of each range, last one first */
+  DNAArrayDBEntry      **caches;
+  /* The composition of what each thread parsed */
+  uint64_t              (*compositions)[NUC_NB];
+};
+
+static int
+dna_array_cache_range_func (SaftSequence *sequence,
+                            size_t        range,
+                            unsigned int  thread,
+                            void         *data)
+{
+  DNAArrayCacheRanges *ranges = data;
+  DNAArrayDBEntry     *entry;
+  unsigned int         i;
+
+  entry                 = dna_array_db_entry_new ();
+  entry->name           = strdup (sequence->name);
+  entry->length         = sequence->seq_length;
+  entry->counts         = search_engine_dna_array_hash_sequence (ranges->engine, sequence,
+                                                                  entry->composition);
+  for (i = 0; i < NUC_NB; i++)
+    ranges->compositions[thread][i] += entry->composition[i];
+  entry->next           = ranges->caches[range];
+  ranges->caches[range] = entry;
+
+  return 1;
+}
+
+static void
+search_engine_dna_array_cache_db_parallel (SearchEngineDNAArray *engine,
+                                           const char           *db_path)
+{
+  const size_t        n_threads = saft_pool_n_threads (engine->pool);
+  const size_t        n_ranges  = n_threads * DNA_ARRAY_RANGES_PER_THREAD;
+  DNAArrayCacheRanges ranges;
+  size_t              i;
+  unsigned int        j;
+
+  ranges.engine       = engine;
+  ranges.caches       = calloc (n_ranges, sizeof (*ranges.caches));
+  ranges.compositions = calloc (n_threads, sizeof (*ranges.compositions));
+
+  saft_fasta_iter_parallel (db_path,
+                            &engine->search_engine.fasta_options,
+                            engine->pool,
+                            n_ranges,
+                            dna_array_cache_range_func,
+                            &ranges);
+
+  /* The cache is kept last sequence first, as when it is read sequentially */
+  for (i = 0; i < n_ranges; i++)
     {
+      DNAArrayDBEntry *entry = ranges.caches[i];
+
+      if (!entry)
+        continue;
+      while (entry->next)
+        entry = entry->next;
       entry->next      = engine->db_cache;
-      engine->db_cache = entry;
-    }
-  else
-    {
-      entry->next         = engine->query_cache;
-      engine->query_cache = entry;
-      engine->n_queries++;
+      engine->db_cache = ranges.caches[i];
     }
+  for (j = 0; j < n_threads; j++)
+    for (i = 0; i < NUC_NB; i++)
+      engine->db_composition[i] += ranges.compositions[j][i];
 
-  return 1;
+  free (ranges.compositions);
+  free (ranges.caches);
 }
 
 static SaftSearch*
@@ -534,72 +1098,626 @@ search_engine_dna_array_search_all_dcached (SearchEngineDNAArray *engine,
                                             const char           *query_path,
                                             const char           *db_path)
 {
-  saft_fasta_iter (db_path,
-                   search_engine_dna_array_cache_sequence,
-                   engine);
-  saft_fasta_iter (query_path,
-                   search_engine_dna_array_search_query,
-                   engine);
+  search_engine_dna_array_cache_db (engine, db_path);
+
+  return search_engine_dna_array_search_cached_db (engine, query_path, -1, NULL);
+}
+
+static void
+search_engine_dna_array_cache_db (SearchEngineDNAArray *engine,
+                                  const char           *db_path)
+{
+  SaftOptions     *options = engine->search_engine.options;
+  DNAArrayDBEntry *entry;
+  size_t           i;
+
+  /* The database cached before, or mapped, is replaced */
+  search_engine_dna_array_unmap_db (engine);
+
+  /* The composition of a shard is not that of the whole database */
+  if (options->n_shards > 1 && saft_search_engine_db_composition_needed (options))
+    saft_search_engine_db_composition (options, db_path, engine->db_composition);
+
+  /* The ranks of the sequences are only known when the database is read
+   * sequentially */
+  if (engine->pool && options->n_shards == 1)
+    search_engine_dna_array_cache_db_parallel (engine, db_path);
+  else
+    saft_search_engine_db_iter_fragments (options,
+                                          db_path,
+                                          &dna_array_cache_db_funcs,
+                                          engine);
+
+  for (entry = engine->db_cache, i = 0; entry; entry = entry->next, i++);
+  engine->n_db_entries             = i;
+  engine->search_engine.n_subjects = i;
+  engine->db_entries   = realloc (engine->db_entries,
+                                  engine->n_db_entries * sizeof (*engine->db_entries));
+  /* The cache is last sequence first, the entries are in file order so
+   * that their indices are the ranks of the sequences */
+  for (entry = engine->db_cache, i = engine->n_db_entries; entry; entry = entry->next)
+    engine->db_entries[--i] = entry;
+  search_engine_dna_array_pack_db (engine);
+}
+
+/**
+ * Moves the cached entries to a contiguous array, in the order they are
+ * scanned, their counts to a single slab and their names to a single block,
+ * as if the database was mapped, so that scanning it reads the memory
+ * sequentially
+ */
+static void
+search_engine_dna_array_pack_db (SearchEngineDNAArray *engine)
+{
+  const size_t  n_entries  = engine->n_db_entries;
+  const size_t  n_counts   = engine->max_words;
+  char         *names;
+  size_t        names_size = 0;
+  size_t        i;
+
+  if (n_entries == 0)
+    return;
+
+  for (i = 0; i < n_entries; i++)
+    names_size += strlen (engine->db_entries[i]->name) + 1;
+  engine->db_mapped = malloc (n_entries * sizeof (*engine->db_mapped));
+  engine->db_slab   = saft_search_engine_slab_new (n_entries * n_counts * sizeof (*engine->db_slab));
+  engine->db_names  = malloc (names_size);
+
+  for (i = 0, names = engine->db_names; i < n_entries; i++)
+    {
+      DNAArrayDBEntry *entry  = engine->db_entries[i];
+      DNAArrayDBEntry *packed = engine->db_mapped + i;
+      const size_t     size   = strlen (entry->name) + 1;
+
+      *packed               = *entry;
+      packed->next          = NULL;
+      packed->counts        = engine->db_slab + i * n_counts;
+      packed->name          = memcpy (names, entry->name, size);
+      memcpy (packed->counts, entry->counts, n_counts * sizeof (*packed->counts));
+      names                += size;
+      engine->db_entries[i] = packed;
+      dna_array_db_entry_free (entry);
+    }
+  engine->db_cache = NULL;
+}
+
+/* Searches the queries against engine->db_entries, those of the NULL
+ * terminated queries or read from query_fd when query_path is NULL */
+static SaftSearch*
+search_engine_dna_array_search_cached_db (SearchEngineDNAArray *engine,
+                                          const char           *query_path,
+                                          int                   query_fd,
+                                          SaftSequence        **queries)
+{
+  SaftOptions       *options = engine->search_engine.options;
+  SaftFastaIterFunc  func    = search_engine_dna_array_search_query;
+
+  /* The context only depends on the cached database and is built once */
+  if (!engine->stats_context && !saft_search_engine_query_composition_needed (options))
+    engine->stats_context = saft_search_engine_stats_context_new (options, NULL, engine->db_composition);
+
+  if (engine->pool)
+    {
+      engine->batch   = realloc (engine->batch,
+                                 DNA_ARRAY_BATCH_PER_THREAD * saft_pool_n_threads (engine->pool) *
+                                 sizeof (*engine->batch));
+      engine->n_batch = 0;
+      func            = search_engine_dna_array_batch_query;
+    }
+  if (query_path)
+    saft_fasta_iter (query_path, &engine->search_engine.fasta_options, func, engine);
+  else if (queries)
+    while (*queries && func (*queries++, engine));
+  else
+    saft_fasta_iter_fd (query_fd, &engine->search_engine.fasta_options, func, engine);
+  if (engine->pool)
+    search_engine_dna_array_search_batch (engine);
 
   engine->search = saft_search_reverse (engine->search);
 
   return engine->search;
 }
 
+static SaftSearch*
+search_engine_dna_array_search_all_mapped (SearchEngineDNAArray *engine,
+                                           const char           *query_path,
+                                           const char           *db_path)
+{
+  if (search_engine_dna_array_map_db (engine, db_path))
+    return NULL;
+
+  return search_engine_dna_array_search_cached_db (engine, query_path, -1, NULL);
+}
+
+/* The database is cached, or mapped, once for all the searches of
+ * search_loaded */
+static int
+search_engine_dna_array_load_db (SaftSearchEngine *engine,
+                                 const char       *db_path)
+{
+  SearchEngineDNAArray *se = (SearchEngineDNAArray*)engine;
+
+  memset (se->db_composition, 0, sizeof (se->db_composition));
+  if (saft_db_is_db (db_path))
+    return search_engine_dna_array_map_db (se, db_path);
+  search_engine_dna_array_cache_db (se, db_path);
+
+  return 0;
+}
+
+static SaftSearch*
+search_engine_dna_array_search_loaded (SaftSearchEngine  *engine,
+                                       int                query_fd,
+                                       SaftSequence     **queries)
+{
+  SearchEngineDNAArray *se     = (SearchEngineDNAArray*)engine;
+  SaftSearch           *search;
+
+  search     = search_engine_dna_array_search_cached_db (se, NULL, query_fd, queries);
+  se->search = NULL;
+
+  return search;
+}
+
+static SaftDatabase*
+search_engine_dna_array_database_new (SaftSearchEngine *engine,
+                                      const char       *db_path)
+{
+  SearchEngineDNAArray *se = (SearchEngineDNAArray*)engine;
+  DNAArrayDatabase     *database;
+  int                   ret;
+
+  database                  = calloc (1, sizeof (*database));
+  database->database.engine = engine;
+  if (!db_path)
+    return &database->database;
+
+  search_engine_dna_array_swap_database (se, database);
+  ret = search_engine_dna_array_load_db (engine, db_path);
+  search_engine_dna_array_swap_database (se, database);
+  if (ret)
+    {
+      search_engine_dna_array_database_free (&database->database);
+      return NULL;
+    }
+  database->db_entries_alloc = database->n_db_entries;
+
+  return &database->database;
+}
+
+/* The sequence is appended to the entries, the cache only keeping track of
+ * what to free */
+static int
+search_engine_dna_array_database_add (SaftDatabase *database,
+                                      SaftSequence *sequence)
+{
+  DNAArrayDatabase     *db     = (DNAArrayDatabase*)database;
+  SearchEngineDNAArray *engine = (SearchEngineDNAArray*)database->engine;
+  DNAArrayDBEntry      *entry;
+  unsigned int          i;
+
+  entry                              = dna_array_db_entry_new ();
+  entry->name                        = strdup (sequence->name);
+  entry->length                      = sequence->seq_length;
+  entry->counts                      = search_engine_dna_array_hash_sequence (engine, sequence,
+                                                                               entry->composition);
+  entry->next                        = db->db_cache;
+  db->db_cache                       = entry;
+  if (db->n_db_entries == db->db_entries_alloc)
+    {
+      db->db_entries_alloc = db->db_entries_alloc ? db->db_entries_alloc << 1 : DNA_ARRAY_DB_ENTRIES_INIT;
+      db->db_entries       = realloc (db->db_entries, db->db_entries_alloc * sizeof (*db->db_entries));
+    }
+  db->db_entries[db->n_db_entries++] = entry;
+  for (i = 0; i < NUC_NB; i++)
+    db->db_composition[i] += entry->composition[i];
+
+  /* The context was built from the previous composition of the database */
+  if (db->stats_context &&
+      saft_search_engine_db_composition_needed (engine->search_engine.options))
+    {
+      saft_stats_context_free (db->stats_context);
+      db->stats_context = NULL;
+    }
+
+  return 0;
+}
+
+static void
+search_engine_dna_array_database_free (SaftDatabase *database)
+{
+  DNAArrayDatabase *db = (DNAArrayDatabase*)database;
+
+  if (db->stats_context)
+    saft_stats_context_free (db->stats_context);
+  if (db->db_cache)
+    dna_array_db_entry_free_all (db->db_cache);
+  if (db->db_entries)
+    free (db->db_entries);
+  if (db->db_mapped)
+    free (db->db_mapped);
+  if (db->db_slab)
+    free (db->db_slab);
+  if (db->db_names)
+    free (db->db_names);
+  saft_db_close (db->db);
+
+  free (db);
+}
+
+static SaftSearch*
+search_engine_dna_array_query (SaftSearchEngine  *engine,
+                               SaftDatabase      *database,
+                               SaftSequence     **queries)
+{
+  SearchEngineDNAArray *se     = (SearchEngineDNAArray*)engine;
+  SaftSearch           *search;
+
+  search_engine_dna_array_swap_database (se, (DNAArrayDatabase*)database);
+  engine->n_subjects = se->n_db_entries;
+  search             = search_engine_dna_array_search_cached_db (se, NULL, -1, queries);
+  se->search         = NULL;
+  search_engine_dna_array_swap_database (se, (DNAArrayDatabase*)database);
+
+  return search;
+}
+
+static void
+search_engine_dna_array_swap_database (SearchEngineDNAArray *engine,
+                                       DNAArrayDatabase     *database)
+{
+  DNAArrayDatabase tmp;
+
+  tmp.stats_context = engine->stats_context;
+  tmp.db_cache      = engine->db_cache;
+  tmp.db_entries    = engine->db_entries;
+  tmp.db            = engine->db;
+  tmp.db_mapped     = engine->db_mapped;
+  tmp.db_slab       = engine->db_slab;
+  tmp.db_names      = engine->db_names;
+  tmp.n_db_entries  = engine->n_db_entries;
+  memcpy (tmp.db_composition, engine->db_composition, sizeof (tmp.db_composition));
+
+  engine->stats_context = database->stats_context;
+  engine->db_cache      = database->db_cache;
+  engine->db_entries    = database->db_entries;
+  engine->db            = database->db;
+  engine->db_mapped     = database->db_mapped;
+  engine->db_slab       = database->db_slab;
+  engine->db_names      = database->db_names;
+  engine->n_db_entries  = database->n_db_entries;
+  memcpy (engine->db_composition, database->db_composition, sizeof (engine->db_composition));
+
+  database->stats_context = tmp.stats_context;
+  database->db_cache      = tmp.db_cache;
+  database->db_entries    = tmp.db_entries;
+  database->db            = tmp.db;
+  database->db_mapped     = tmp.db_mapped;
+  database->db_slab       = tmp.db_slab;
+  database->db_names      = tmp.db_names;
+  database->n_db_entries  = tmp.n_db_entries;
+  memcpy (database->db_composition, tmp.db_composition, sizeof (database->db_composition));
+}
+
+/**
+ * The counts are written in the order of the database, as they are cached,
+ * along with the composition of the sequences longer than a word, as it is
+ * gathered while caching
+ */
+static int
+search_engine_dna_array_write_db (SaftSearchEngine *engine,
+                                  const char       *db_path,
+                                  const char       *out_path,
+                                  int               append)
+{
+  SearchEngineDNAArray *se      = (SearchEngineDNAArray*)engine;
+  SaftOptions          *options = engine->options;
+  SaftDBWriter         *writer;
+  size_t                i;
+
+  writer = saft_db_writer_new (out_path,
+                               options->alphabet->name,
+                               options->alphabet->size,
+                               options->word_size,
+                               SAFT_DB_COUNTS_ARRAY,
+                               sizeof (WordCount),
+                               append);
+  if (!writer)
+    return 1;
+
+  search_engine_dna_array_cache_db (se, db_path);
+  for (i = 0; i < se->n_db_entries; i++)
+    {
+      DNAArrayDBEntry *entry = se->db_entries[i];
+      SaftDBRecord     record;
+
+      memset (&record, 0, sizeof (record));
+      record.length   = entry->length;
+      record.n_counts = se->max_words;
+      saft_db_writer_add (writer, &record, entry->name, entry->counts, entry->composition);
+    }
+
+  return saft_db_writer_close (writer);
+}
+
+/* The entries of the shard point into the map, the composition being that of
+ * the whole database */
+static int
+search_engine_dna_array_map_db (SearchEngineDNAArray *engine,
+                                const char           *db_path)
+{
+  SaftOptions *options = engine->search_engine.options;
+  SaftDB      *db;
+  size_t       first;
+  size_t       last;
+  size_t       i;
+
+  search_engine_dna_array_unmap_db (engine);
+  if (!(db = saft_db_open (db_path)))
+    return 1;
+  if (db->header->counts_type != SAFT_DB_COUNTS_ARRAY ||
+      db->header->count_size != sizeof (WordCount) ||
+      db->header->word_size != options->word_size ||
+      strcmp (db->header->alphabet, options->alphabet->name))
+    {
+      saft_error ("`%s' was not written for %s words of size %lu",
+                  db_path, options->alphabet->name, (unsigned long)options->word_size);
+      saft_db_close (db);
+      return 1;
+    }
+
+  saft_db_split (db, options->shard, options->n_shards, &first, &last);
+  engine->db                       = db;
+  engine->db_mapped                = calloc (last - first, sizeof (*engine->db_mapped));
+  engine->n_db_entries             = last - first;
+  engine->search_engine.n_subjects = last - first;
+  engine->db_entries               = realloc (engine->db_entries,
+                                              engine->n_db_entries * sizeof (*engine->db_entries));
+  for (i = 0; i < engine->n_db_entries; i++)
+    {
+      DNAArrayDBEntry *entry = engine->db_mapped + i;
+
+      if (db->sequences[first + i].record->n_counts != engine->max_words)
+        {
+          saft_error ("`%s' is truncated or corrupted", db_path);
+          search_engine_dna_array_unmap_db (engine);
+          return 1;
+        }
+      entry->counts         = (WordCount*)saft_db_counts (db, first + i);
+      entry->name           = (char*)saft_db_name (db, first + i);
+      entry->length         = db->sequences[first + i].record->length;
+      engine->db_entries[i] = entry;
+    }
+  for (i = 0; i < NUC_NB; i++)
+    engine->db_composition[i] = db->composition[i];
+
+  return 0;
+}
+
+static void
+search_engine_dna_array_unmap_db (SearchEngineDNAArray *engine)
+{
+  if (engine->db_mapped)
+    free (engine->db_mapped);
+  if (engine->db_slab)
+    free (engine->db_slab);
+  if (engine->db_names)
+    free (engine->db_names);
+  saft_db_close (engine->db);
+  engine->db_mapped    = NULL;
+  engine->db_slab      = NULL;
+  engine->db_names     = NULL;
+  engine->db           = NULL;
+  engine->n_db_entries = 0;
+}
+
 static int
 search_engine_dna_array_search_query (SaftSequence *sequence,
                                       void         *data)
 {
   SearchEngineDNAArray *engine;
   SaftSearch           *search;
-  DNAArrayDBEntry      *entry;
+  SaftStatsContext     *stats_context;
   WordCount            *counts;
+  uint64_t              composition[NUC_NB] = {0};
 
-  engine       = (SearchEngineDNAArray*)data;
-  counts       = search_engine_dna_array_hash_sequence (engine, sequence);
-  search       = saft_search_new (engine->search_engine.options->max_results);
-  search->name = strdup (sequence->name);
+  engine        = (SearchEngineDNAArray*)data;
+  counts        = search_engine_dna_array_hash_sequence (engine, sequence, composition);
+  search        = saft_search_new (engine->search_engine.options->max_results);
+  search->name  = strdup (sequence->name);
+  stats_context = engine->stats_context;
+  if (!stats_context)
+    stats_context = saft_search_engine_stats_context_new (engine->search_engine.options,
+                                                          composition,
+                                                          engine->db_composition);
+
+  search_engine_dna_array_scan_db (engine, search, counts, sequence->seq_length,
+                                   stats_context, 0, engine->n_db_entries);
+
+  free (counts);
+  if (stats_context != engine->stats_context)
+    saft_stats_context_free (stats_context);
 
-  for (entry = engine->db_cache; entry; entry = entry->next)
+  saft_search_resolve_names (search, search_engine_dna_array_subject_name, engine);
+  engine->search = saft_search_engine_add_search (&engine->search_engine,
+                                                  engine->search,
+                                                  search);
+
+  return 1;
+}
+
+static const char*
+search_engine_dna_array_subject_name (size_t  subject,
+                                      void   *data)
+{
+  SearchEngineDNAArray *engine = data;
+
+  return engine->db_entries[subject]->name;
+}
+
+/**
+ * Compares a query to the entries [first, last) of the database cache.
+ * Only reads the engine, hence can be called from several threads.
+ */
+static void
+search_engine_dna_array_scan_db (SearchEngineDNAArray *engine,
+                                 SaftSearch           *search,
+                                 WordCount            *counts,
+                                 size_t                length,
+                                 SaftStatsContext     *stats_context,
+                                 size_t                first,
+                                 size_t                last)
+{
+  size_t i;
+
+  for (i = first; i < last; i++)
     {
-      unsigned long d2;
-      double        mean;
-      double        var;
+      DNAArrayDBEntry *entry = engine->db_entries[i];
+      uint64_t         d2;
+      double           mean;
+      double           var;
 
       d2   = search_engine_dna_array_d2 (engine,
                                          entry->counts,
                                          counts);
-      mean = saft_stats_mean (engine->stats_context,
-                              sequence->seq_length,
+      mean = saft_stats_mean (stats_context,
+                              length,
                               entry->length);
-      var  = saft_stats_var (engine->stats_context,
-                             sequence->seq_length,
+      var  = saft_stats_var (stats_context,
+                             length,
                              entry->length);
 
       /* FIXME adjust this euristic depending on the user's required significance level */
       if (d2 > mean + 2 * sqrt (var))
         {
-          SaftResult    *result;
-
-          result          = saft_result_new ();
-          result->d2      = d2;
-          result->p_value = saft_stats_pgamma_m_v (result->d2, mean, var);
-          result->name    = strdup (entry->name);
-          saft_search_add_result (search, result);
+          saft_search_add_subject (search, i, d2, mean, var,
+                                   saft_stats_pgamma_m_v (d2, mean, var));
         }
     }
+}
 
-  free (counts);
+/* Threaded search of the cached database.
+ * Queries are gathered in batches, and each batch is searched in two parallel
+ * steps: counting the words of the queries, then scanning the database. When a
+ * batch has fewer queries than threads, the database is split into slices and
+ * every (query, slice) pair gets its own heap. The heaps of the slices of a
+ * query are then merged in order, so the results do not depend on the
+ * scheduling of the threads. */
 
-  if (search->n_results == 0)
-    saft_search_free (search);
-  else
+typedef struct _DNAArrayBatch DNAArrayBatch;
+
+struct _DNAArrayBatch
+{
+  SearchEngineDNAArray  *engine;
+  WordCount            **counts;
+  SaftStatsContext     **stats_contexts;
+  SaftSearch           **searches;
+  size_t                 n_slices;
+};
+
+static void
+dna_array_batch_count_func (size_t        task,
+                            unsigned int  thread,
+                            void         *data)
+{
+  DNAArrayBatch        *batch    = data;
+  SearchEngineDNAArray *engine   = batch->engine;
+  SaftPackedSequence   *sequence = engine->batch[task];
+  uint64_t              composition[NUC_NB] = {0};
+
+  batch->counts[task]         = search_engine_dna_array_hash_packed (engine, sequence, composition);
+  batch->stats_contexts[task] = engine->stats_context;
+  if (!engine->stats_context)
+    batch->stats_contexts[task] = saft_search_engine_stats_context_new (engine->search_engine.options,
+                                                                        composition,
+                                                                        engine->db_composition);
+}
+
+static void
+dna_array_batch_scan_func (size_t        task,
+                           unsigned int  thread,
+                           void         *data)
+{
+  DNAArrayBatch        *batch  = data;
+  SearchEngineDNAArray *engine = batch->engine;
+  const size_t          query  = task / batch->n_slices;
+  const size_t          slice  = task % batch->n_slices;
+  SaftSearch           *search;
+
+  search                 = saft_search_new (engine->search_engine.options->max_results);
+  batch->searches[task]  = search;
+  search_engine_dna_array_scan_db (engine,
+                                   search,
+                                   batch->counts[query],
+                                   engine->batch[query]->seq_length,
+                                   batch->stats_contexts[query],
+                                   slice * engine->n_db_entries / batch->n_slices,
+                                   (slice + 1) * engine->n_db_entries / batch->n_slices);
+}
+
+static int
+search_engine_dna_array_batch_query (SaftSequence *sequence,
+                                     void         *data)
+{
+  SearchEngineDNAArray *engine = (SearchEngineDNAArray*)data;
+
+  engine->batch[engine->n_batch] = saft_sequence_pack (sequence);
+  engine->n_batch++;
+  if (engine->n_batch == DNA_ARRAY_BATCH_PER_THREAD * saft_pool_n_threads (engine->pool))
+    search_engine_dna_array_search_batch (engine);
+
+  return 1;
+}
+
+static void
+search_engine_dna_array_search_batch (SearchEngineDNAArray *engine)
+{
+  const size_t   n_threads = saft_pool_n_threads (engine->pool);
+  const size_t   n_queries = engine->n_batch;
+  DNAArrayBatch  batch;
+  size_t         i;
+
+  if (n_queries == 0)
+    return;
+
+  batch.engine         = engine;
+  batch.n_slices       = (n_threads + n_queries - 1) / n_queries;
+  if (batch.n_slices > engine->n_db_entries)
+    batch.n_slices = engine->n_db_entries;
+  if (batch.n_slices < 1)
+    batch.n_slices = 1;
+  batch.counts         = malloc (n_queries * sizeof (*batch.counts));
+  batch.stats_contexts = malloc (n_queries * sizeof (*batch.stats_contexts));
+  batch.searches       = malloc (n_queries * batch.n_slices * sizeof (*batch.searches));
+
+  saft_pool_run (engine->pool, n_queries, dna_array_batch_count_func, &batch);
+  saft_pool_run (engine->pool, n_queries * batch.n_slices, dna_array_batch_scan_func, &batch);
+
+  for (i = 0; i < n_queries; i++)
     {
-      search->next = engine->search;
-      engine->search = search;
+      SaftSearch *search = batch.searches[i * batch.n_slices];
+      size_t      j;
+
+      for (j = 1; j < batch.n_slices; j++)
+        saft_search_merge (search, batch.searches[i * batch.n_slices + j]);
+      search->name = strdup (engine->batch[i]->name);
+      saft_search_resolve_names (search, search_engine_dna_array_subject_name, engine);
+
+      engine->search = saft_search_engine_add_search (&engine->search_engine,
+                                                      engine->search,
+                                                      search);
+
+      free (batch.counts[i]);
+      if (batch.stats_contexts[i] != engine->stats_context)
+        saft_stats_context_free (batch.stats_contexts[i]);
+      saft_packed_sequence_free (engine->batch[i]);
     }
+  engine->n_batch = 0;
 
-  return 1;
+  free (batch.counts);
+  free (batch.stats_contexts);
+  free (batch.searches);
 }
 
 static SaftSearch*
@@ -607,99 +1725,263 @@ search_engine_dna_array_search_all_qcached (SearchEngineDNAArray *engine,
                                             const char           *query_path,
                                             const char           *db_path)
 {
-  unsigned long i;
+  SaftOptions      *options = engine->search_engine.options;
+  DNAArrayDBEntry  *entry;
+  unsigned long     i;
+
+  /* Queries contexts are built as they are cached and need the composition
+   * of the database beforehand */
+  if (saft_search_engine_db_composition_needed (options))
+    saft_search_engine_db_composition (options, db_path, engine->db_composition);
+  if (!engine->stats_context && !saft_search_engine_query_composition_needed (options))
+    engine->stats_context = saft_search_engine_stats_context_new (options, NULL, engine->db_composition);
 
   saft_fasta_iter (query_path,
+                   &engine->search_engine.fasta_options,
                    search_engine_dna_array_cache_sequence,
                    engine);
-  engine->search_array = calloc (engine->n_queries, sizeof (*engine->search_array));
-  saft_fasta_iter (db_path,
-                   search_engine_dna_array_search_db,
-                   engine);
+  engine->search_array  = calloc (engine->n_queries, sizeof (*engine->search_array));
+  engine->query_entries = realloc (engine->query_entries,
+                                   engine->n_queries * sizeof (*engine->query_entries));
+  for (entry = engine->query_cache, i = 0; entry; entry = entry->next, i++)
+    engine->query_entries[i] = entry;
+  engine->n_scanned = 0;
+  if (engine->pool)
+    {
+      const size_t     n_threads = saft_pool_n_threads (engine->pool);
+
+      engine->partial_searches = calloc (n_threads * engine->n_queries,
+                                         sizeof (*engine->partial_searches));
+      engine->batch            = realloc (engine->batch,
+                                          DNA_ARRAY_BATCH_PER_THREAD * n_threads *
+                                          sizeof (*engine->batch));
+      engine->batch_counts     = realloc (engine->batch_counts,
+                                          DNA_ARRAY_BATCH_PER_THREAD * n_threads *
+                                          sizeof (*engine->batch_counts));
+      engine->n_batch          = 0;
+
+      engine->search_engine.n_subjects = saft_search_engine_db_iter (options,
+                                                                     db_path,
+                                                                     search_engine_dna_array_block_db,
+                                                                     engine);
+      search_engine_dna_array_search_block (engine);
+
+      /* The heaps of the threads hold disjoint sets of subjects, and merging
+       * them in any order keeps the same hits */
+      for (i = 0; i < engine->n_queries; i++)
+        {
+          size_t j;
 
-  for (i = 0; i < engine->n_queries; i++)
+          for (j = 0; j < n_threads; j++)
+            {
+              SaftSearch *partial = engine->partial_searches[j * engine->n_queries + i];
+
+              if (!partial)
+                continue;
+              if (!engine->search_array[i])
+                engine->search_array[i] = partial;
+              else
+                saft_search_merge (engine->search_array[i], partial);
+            }
+        }
+      free (engine->partial_searches);
+      engine->partial_searches = NULL;
+    }
+  else
+    engine->search_engine.n_subjects = saft_search_engine_db_iter_fragments (options,
+                                                                             db_path,
+                                                                             &dna_array_search_db_funcs,
+                                                                             engine);
+
+  /* The query cache is in the reverse order of the queries */
+  for (i = engine->n_queries; i-- > 0;)
     {
       SaftSearch *search;
 
       search = engine->search_array[i];
-      if (!search || search->n_results == 0)
-        continue;
-      search->next   = engine->search;
-      engine->search = search;
+      if (!search)
+        {
+          search       = saft_search_new (options->max_results);
+          search->name = strdup (engine->query_entries[i]->name);
+        }
+      engine->search = saft_search_engine_add_search (&engine->search_engine,
+                                                      engine->search,
+                                                      search);
     }
   free (engine->search_array);
   engine->search_array = NULL;
 
+  engine->search = saft_search_reverse (engine->search);
+
   return engine->search;
 }
 
 static int
-search_engine_dna_array_search_db (SaftSequence *sequence,
-                                   void         *data)
+search_engine_dna_array_search_db (void *data)
 {
   SearchEngineDNAArray *engine;
   DNAArrayDBEntry      *entry;
   WordCount            *counts;
+  uint64_t              composition[NUC_NB] = {0};
   size_t                query_idx = 0;
 
   engine = (SearchEngineDNAArray*)data;
-  counts = search_engine_dna_array_hash_sequence (engine, sequence);
+  counts = dna_array_subject_end (engine, composition);
 
   for (entry = engine->query_cache; entry; entry = entry->next)
     {
-      unsigned long d2;
-      double        mean;
-      double        var;
+      search_engine_dna_array_score_query (engine,
+                                           engine->search_array + query_idx,
+                                           entry,
+                                           counts,
+                                           engine->n_scanned,
+                                           engine->subject->name,
+                                           engine->subject->seq_length);
+      query_idx++;
+    }
+  engine->n_scanned++;
 
-      d2   = search_engine_dna_array_d2 (engine,
-                                         entry->counts,
-                                         counts);
-      mean = saft_stats_mean (engine->stats_context,
-                              sequence->seq_length,
-                              entry->length);
-      var  = saft_stats_var (engine->stats_context,
-                             sequence->seq_length,
-                             entry->length);
+  free (counts);
 
-      if (d2 > mean + 2 * sqrt (var))
-        {
-          SaftSearch *search;
-          SaftResult *result;
+  return 1;
+}
 
-          if (!engine->search_array[query_idx])
-            {
-              search       = saft_search_new (engine->search_engine.options->max_results);
-              /* TODO could use the same string as in the entry and deallocate
-               * carefully (probably not worth the trouble) */
-              search->name = strdup (entry->name);
-              engine->search_array[query_idx] = search;
-            }
-          search = engine->search_array[query_idx];
+/**
+ * Scores a database sequence against a cached query, and adds the hit to
+ * search, which is created on the first hit
+ */
+static void
+search_engine_dna_array_score_query (SearchEngineDNAArray  *engine,
+                                     SaftSearch           **search,
+                                     DNAArrayDBEntry       *entry,
+                                     WordCount             *counts,
+                                     size_t                 subject,
+                                     const char            *name,
+                                     size_t                 length)
+{
+  SaftStatsContext *stats_context;
+  uint64_t          d2;
+  double            mean;
+  double            var;
+
+  stats_context = entry->stats_context ? entry->stats_context : engine->stats_context;
+  d2            = search_engine_dna_array_d2 (engine,
+                                              entry->counts,
+                                              counts);
+  mean          = saft_stats_mean (stats_context,
+                                   length,
+                                   entry->length);
+  var           = saft_stats_var (stats_context,
+                                  length,
+                                  entry->length);
 
-          result          = saft_result_new ();
-          result->d2      = d2;
-          result->p_value = saft_stats_pgamma_m_v (result->d2, mean, var);
-          result->name    = strdup (sequence->name);
-          saft_search_add_result (search, result);
+  if (d2 > mean + 2 * sqrt (var))
+    {
+      if (!*search)
+        {
+          *search         = saft_search_new (engine->search_engine.options->max_results);
+          /* TODO could use the same string as in the entry and deallocate
+           * carefully (probably not worth the trouble) */
+          (*search)->name = strdup (entry->name);
         }
-      query_idx++;
+
+      saft_search_add_hit (*search, subject, name, d2, mean, var,
+                           saft_stats_pgamma_m_v (d2, mean, var));
     }
+}
 
-  free (counts);
+/* Threaded search of the cached queries.
+ * The database is read in blocks of sequences. The words of the sequences of
+ * a block are counted in parallel, then the block is scored with one task per
+ * (database sequence, block of queries) pair. The pool hands out contiguous
+ * tasks to each thread and lets idle threads steal tasks, so that sequences
+ * of uneven lengths do not leave threads idle. Each thread adds its hits to
+ * its own heaps, which are merged once the whole database was read. The hits
+ * are ranked on the rank of their subject after their p-value, so that the
+ * hits kept do not depend on which thread scored which subject. */
+
+static void
+dna_array_block_count_func (size_t        task,
+                            unsigned int  thread,
+                            void         *data)
+{
+  SearchEngineDNAArray *engine = data;
+  uint64_t              composition[NUC_NB] = {0};
+
+  engine->batch_counts[task] = search_engine_dna_array_hash_packed (engine,
+                                                                    engine->batch[task],
+                                                                    composition);
+}
+
+static void
+dna_array_block_score_func (size_t        task,
+                            unsigned int  thread,
+                            void         *data)
+{
+  SearchEngineDNAArray  *engine   = data;
+  const size_t           n_blocks = (engine->n_queries + DNA_ARRAY_QUERY_BLOCK - 1) / DNA_ARRAY_QUERY_BLOCK;
+  const size_t           subject  = task / n_blocks;
+  const size_t           first    = (task % n_blocks) * DNA_ARRAY_QUERY_BLOCK;
+  SaftSearch           **searches = engine->partial_searches + thread * engine->n_queries;
+  size_t                 i;
+
+  for (i = first; i < first + DNA_ARRAY_QUERY_BLOCK && i < engine->n_queries; i++)
+    search_engine_dna_array_score_query (engine,
+                                         searches + i,
+                                         engine->query_entries[i],
+                                         engine->batch_counts[subject],
+                                         engine->n_scanned + subject,
+                                         engine->batch[subject]->name,
+                                         engine->batch[subject]->seq_length);
+}
+
+static int
+search_engine_dna_array_block_db (SaftSequence *sequence,
+                                  void         *data)
+{
+  SearchEngineDNAArray *engine = (SearchEngineDNAArray*)data;
+
+  engine->batch[engine->n_batch] = saft_sequence_pack (sequence);
+  engine->n_batch++;
+  if (engine->n_batch == DNA_ARRAY_BATCH_PER_THREAD * saft_pool_n_threads (engine->pool))
+    search_engine_dna_array_search_block (engine);
 
   return 1;
 }
 
+static void
+search_engine_dna_array_search_block (SearchEngineDNAArray *engine)
+{
+  const size_t n_blocks = (engine->n_queries + DNA_ARRAY_QUERY_BLOCK - 1) / DNA_ARRAY_QUERY_BLOCK;
+  size_t       i;
+
+  if (engine->n_batch == 0)
+    return;
+
+  saft_pool_run (engine->pool, engine->n_batch, dna_array_block_count_func, engine);
+  saft_pool_run (engine->pool, engine->n_batch * n_blocks, dna_array_block_score_func, engine);
+
+  for (i = 0; i < engine->n_batch; i++)
+    {
+      free (engine->batch_counts[i]);
+      saft_packed_sequence_free (engine->batch[i]);
+    }
+  engine->n_scanned += engine->n_batch;
+  engine->n_batch    = 0;
+}
+
 static DNAArrayDBEntry*
 dna_array_db_entry_new ()
 {
   DNAArrayDBEntry *entry;
 
-  entry         = malloc (sizeof (*entry));
-  entry->next   = NULL;
-  entry->counts = NULL;
-  entry->name   = NULL;
-  entry->length = 0;
+  entry                = malloc (sizeof (*entry));
+  entry->next          = NULL;
+  entry->counts        = NULL;
+  entry->name          = NULL;
+  entry->stats_context = NULL;
+  entry->length        = 0;
+  memset (entry->composition, 0, sizeof (entry->composition));
 
   return entry;
 }
@@ -711,6 +1993,8 @@ dna_array_db_entry_free (DNAArrayDBEntry *entry)
     free (entry->counts);
   if (entry->name)
     free (entry->name);
+  if (entry->stats_context)
+    saft_stats_context_free (entry->stats_context);
   free (entry);
 }
 
@@ -61,7 +61,17 @@ saft_search_engine_generic_new (SaftOptions *options)
   engine->search_engine.options              = options;
   engine->search_engine.search_two_sequences = search_engine_generic_search_two_sequences;
   engine->search_engine.search_all           = search_engine_generic_search_all;
+  engine->search_engine.write_db             = NULL;
+  engine->search_engine.load_db              = NULL;
+  engine->search_engine.search_loaded        = NULL;
+  engine->search_engine.database_new         = NULL;
+  engine->search_engine.database_add         = NULL;
+  engine->search_engine.database_free        = NULL;
+  engine->search_engine.query                = NULL;
   engine->search_engine.free                 = search_engine_generic_free;
+  engine->search_engine.n_subjects           = 0;
+  engine->search_engine.search_done          = NULL;
+  engine->search_engine.search_done_data     = NULL;
 
   return (SaftSearchEngine*)engine;
 }
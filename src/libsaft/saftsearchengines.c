@@ -24,33 +24,290 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
 
+#include "saftdb.h"
 #include "saftfasta.h"
+#include "saftfastaindex.h"
 #include "saftsearchengines.h"
-#include "saftstats.h"
 
 
-typedef enum
+#define SAFT_SLAB_ALIGN     64
+#define SAFT_SLAB_HUGE_PAGE (2 << 20)
+
+
+static int  saft_search_engine_composition_begin (const char *name,
+                                                  size_t      name_length,
+                                                  void       *data);
+
+static void saft_search_engine_composition_feed  (const char *letters,
+                                                  size_t      length,
+                                                  void       *data);
+
+static int  saft_search_engine_composition_end   (void       *data);
+
+
+typedef struct _SaftCompositionData SaftCompositionData;
+
+struct _SaftCompositionData
 {
-  NUC_A  = 0,
-  NUC_C  = 1,
-  NUC_G  = 2,
-  NUC_T  = 3,
-  NUC_NB = 4
-}
-Nucleotide;
+  uint64_t     *composition;
+  /* That of the sequence being parsed, added to composition once it is
+   * known to hold a word */
+  uint64_t      sequence[NUC_NB];
+  size_t        length;
+  size_t        word_size;
+};
 
-static unsigned char char_to_bin_table[128] =
+static const SaftFastaFragmentFuncs saft_search_engine_composition_funcs =
 {
-  ['a'] = NUC_A,
-  ['c'] = NUC_C,
-  ['g'] = NUC_G,
-  ['t'] = NUC_T,
-  ['A'] = NUC_A,
-  ['C'] = NUC_C,
-  ['G'] = NUC_G,
-  ['T'] = NUC_T,
+  saft_search_engine_composition_begin,
+  saft_search_engine_composition_feed,
+  saft_search_engine_composition_end
 };
 
+
+void
+saft_search_engine_fasta_options (SaftOptions      *options,
+                                  SaftFastaOptions *fasta_options)
+{
+  fasta_options->n_threads   = options->n_threads;
+  fasta_options->min_quality = options->min_quality;
+}
+
+int
+saft_search_engine_query_composition_needed (SaftOptions *options)
+{
+  return (options->freq_type == SAFT_FREQ_QUERY ||
+          options->freq_type == SAFT_FREQ_QUERY_SUBJECTS);
+}
+
+int
+saft_search_engine_db_composition_needed (SaftOptions *options)
+{
+  return (options->freq_type == SAFT_FREQ_SUBJECTS ||
+          options->freq_type == SAFT_FREQ_QUERY_SUBJECTS);
+}
+
+/**
+ * Only used by the modes that do not get the database's composition for free
+ * while caching it. The rules are those of the counters of the DNA engines,
+ * so that every mode gets the same composition: the unknown letters and the
+ * sequences shorter than a word are left out
+ */
+void
+saft_search_engine_db_composition (SaftOptions *options,
+                                   const char  *db_path,
+                                   uint64_t    *composition)
+{
+  SaftCompositionData data;
+  SaftFastaOptions    fasta_options;
+
+  data.composition = composition;
+  data.word_size   = options->word_size;
+  memset (composition, 0, NUC_NB * sizeof (*composition));
+
+  saft_search_engine_fasta_options (options, &fasta_options);
+  saft_fasta_iter_fragments (db_path,
+                             &fasta_options,
+                             &saft_search_engine_composition_funcs,
+                             &data);
+}
+
+static int
+saft_search_engine_composition_begin (const char *name,
+                                      size_t      name_length,
+                                      void       *data)
+{
+  SaftCompositionData *cdata = data;
+
+  memset (cdata->sequence, 0, sizeof (cdata->sequence));
+  cdata->length = 0;
+
+  return 1;
+}
+
+static void
+saft_search_engine_composition_feed (const char *letters,
+                                     size_t      length,
+                                     void       *data)
+{
+  SaftCompositionData *cdata;
+  size_t               i;
+
+  cdata = (SaftCompositionData*)data;
+  for (i = 0; i < length; i++)
+    {
+      const unsigned char c = SaftNucleotideCodes[(unsigned char)letters[i]];
+
+      if (c != NUC_UNKNOWN)
+        cdata->sequence[c]++;
+    }
+  cdata->length += length;
+}
+
+static int
+saft_search_engine_composition_end (void *data)
+{
+  SaftCompositionData *cdata = data;
+  unsigned int         i;
+
+  if (cdata->length >= cdata->word_size)
+    for (i = 0; i < NUC_NB; i++)
+      cdata->composition[i] += cdata->sequence[i];
+
+  return 1;
+}
+
+/**
+ * Returns a new statistics context matching the options' frequency type.
+ * Compositions that are not needed by that type may be NULL.
+ */
+SaftStatsContext*
+saft_search_engine_stats_context_new (SaftOptions    *options,
+                                      const uint64_t *query_composition,
+                                      const uint64_t *db_composition)
+{
+  const unsigned int n_letters = options->alphabet->size;
+  SaftStatsContext  *context;
+  uint64_t          *composition;
+  unsigned int       i;
+
+  switch (options->freq_type)
+    {
+      case SAFT_FREQ_QUERY:
+          return saft_stats_context_new_from_counts (options->word_size,
+                                                     query_composition,
+                                                     n_letters);
+      case SAFT_FREQ_SUBJECTS:
+          return saft_stats_context_new_from_counts (options->word_size,
+                                                     db_composition,
+                                                     n_letters);
+      case SAFT_FREQ_QUERY_SUBJECTS:
+          composition = malloc (n_letters * sizeof (*composition));
+          for (i = 0; i < n_letters; i++)
+            composition[i] = query_composition[i] + db_composition[i];
+          context = saft_stats_context_new_from_counts (options->word_size,
+                                                        composition,
+                                                        n_letters);
+          free (composition);
+          return context;
+      default:
+          return saft_stats_context_new (options->word_size,
+                                         options->letter_frequencies,
+                                         n_letters);
+    }
+}
+
+size_t
+saft_search_engine_db_iter (SaftOptions       *options,
+                            const char        *db_path,
+                            SaftFastaIterFunc  func,
+                            void              *data)
+{
+  SaftFastaOptions fasta_options;
+
+  saft_search_engine_fasta_options (options, &fasta_options);
+
+  return saft_fasta_iter_shard (db_path,
+                                &fasta_options,
+                                options->shard,
+                                options->n_shards,
+                                func,
+                                data);
+}
+
+void
+saft_search_engine_db_ranks (SaftOptions *options,
+                             const char  *db_path,
+                             size_t      *first,
+                             size_t      *step)
+{
+  SaftFastaIndex *index;
+  SaftDB         *db;
+  size_t          last;
+
+  /* The shards are split as by the engines: runs of the packed database or
+   * of the indexed file, and every n-th sequence otherwise */
+  *first = 0;
+  *step  = 1;
+  if (options->n_shards <= 1)
+    return;
+  if (saft_db_is_db (db_path))
+    {
+      if ((db = saft_db_open (db_path)))
+        {
+          saft_db_split (db, options->shard, options->n_shards, first, &last);
+          saft_db_close (db);
+        }
+    }
+  else if ((index = saft_fasta_index_load (db_path)))
+    {
+      saft_fasta_index_split (index, options->shard, options->n_shards, first, &last);
+      saft_fasta_index_free (index);
+    }
+  else
+    {
+      *first = options->shard;
+      *step  = options->n_shards;
+    }
+}
+
+size_t
+saft_search_engine_db_iter_fragments (SaftOptions                  *options,
+                                      const char                   *db_path,
+                                      const SaftFastaFragmentFuncs *funcs,
+                                      void                         *data)
+{
+  SaftFastaOptions fasta_options;
+
+  saft_search_engine_fasta_options (options, &fasta_options);
+
+  return saft_fasta_iter_shard_fragments (db_path,
+                                          &fasta_options,
+                                          options->shard,
+                                          options->n_shards,
+                                          funcs,
+                                          data);
+}
+
+SaftSearch*
+saft_search_engine_add_search (SaftSearchEngine *engine,
+                               SaftSearch       *searches,
+                               SaftSearch       *search)
+{
+  search->n_tests = engine->n_subjects;
+  if (engine->search_done)
+    {
+      engine->search_done (search, engine->search_done_data);
+      saft_search_free (search);
+      return searches;
+    }
+  if (search->n_results == 0)
+    {
+      saft_search_free (search);
+      return searches;
+    }
+  search->next = searches;
+
+  return search;
+}
+
+void*
+saft_search_engine_slab_new (size_t size)
+{
+  const size_t  align = size >= 2 * SAFT_SLAB_HUGE_PAGE ? SAFT_SLAB_HUGE_PAGE : SAFT_SLAB_ALIGN;
+  void         *slab;
+
+  if (posix_memalign (&slab, align, size))
+    return NULL;
+#ifdef MADV_HUGEPAGE
+  if (align == SAFT_SLAB_HUGE_PAGE)
+    madvise (slab, size, MADV_HUGEPAGE);
+#endif
+
+  return slab;
+}
+
 /* vim:ft=c:expandtab:sw=4:ts=4:sts=4:cinoptions={.5s^-2n-2(0:
  */
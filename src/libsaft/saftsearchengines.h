@@ -22,7 +22,9 @@
 #ifndef __SAFT_SEARCH_ENGINE_H__
 #define __SAFT_SEARCH_ENGINE_H__
 
+#include "saftfasta.h"
 #include "saftsearch.h"
+#include "saftstats.h"
 
 #ifdef __cplusplus
 extern "C"
@@ -35,6 +37,59 @@ SaftSearchEngine* saft_search_engine_dna_array_new (SaftOptions *options);
 
 SaftSearchEngine* saft_search_engine_dna_hash_new  (SaftOptions *options);
 
+/* Helpers shared by the search engines */
+
+/* Sets how the files are read for the options */
+void              saft_search_engine_fasta_options            (SaftOptions      *options,
+                                                               SaftFastaOptions *fasta_options);
+
+/* Letter compositions are indexed by the codes of the options' alphabet */
+
+int               saft_search_engine_query_composition_needed (SaftOptions    *options);
+
+int               saft_search_engine_db_composition_needed    (SaftOptions    *options);
+
+void              saft_search_engine_db_composition           (SaftOptions    *options,
+                                                               const char     *db_path,
+                                                               uint64_t       *composition);
+
+SaftStatsContext* saft_search_engine_stats_context_new        (SaftOptions    *options,
+                                                               const uint64_t *query_composition,
+                                                               const uint64_t *db_composition);
+
+/* Iterates over the database sequences of the options' shard, and returns
+ * their number */
+size_t            saft_search_engine_db_iter                  (SaftOptions       *options,
+                                                               const char        *db_path,
+                                                               SaftFastaIterFunc  func,
+                                                               void              *data);
+
+/* Sets the rank in the whole database of the first sequence of the options'
+ * shard, and the step between the ranks of its sequences, so that the
+ * sequence of rank i in the shard has rank *first + i * *step */
+void              saft_search_engine_db_ranks                 (SaftOptions       *options,
+                                                               const char        *db_path,
+                                                               size_t            *first,
+                                                               size_t            *step);
+
+/* Same as saft_search_engine_db_iter, but hands the sequences over in pieces
+ * as they are read */
+size_t            saft_search_engine_db_iter_fragments        (SaftOptions                  *options,
+                                                               const char                   *db_path,
+                                                               const SaftFastaFragmentFuncs *funcs,
+                                                               void                         *data);
+
+/* Allocates size bytes aligned on a cache line, or on a huge page and backed
+ * by huge pages where possible when it spans several, for the counts of a
+ * cached database. Freed with free () */
+void*             saft_search_engine_slab_new                 (size_t             size);
+
+/* Hands the search of a query over to the engine's search_done, or adds it
+ * to the head of searches if it has hits. Returns the new head of searches */
+SaftSearch*       saft_search_engine_add_search               (SaftSearchEngine  *engine,
+                                                               SaftSearch        *searches,
+                                                               SaftSearch        *search);
+
 #ifdef __cplusplus
 }
 #endif
@@ -49,6 +49,19 @@ SaftAlphabet SaftAlphabetDNA =
     }
 };
 
+const unsigned char SaftNucleotideCodes[256] =
+{
+  [0 ... 255] = NUC_UNKNOWN,
+  ['A']       = NUC_A,
+  ['C']       = NUC_C,
+  ['G']       = NUC_G,
+  ['T']       = NUC_T,
+  ['a']       = NUC_A,
+  ['c']       = NUC_C,
+  ['g']       = NUC_G,
+  ['t']       = NUC_T
+};
+
 SaftAlphabet SaftAlphabetProtein =
 {
   .name    = "Protein",
@@ -169,7 +182,10 @@ saft_sequence_copy (SaftSequence *seq)
 
   new_seq              = saft_sequence_new ();
   new_seq->name        = strdup (seq->name);
-  new_seq->seq         = strdup (seq->seq);
+  /* The sequence may be a view into a file, without a terminating '\0' */
+  new_seq->seq         = malloc (seq->seq_length + 1);
+  memcpy (new_seq->seq, seq->seq, seq->seq_length);
+  new_seq->seq[seq->seq_length] = '\0';
   new_seq->name_length = seq->name_length;
   new_seq->seq_length  = seq->seq_length;
   new_seq->name_alloc  = seq->name_length + 1;
@@ -178,5 +194,241 @@ saft_sequence_copy (SaftSequence *seq)
   return new_seq;
 }
 
+/*******************/
+/* Packed sequence */
+/*******************/
+
+#define BYTES_ONES  0x0101010101010101ull
+#define BYTES_HIGH  0x8080808080808080ull
+
+static uint64_t pack_8_letters   (const char         *letters);
+
+static int      known_8_letters  (const char         *letters);
+
+static void     pack_n_runs      (SaftPackedSequence *packed,
+                                  const char         *letters,
+                                  size_t              start,
+                                  size_t              end,
+                                  size_t             *n_runs_alloc);
+
+SaftPackedSequence*
+saft_sequence_pack (SaftSequence *seq)
+{
+  SaftPackedSequence *packed;
+  const size_t        n_full       = seq->seq_length / NUCS_PER_WORD;
+  const size_t        n_words      = (seq->seq_length + NUCS_PER_WORD - 1) / NUCS_PER_WORD;
+  size_t              n_runs_alloc = 0;
+  size_t              i;
+
+  packed              = malloc (sizeof (*packed));
+  packed->name        = strdup (seq->name);
+  packed->name_length = seq->name_length;
+  packed->seq_length  = seq->seq_length;
+  packed->words       = malloc ((n_words + 1) * sizeof (*packed->words));
+  packed->n_runs      = NULL;
+  packed->n_n_runs    = 0;
+
+  /* Whole words are packed eight letters at a time */
+  for (i = 0; i < n_full; i++)
+    {
+      const char *letters = seq->seq + i * NUCS_PER_WORD;
+
+      packed->words[i] = pack_8_letters (letters)      << 48 |
+                         pack_8_letters (letters + 8)  << 32 |
+                         pack_8_letters (letters + 16) << 16 |
+                         pack_8_letters (letters + 24);
+      if (!(known_8_letters (letters) & known_8_letters (letters + 8) &
+            known_8_letters (letters + 16) & known_8_letters (letters + 24)))
+        pack_n_runs (packed, seq->seq, i * NUCS_PER_WORD, (i + 1) * NUCS_PER_WORD, &n_runs_alloc);
+    }
+  if (n_full < n_words)
+    {
+      uint64_t bits = 0;
+
+      for (i = n_full * NUCS_PER_WORD; i < seq->seq_length; i++)
+        bits = (bits << BITS_PER_NUC) | (SaftNucleotideCodes[(unsigned char)seq->seq[i]] & 3);
+      packed->words[n_full] = bits << (BITS_PER_NUC * (n_words * NUCS_PER_WORD - seq->seq_length));
+      pack_n_runs (packed, seq->seq, n_full * NUCS_PER_WORD, seq->seq_length, &n_runs_alloc);
+    }
+  packed->words[n_words] = 0;
+
+  return packed;
+}
+
+/* Bits 1 and 2 of the ASCII codes of ACGT, in either case, are 00, 01, 11 and
+ * 10, which give NUC_A to NUC_T once the low bit is xored with the high one.
+ * The unknown letters get meaningless codes, fixed by pack_n_runs. */
+static uint64_t
+pack_8_letters (const char *letters)
+{
+  uint64_t x;
+
+  memcpy (&x, letters, sizeof (x));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  /* The first letter goes to the high bits */
+  x = __builtin_bswap64 (x);
+#endif
+  x  = (x >> 1) & (3 * BYTES_ONES);
+  x ^= (x >> 1) & BYTES_ONES;
+  x  = (x | (x >> 6))  & 0x000f000f000f000full;
+  x  = (x | (x >> 12)) & 0x000000ff000000ffull;
+  x  = (x | (x >> 24)) & 0xffff;
+
+  return x;
+}
+
+/* Whether the eight letters are all in [ACGTacgt] */
+static int
+known_8_letters (const char *letters)
+{
+  const uint64_t low_7 = 0x7f7f7f7f7f7f7f7full;
+  uint64_t       x;
+  uint64_t       matches = 0;
+  unsigned int   i;
+
+  memcpy (&x, letters, sizeof (x));
+  x |= 0x20 * BYTES_ONES;
+  for (i = 0; i < NUC_NB; i++)
+    {
+      /* The high bit of the bytes equal to the lower case letter */
+      const uint64_t diff = x ^ ("acgt"[i] * BYTES_ONES);
+
+      matches |= ~(((diff & low_7) + low_7) | diff) & BYTES_HIGH;
+    }
+
+  return matches == BYTES_HIGH;
+}
+
+/* Records the unknown letters of [start, end) as N runs, and packs them as
+ * NUC_A */
+static void
+pack_n_runs (SaftPackedSequence *packed,
+             const char         *letters,
+             size_t              start,
+             size_t              end,
+             size_t             *n_runs_alloc)
+{
+  size_t i;
+
+  for (i = start; i < end; i++)
+    {
+      SaftNRun *run;
+
+      if (SaftNucleotideCodes[(unsigned char)letters[i]] != NUC_UNKNOWN)
+        continue;
+      packed->words[i / NUCS_PER_WORD] &= ~((uint64_t)3 << (62 - BITS_PER_NUC * (i % NUCS_PER_WORD)));
+      if (packed->n_n_runs > 0)
+        {
+          run = packed->n_runs + packed->n_n_runs - 1;
+          if (run->start + run->length == i)
+            {
+              run->length++;
+              continue;
+            }
+        }
+      if (packed->n_n_runs == *n_runs_alloc)
+        {
+          *n_runs_alloc  = *n_runs_alloc ? 2 * *n_runs_alloc : 4;
+          packed->n_runs = realloc (packed->n_runs,
+                                    *n_runs_alloc * sizeof (*packed->n_runs));
+        }
+      run         = packed->n_runs + packed->n_n_runs++;
+      run->start  = i;
+      run->length = 1;
+    }
+}
+
+void
+saft_packed_sequence_free (SaftPackedSequence *packed)
+{
+  if (packed)
+    {
+      if (packed->name)
+        free (packed->name);
+      if (packed->words)
+        free (packed->words);
+      if (packed->n_runs)
+        free (packed->n_runs);
+      free (packed);
+    }
+}
+
+SaftSequence*
+saft_packed_sequence_unpack (const SaftPackedSequence *packed)
+{
+  static const char  letters[NUC_NB] = {'A', 'C', 'G', 'T'};
+  SaftSequence      *seq;
+  size_t             i;
+
+  seq              = saft_sequence_new ();
+  seq->name        = strdup (packed->name);
+  seq->seq         = malloc (packed->seq_length + 1);
+  seq->name_length = packed->name_length;
+  seq->seq_length  = packed->seq_length;
+  seq->name_alloc  = packed->name_length + 1;
+  seq->seq_alloc   = packed->seq_length + 1;
+
+  for (i = 0; i < packed->seq_length; i++)
+    seq->seq[i] = letters[(packed->words[i / NUCS_PER_WORD] >>
+                           (62 - BITS_PER_NUC * (i % NUCS_PER_WORD))) & 3];
+  for (i = 0; i < packed->n_n_runs; i++)
+    memset (seq->seq + packed->n_runs[i].start, 'N', packed->n_runs[i].length);
+  seq->seq[seq->seq_length] = '\0';
+
+  return seq;
+}
+
+uint64_t
+saft_packed_sequence_kmer (const SaftPackedSequence *packed,
+                           size_t                    start,
+                           unsigned int              k)
+{
+  const size_t       word  = start / NUCS_PER_WORD;
+  const unsigned int shift = BITS_PER_NUC * (start % NUCS_PER_WORD);
+  uint64_t           bits;
+
+  if (k == 0)
+    return 0;
+
+  /* The words are padded, so that the next one can always be read */
+  bits = packed->words[word] << shift;
+  if (shift)
+    bits |= packed->words[word + 1] >> (64 - shift);
+
+  return bits >> (64 - BITS_PER_NUC * k);
+}
+
+/* The low bit of each base is in lo, its high bit in hi: 01 is C, 10 is G and
+ * 11 is T. The padding bits count as A, which is the remainder once the N,
+ * packed as A, are left out. */
+void
+saft_packed_sequence_composition (const SaftPackedSequence *packed,
+                                  uint64_t                 *composition)
+{
+  const uint64_t low_bits = 0x5555555555555555ull;
+  const size_t   n_words  = (packed->seq_length + NUCS_PER_WORD - 1) / NUCS_PER_WORD;
+  uint64_t       n_c      = 0;
+  uint64_t       n_g      = 0;
+  uint64_t       n_t      = 0;
+  uint64_t       n_n      = 0;
+  size_t         i;
+
+  for (i = 0; i < n_words; i++)
+    {
+      const uint64_t lo = packed->words[i] & low_bits;
+      const uint64_t hi = (packed->words[i] >> 1) & low_bits;
+
+      n_c += __builtin_popcountll (lo & ~hi);
+      n_g += __builtin_popcountll (hi & ~lo);
+      n_t += __builtin_popcountll (hi & lo);
+    }
+  for (i = 0; i < packed->n_n_runs; i++)
+    n_n += packed->n_runs[i].length;
+  composition[NUC_A] += packed->seq_length - n_n - n_c - n_g - n_t;
+  composition[NUC_C] += n_c;
+  composition[NUC_G] += n_g;
+  composition[NUC_T] += n_t;
+}
+
 /* vim:ft=c:expandtab:sw=4:ts=4:sts=4:cinoptions={.5s^-2n-2(0:
  */
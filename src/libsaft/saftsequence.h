@@ -22,6 +22,9 @@
 #ifndef __SAFT_SEQUENCE_H__
 #define __SAFT_SEQUENCE_H__
 
+#include <stddef.h>
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C"
 {
@@ -40,6 +43,7 @@ typedef unsigned char SaftLetter;
 #define BITS_PER_BYTE   8
 #define BITS_PER_NUC    2
 #define NUCS_PER_BYTE   (BITS_PER_BYTE / BITS_PER_NUC)
+#define NUCS_PER_WORD   (sizeof (uint64_t) * NUCS_PER_BYTE)
 
 typedef enum
 {
@@ -51,6 +55,16 @@ typedef enum
 }
 Nucleotide;
 
+/* The code of the letters other than [ACGTacgt] in SaftNucleotideCodes, which
+ * no word of the DNA engines spans, and which are left out of the
+ * compositions */
+#define NUC_UNKNOWN NUC_NB
+
+/* The Nucleotide of each letter, or NUC_UNKNOWN. Unlike the codes of
+ * SaftAlphabetDNA, where 'N' and A are both 0, the unknown letters are told
+ * apart from A */
+extern const unsigned char SaftNucleotideCodes[256];
+
 /************/
 /* Alphabet */
 /************/
@@ -106,6 +120,55 @@ SaftSequence* saft_sequence_copy (SaftSequence *seq);
 
 /* TODO add functions for six frame translations */
 
+/*******************/
+/* Packed sequence */
+/*******************/
+
+/* A DNA sequence with two bits per base, NUCS_PER_WORD bases per word. The
+ * first base of a word is in its two highest bits, so that k consecutive bases
+ * read as the words of the search engines. The letters other than [ACGTacgt]
+ * are packed as NUC_A, and are recorded as runs restored as 'N' by
+ * unpacking, which the engines skip like the unknown letters of the
+ * sequences. The case of the letters is lost. */
+
+typedef struct _SaftNRun SaftNRun;
+
+struct _SaftNRun
+{
+  size_t  start;
+  size_t  length;
+};
+
+typedef struct _SaftPackedSequence SaftPackedSequence;
+
+struct _SaftPackedSequence
+{
+  char      *name;
+  /* Followed by an extra word, the bits past the last base being 0 */
+  uint64_t  *words;
+  SaftNRun  *n_runs;
+
+  size_t     name_length;
+  size_t     seq_length;
+  size_t     n_n_runs;
+};
+
+SaftPackedSequence* saft_sequence_pack                (SaftSequence             *seq);
+
+void                saft_packed_sequence_free         (SaftPackedSequence       *packed);
+
+SaftSequence*       saft_packed_sequence_unpack       (const SaftPackedSequence *packed);
+
+/* The k <= NUCS_PER_WORD bases starting at start, in the low bits of the
+ * result */
+uint64_t            saft_packed_sequence_kmer         (const SaftPackedSequence *packed,
+                                                       size_t                    start,
+                                                       unsigned int              k);
+
+/* Adds the number of each nucleotide to composition, leaving the N out */
+void                saft_packed_sequence_composition  (const SaftPackedSequence *packed,
+                                                       uint64_t                 *composition);
+
 #ifdef __cplusplus
 }
 #endif
@@ -134,6 +134,29 @@ saft_stats_context_new (unsigned int word_size,
 #undef p
 }
 
+SaftStatsContext*
+saft_stats_context_new_from_counts (unsigned int    word_size,
+                                    const uint64_t *letter_counts,
+                                    unsigned int    n_letters)
+{
+  SaftStatsContext *context;
+  double           *letter_frequencies;
+  long double       total = 0;
+  unsigned int      i;
+
+  for (i = 0; i < n_letters; i++)
+    total += letter_counts[i] + 1;
+
+  letter_frequencies = malloc (n_letters * sizeof (*letter_frequencies));
+  for (i = 0; i < n_letters; i++)
+    letter_frequencies[i] = (letter_counts[i] + 1) / total;
+
+  context = saft_stats_context_new (word_size, letter_frequencies, n_letters);
+  free (letter_frequencies);
+
+  return context;
+}
+
 void
 saft_stats_context_free (SaftStatsContext *context)
 {
@@ -143,35 +166,39 @@ saft_stats_context_free (SaftStatsContext *context)
 
 double
 saft_stats_mean (SaftStatsContext *context,
-                 unsigned int      query_size,
-                 unsigned int      subject_size)
+                 size_t            query_size,
+                 size_t            subject_size)
 {
-  return query_size * subject_size * context->p_2_k;
+  const long double m = query_size;
+  const long double n = subject_size;
+
+  return m * n * context->p_2_k;
 }
 
 double
 saft_stats_var (SaftStatsContext *context,
-                unsigned int      query_size,
-                unsigned int      subject_size)
+                size_t            query_size,
+                size_t            subject_size)
 {
-  double sum_var_Yu;
-  double cov_crab;
-  double cov_diag;
-  double cov_ac1;
-  double cov_ac2;
-  int    m = query_size;
-  int    n = subject_size;
-  int    k = context->word_size;
-
-  sum_var_Yu = m * n * context->sum_var_Yu;
-  cov_crab   = m * n * (n + m - 4 * k + 2) * context->cov_crab;
+  long double sum_var_Yu;
+  long double cov_crab;
+  long double cov_diag;
+  long double cov_ac1;
+  long double cov_ac2;
+  const long double m  = query_size;
+  const long double n  = subject_size;
+  const long double k  = context->word_size;
+  const long double mn = m * n;
+
+  sum_var_Yu = mn * context->sum_var_Yu;
+  cov_crab   = mn * (n + m - 4 * k + 2) * context->cov_crab;
 
   if (context->word_size == 1)
     return sum_var_Yu + cov_crab;
 
-  cov_diag = m * n * context->cov_diag;
-  cov_ac1  = m * n * context->cov_ac1;
-  cov_ac2  = m * n * context->cov_ac2;
+  cov_diag = mn * context->cov_diag;
+  cov_ac1  = mn * context->cov_ac1;
+  cov_ac2  = mn * context->cov_ac2;
 
   return sum_var_Yu + cov_crab + cov_diag + cov_ac1 + cov_ac2;
 }
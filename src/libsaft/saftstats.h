@@ -22,6 +22,9 @@
 #ifndef __SAFT_STATS_H__
 #define __SAFT_STATS_H__
 
+#include <stddef.h>
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C"
 {
@@ -48,15 +51,26 @@ SaftStatsContext* saft_stats_context_new  (unsigned int      word_size,
                                            double           *letter_frequencies,
                                            unsigned int      n_letters);
 
+/* Letter frequencies are estimated from letter counts, with a pseudo-count of
+ * one per letter so that a missing letter does not make the variance
+ * degenerate */
+SaftStatsContext* saft_stats_context_new_from_counts
+                                          (unsigned int      word_size,
+                                           const uint64_t   *letter_counts,
+                                           unsigned int      n_letters);
+
 void              saft_stats_context_free (SaftStatsContext *context);
 
+/* Sequence sizes are taken as size_t and the moments are accumulated in long
+ * double, so that chromosome-scale comparisons (where m * n * (m + n) is well
+ * beyond the range of any integer type) do not overflow */
 double            saft_stats_mean         (SaftStatsContext *context,
-                                           unsigned int      query_size,
-                                           unsigned int      subject_size);
+                                           size_t            query_size,
+                                           size_t            subject_size);
 
 double            saft_stats_var          (SaftStatsContext *context,
-                                           unsigned int      query_size,
-                                           unsigned int      subject_size);
+                                           size_t            query_size,
+                                           size_t            subject_size);
 
 double            saft_stats_pgamma_m_v   (double            d2,
                                            double            mean,
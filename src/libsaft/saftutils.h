@@ -19,8 +19,8 @@
  *
  */
 
-#ifndef __SAFT_ERROR_H__
-#define __SAFT_ERROR_H__
+#ifndef __SAFT_UTILS_H__
+#define __SAFT_UTILS_H__
 
 #ifdef __cplusplus
 extern "C"
@@ -38,7 +38,7 @@ extern "C"
 }
 #endif
 
-#endif /* __SAFT_ERROR_H__ */
+#endif /* __SAFT_UTILS_H__ */
 
 /* vim:ft=c:expandtab:sw=4:ts=4:sts=4:cinoptions={.5s^-2n-2(0:
  */
@@ -0,0 +1,101 @@
+/* saftindex.c
+ * Copyright (C) 2008  Sylvain FORET
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *                                                                       
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *                                                                       
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Writes the index of FASTA files (see saftfastaindex.h). The sharded
+ * searches of saft use the index of the database to give each shard a run of
+ * consecutive sequences holding about the same number of letters.
+ */
+
+
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "safterror.h"
+#include "saftfastaindex.h"
+
+
+static struct option long_options[] =
+{
+    {"help",    no_argument,       NULL, 'h'},
+    {"version", no_argument,       NULL, 'V'},
+    {NULL, 0, NULL, 0}
+};
+
+static void saft_index_usage (char *argv0);
+
+int
+main (int    argc,
+      char **argv)
+{
+  int ret = 0;
+  int i;
+
+  while (1)
+    {
+      int c;
+
+      c = getopt_long (argc, argv, "hV", long_options, NULL);
+      if (c == -1)
+        break;
+
+      switch (c)
+        {
+          case 'h':
+              saft_index_usage (argv[0]);
+              return 0;
+          case 'V':
+              printf ("SAFT version " SAFT_VERSION "\n");
+              return 0;
+          default:
+              saft_index_usage (argv[0]);
+              return 1;
+        }
+    }
+  if (optind == argc)
+    {
+      saft_index_usage (argv[0]);
+      return 1;
+    }
+
+  for (i = optind; i < argc; i++)
+    {
+      SaftFastaIndex *index;
+
+      index = saft_fasta_index_build (argv[i]);
+      if (!index || saft_fasta_index_write (index))
+        ret = 1;
+      saft_fasta_index_free (index);
+    }
+
+  return ret;
+}
+
+static void
+saft_index_usage (char *argv0)
+{
+  char *prog = basename (argv0);
+
+  printf ("Usage: %s FASTA...\n", prog);
+  printf ("Writes the index of each FASTA file to FASTA" SAFT_FASTA_INDEX_SUFFIX "\n");
+}
+
+/* vim:ft=c:expandtab:sw=4:ts=4:sts=4:cinoptions={.5s^-2n-2(0:
+ */
@@ -23,14 +23,28 @@
 #define _GNU_SOURCE
 #include <errno.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
 
+#include "saftdb.h"
 #include "safterror.h"
 #include "saftfasta.h"
+#include "saftresults.h"
 #include "saftsearch.h"
+#include "saftsearchengines.h"
 
+/* Clients served at once, the others waiting to be accepted */
+#define SAFT_SERVER_MAX_CLIENTS 64
+/* Seconds a client can stay silent while sending its queries */
+#define SAFT_SERVER_TIMEOUT     60
 
 typedef struct _SaftOptDesc SaftOptDesc;
 
@@ -49,17 +63,21 @@ static SaftOptDesc opt_desc[] =
     {"version",     no_argument,       'V', "Prints the program's version"},
     /* General options */
     {"verbose",     no_argument,       'v', "Increases the program's verbosity"},
-    /* TODO multi threading options ? */
+    {"threads",     required_argument, 't', "Number of threads to use (only used by some modes)"},
     /* Input / Output */
-    {"input",       required_argument, 'i', "Path to the input file"},
-    {"database",    required_argument, 'd', "Path to the database to search"},
+    {"input",       required_argument, 'i', "Path to the input file, `-' for the standard input"},
+    {"database",    required_argument, 'd', "Path to the database to search, a FASTA file or a database written by saft-makedb"},
+    {"shard",       required_argument, 's', "Only search the i-th of every n database sequences (i/n), and write partial results for saft-merge"},
+    {"min_quality", required_argument, 'Q', "Mask the bases of FASTQ reads with a lower quality (Phred score) as unknown"},
     {"output",      required_argument, 'o', "Path to the output file"},
+    {"listen",      required_argument, 'l', "Load the database once, and search the queries sent to the Unix socket of this path instead of the input"},
     /* Search setup */
     {"program",     required_argument, 'p', "Program to use"},
     {"wordsize",    required_argument, 'w', "Word size"},
     {"showmax",     required_argument, 'b', "Maximum number of results to show"},
     {"pmax",        required_argument, 'e', "Show results with a p-value smaller than this"},
     {"letter_freq", required_argument, 'f', "Comma separated list of letter frequencies"},
+    {"freq_type",   required_argument, 'F', "Letter frequencies model: uniform (default), query, subjects or query_subjects"},
     /* FIXME add option to choose the strand(s) of the query */
 
     /* TODO We could have an extra mechanism to add engine specific options */
@@ -83,11 +101,62 @@ static void             saft_main_version       (void);
 
 static SaftProgramType  saft_main_program_type  (char        *program);
 
+static SaftFreqType     saft_main_freq_type     (char        *freq_type);
+
 static int              saft_main_search        (SaftOptions *options);
 
-static void             saft_main_write_search  (SaftOptions *options,
-                                                 SaftSearch  *search,
-                                                 FILE        *stream);
+static int              saft_main_serve         (SaftOptions *options,
+                                                 const char  *socket_path);
+
+static void*            saft_main_client        (void        *data);
+
+static int              saft_main_client_query  (SaftSequence *sequence,
+                                                 void         *data);
+
+static void             saft_main_write_search  (SaftSearch  *search,
+                                                 void        *data);
+
+static void             saft_main_write_partial (SaftSearch  *search,
+                                                 void        *data);
+
+typedef struct _SaftOutputData SaftOutputData;
+
+struct _SaftOutputData
+{
+  FILE        *stream;
+  SaftOptions *options;
+  /* Rank in the database of the first subject of the shard, and step
+   * between the ranks of its subjects */
+  size_t       first_subject;
+  size_t       subject_step;
+};
+
+typedef struct _SaftServer SaftServer;
+
+struct _SaftServer
+{
+  SaftSearchEngine *engine;
+  SaftOptions      *options;
+  size_t            first_subject;
+  size_t            subject_step;
+  /* The engine searches one query at a time, on its own threads, and the
+   * clients take turns query by query */
+  pthread_mutex_t   lock;
+  /* Clients connected, each having a thread and a temporary file, which
+   * are not accepted beyond SAFT_SERVER_MAX_CLIENTS */
+  pthread_mutex_t   clients_lock;
+  pthread_cond_t    client_done;
+  unsigned int      n_clients;
+};
+
+typedef struct _SaftClient SaftClient;
+
+struct _SaftClient
+{
+  SaftServer     *server;
+  SaftOutputData  output;
+  int             fd;
+};
 
 int
 main (int    argc,
@@ -97,7 +166,9 @@ main (int    argc,
   SaftOptions    *options      = saft_options_new ();
   int             ret          = 0;
   char           *tmp_freqs    = NULL;
+  char           *socket_path  = NULL;
   char           *optstring;
+  char            trailing;
   char           *endptr;
 
   optstring = saft_main_get_optstring ();
@@ -125,15 +196,48 @@ main (int    argc,
           case 'v':
               options->verbosity++;
               break;
+          case 't':
+              options->n_threads = strtoul (optarg, &endptr, 10);
+              if (errno == ERANGE || errno == EINVAL || *endptr != '\0' ||
+                  *optarg == '-' || options->n_threads < 1)
+                {
+                  saft_error ("Wrong `--threads (-t)' argument: could not convert `%s' to a positive integer", optarg);
+                  ret = 1;
+                  goto cleanup;
+                }
+              break;
           case 'i':
               options->input_path = strdup (optarg);
               break;
           case 'd':
               options->db_path = strdup (optarg);
               break;
+          case 'Q':
+              options->min_quality = strtoul (optarg, &endptr, 10);
+              if (errno == ERANGE || errno == EINVAL || *endptr != '\0' ||
+                  *optarg == '-' || options->min_quality > 93)
+                {
+                  saft_error ("Wrong `--min_quality (-Q)' argument: `%s' is not a quality between 0 and 93", optarg);
+                  ret = 1;
+                  goto cleanup;
+                }
+              break;
+          case 's':
+              if (sscanf (optarg, "%u/%u%c", &options->shard, &options->n_shards, &trailing) != 2 ||
+                  options->shard < 1 || options->shard > options->n_shards)
+                {
+                  saft_error ("Wrong `--shard (-s)' argument: `%s' is not of the form i/n with 1 <= i <= n", optarg);
+                  ret = 1;
+                  goto cleanup;
+                }
+              options->shard--;
+              break;
           case 'o':
               options->output_path = strdup (optarg);
               break;
+          case 'l':
+              socket_path = strdup (optarg);
+              break;
           case 'p':
               options->program = saft_main_program_type (optarg);
               if (options->program == SAFT_UNKNOWN_PROGRAM)
@@ -173,6 +277,16 @@ main (int    argc,
           case 'f':
               tmp_freqs = optarg;
               break;
+          case 'F':
+              options->freq_type = saft_main_freq_type (optarg);
+              if (options->freq_type == SAFT_UNKNOWN_FREQUENCY ||
+                  options->freq_type == SAFT_FREQ_USER)
+                {
+                  ret = 1;
+                  saft_error ("Wrong `--freq_type (-F)' argument: unknown frequency type `%s'", optarg);
+                  goto cleanup;
+                }
+              break;
           case 'q':
               options->cache_queries = 1;
               break;
@@ -212,7 +326,7 @@ main (int    argc,
               break;
         }
     }
-  if (!options->input_path)
+  if (!options->input_path && !socket_path)
     {
       saft_error ("Query file was not provided, use the `--input' or `-i' option'");
       ret = 1;
@@ -224,6 +338,27 @@ main (int    argc,
       ret = 1;
       goto cleanup;
     }
+  /* The words of a database written by saft-makedb are already counted */
+  if (saft_db_is_db (options->db_path))
+    {
+      SaftDB *db = saft_db_open (options->db_path);
+
+      if (!db)
+        {
+          ret = 1;
+          goto cleanup;
+        }
+      if (options->word_size != 0 && options->word_size != db->header->word_size)
+        {
+          saft_error ("`%s' holds words of size %u, not %lu",
+                      options->db_path, db->header->word_size, (unsigned long)options->word_size);
+          saft_db_close (db);
+          ret = 1;
+          goto cleanup;
+        }
+      options->word_size = db->header->word_size;
+      saft_db_close (db);
+    }
   if (options->word_size == 0)
     {
       if (options->program == SAFTN)
@@ -237,6 +372,13 @@ main (int    argc,
     }
 
   options->letter_frequencies = malloc (options->alphabet->size * sizeof (*options->letter_frequencies));
+  if (tmp_freqs && options->freq_type != SAFT_FREQ_UNIFORM)
+    {
+      saft_error ("Letter frequencies (-f) can't be combined with the `%s' frequency type (-F)",
+                  saft_freq_type_names[options->freq_type]);
+      ret = 1;
+      goto cleanup;
+    }
   if (tmp_freqs)
     {
       const double epsilon = 1e-6;
@@ -244,6 +386,7 @@ main (int    argc,
       char        *saveptr;
       int          i;
 
+      options->freq_type = SAFT_FREQ_USER;
       for (i = 0; i < options->alphabet->size; i++)
         {
           char *token;
@@ -282,9 +425,14 @@ main (int    argc,
         options->letter_frequencies[i] = f;
     }
 
-  saft_main_search (options);
+  if (socket_path)
+    ret = saft_main_serve (options, socket_path);
+  else
+    saft_main_search (options);
 
 cleanup:
+  if (socket_path)
+    free (socket_path);
   free (optstring);
   free (long_options);
   saft_options_free (options);
@@ -395,12 +543,21 @@ saft_main_program_type (char *program)
   return SAFT_UNKNOWN_PROGRAM;
 }
 
+static SaftFreqType
+saft_main_freq_type (char *freq_type)
+{
+  unsigned int i;
+  for (i = 0; i < NB_SAFT_FREQUENCIES; i++)
+    if (!strcmp (freq_type, saft_freq_type_names[i]))
+      return i;
+  return SAFT_UNKNOWN_FREQUENCY;
+}
+
 static int
 saft_main_search (SaftOptions *options)
 {
   SaftSearchEngine *engine;
-  SaftSearch       *searches;
-  SaftSearch       *search;
+  SaftOutputData    output;
   FILE             *out_stream;
 
   if (options->output_path == NULL)
@@ -418,45 +575,230 @@ saft_main_search (SaftOptions *options)
       return 1;
     }
 
-  searches = saft_search_all (engine, options->input_path, options->db_path);
-  saft_search_engine_free (engine);
-
-  for (search = searches; search; search = search->next)
+  /* The results of a query are written as soon as it is searched, the
+   * queries being possibly read from a pipe */
+  output.stream            = out_stream;
+  output.options           = options;
+  engine->search_done_data = &output;
+  if (options->n_shards > 1)
     {
-      saft_main_write_search (options,
-                              search,
-                              out_stream);
+      saft_search_engine_db_ranks (options, options->db_path, &output.first_subject, &output.subject_step);
+      saft_results_write_partial_header (out_stream, options);
+      engine->search_done = saft_main_write_partial;
     }
-  saft_search_free_all (search);
+  else
+    engine->search_done = saft_main_write_search;
 
-  if (options->output_path == NULL)
+  saft_search_all (engine, options->input_path, options->db_path);
+  saft_search_engine_free (engine);
+
+  if (options->output_path != NULL)
     fclose (out_stream);
   return 0;
 }
 
-static void
-saft_main_write_search (SaftOptions *options,
-                        SaftSearch  *search,
-                        FILE        *stream)
+/**
+ * Each client writes its queries to the socket and shuts its writing side
+ * down, then reads the results back, written as they would be to the output
+ * file, until the server closes the connection.
+ */
+static int
+saft_main_serve (SaftOptions *options,
+                 const char  *socket_path)
 {
-  int i;
+  SaftServer         server;
+  struct sockaddr_un addr;
+  struct stat        st;
+  int                fd;
+
+  server.options = options;
+  server.engine  = saft_search_engine_new (options);
+  if (!server.engine)
+    {
+      saft_error ("Could not create search engine");
+      return 1;
+    }
+  if (saft_search_engine_load_db (server.engine, options->db_path))
+    {
+      saft_search_engine_free (server.engine);
+      return 1;
+    }
+  if (options->n_shards > 1)
+    server.engine->search_done = saft_main_write_partial;
+  else
+    server.engine->search_done = saft_main_write_search;
+  saft_search_engine_db_ranks (options, options->db_path, &server.first_subject, &server.subject_step);
+  pthread_mutex_init (&server.lock, NULL);
+  pthread_mutex_init (&server.clients_lock, NULL);
+  pthread_cond_init (&server.client_done, NULL);
+  server.n_clients = 0;
+
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen (socket_path) >= sizeof (addr.sun_path))
+    {
+      saft_error ("The socket path `%s' is too long", socket_path);
+      saft_search_engine_free (server.engine);
+      return 1;
+    }
+  strcpy (addr.sun_path, socket_path);
+  /* Left by a previous server */
+  if (stat (socket_path, &st) == 0 && S_ISSOCK (st.st_mode))
+    unlink (socket_path);
+  if ((fd = socket (AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+      bind (fd, (struct sockaddr*)&addr, sizeof (addr)) == -1 ||
+      listen (fd, SOMAXCONN) == -1)
+    {
+      saft_error ("Couldn't listen on `%s': %s", socket_path, strerror (errno));
+      saft_search_engine_free (server.engine);
+      return 1;
+    }
+  /* A client leaving before its results are written is not an error */
+  signal (SIGPIPE, SIG_IGN);
+  if (options->verbosity > 0)
+    fprintf (stderr, "Listening on `%s'\n", socket_path);
 
-  fprintf (stream, "Query: %s program: %s word size: %ld\n",
-           search->name,
-           saft_program_names[options->program],
-           (long)options->word_size);
+  while (1)
+    {
+      SaftClient     *client;
+      pthread_t       thread;
+      struct timeval  timeout = {SAFT_SERVER_TIMEOUT, 0};
+      int             client_fd;
+
+      /* The connections beyond the limit wait in the backlog */
+      pthread_mutex_lock (&server.clients_lock);
+      while (server.n_clients >= SAFT_SERVER_MAX_CLIENTS)
+        pthread_cond_wait (&server.client_done, &server.clients_lock);
+      pthread_mutex_unlock (&server.clients_lock);
+
+      client_fd = accept (fd, NULL, NULL);
+      if (client_fd == -1)
+        {
+          if (errno == EINTR || errno == ECONNABORTED)
+            continue;
+          saft_error ("Couldn't accept a connection on `%s': %s", socket_path, strerror (errno));
+          break;
+        }
+      setsockopt (client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof (timeout));
+      client         = malloc (sizeof (*client));
+      client->server = &server;
+      client->fd     = client_fd;
+      pthread_mutex_lock (&server.clients_lock);
+      server.n_clients++;
+      pthread_mutex_unlock (&server.clients_lock);
+      if (pthread_create (&thread, NULL, saft_main_client, client))
+        {
+          close (client_fd);
+          free (client);
+          pthread_mutex_lock (&server.clients_lock);
+          server.n_clients--;
+          pthread_mutex_unlock (&server.clients_lock);
+          continue;
+        }
+      pthread_detach (thread);
+    }
+
+  close (fd);
+  unlink (socket_path);
+  saft_search_engine_free (server.engine);
+
+  return 1;
+}
 
-  saft_search_adjust_pvalues (search);
-  for (i = 0; i < search->n_results; i++)
+static void*
+saft_main_client (void *data)
+{
+  SaftClient     *client = data;
+  SaftServer     *server = client->server;
+  FILE           *queries;
+  char            buffer[1 << 16];
+  ssize_t         n;
+
+  /* The queries are read whole before any is searched, so that a slow
+   * client does not hold the others, and a silent one is dropped */
+  if (!(queries = tmpfile ()))
+    saft_error ("Couldn't create a temporary file for the queries");
+  else
     {
-      fprintf (stream, "  Hit: %s D2: %ld adj.p.val: %.5e p.val: %.5e\n",
-               search->results[i]->name,
-               search->results[i]->d2,
-               search->results[i]->p_value_adj,
-               search->results[i]->p_value);
+      while ((n = read (client->fd, buffer, sizeof (buffer))) > 0 ||
+             (n == -1 && errno == EINTR))
+        if (n > 0)
+          fwrite (buffer, 1, n, queries);
+      fflush (queries);
+      lseek (fileno (queries), 0, SEEK_SET);
     }
-  if (i == 0)
-    fprintf (stream, "No hit found\n");
+
+  if (queries && n == 0)
+    {
+      client->output.stream        = fdopen (client->fd, "w");
+      client->output.options       = server->options;
+      client->output.first_subject = server->first_subject;
+      client->output.subject_step  = server->subject_step;
+      if (server->options->n_shards > 1)
+        saft_results_write_partial_header (client->output.stream, server->options);
+      saft_fasta_iter_fd (fileno (queries), &server->engine->fasta_options, saft_main_client_query, client);
+      fclose (client->output.stream);
+    }
+  else
+    close (client->fd);
+  if (queries)
+    fclose (queries);
+  free (client);
+
+  pthread_mutex_lock (&server->clients_lock);
+  server->n_clients--;
+  pthread_cond_signal (&server->client_done);
+  pthread_mutex_unlock (&server->clients_lock);
+
+  return NULL;
+}
+
+/* The engine is only held for the query, so that the queries of the
+ * clients are interleaved and a large batch does not hold a single query */
+static int
+saft_main_client_query (SaftSequence *sequence,
+                        void         *data)
+{
+  SaftClient   *client     = data;
+  SaftServer   *server     = client->server;
+  SaftSequence *queries[2] = {sequence, NULL};
+
+  pthread_mutex_lock (&server->lock);
+  server->engine->search_done_data = &client->output;
+  saft_search_loaded_queries (server->engine, queries);
+  pthread_mutex_unlock (&server->lock);
+
+  return 1;
+}
+
+static void
+saft_main_write_search (SaftSearch *search,
+                        void       *data)
+{
+  SaftOutputData *output = data;
+
+  if (search->n_results == 0)
+    return;
+  saft_results_write (output->stream,
+                      output->options,
+                      search);
+  fflush (output->stream);
+}
+
+/* Queries without hits are written too, for their number of tests */
+static void
+saft_main_write_partial (SaftSearch *search,
+                         void       *data)
+{
+  SaftOutputData *output = data;
+
+  saft_results_write_partial (output->stream,
+                              search->name,
+                              search->n_tests,
+                              search,
+                              output->first_subject,
+                              output->subject_step);
+  fflush (output->stream);
 }
 
 /* vim:ft=c:expandtab:sw=4:ts=4:sts=4:cinoptions={.5s^-2n-2(0:
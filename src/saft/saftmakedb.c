@@ -0,0 +1,277 @@
+/* saftmakedb.c
+ * Copyright (C) 2008  Sylvain FORET
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *                                                                       
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *                                                                       
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Writes the word counts of a FASTA database (see saftdb.h), which saft
+ * searches without reading nor counting the database again when given as
+ * its `--database'. The sequences of other FASTA files can then be appended
+ * to the database, and sequences deleted from it, without writing it again
+ * until it is compacted. The searches running meanwhile keep searching the
+ * database as it was when they started.
+ */
+
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "saftdb.h"
+#include "safterror.h"
+#include "saftfasta.h"
+#include "saftsearch.h"
+
+
+static struct option long_options[] =
+{
+    {"help",        no_argument,       NULL, 'h'},
+    {"version",     no_argument,       NULL, 'V'},
+    {"threads",     required_argument, NULL, 't'},
+    {"min_quality", required_argument, NULL, 'Q'},
+    {"wordsize",    required_argument, NULL, 'w'},
+    {"append",      no_argument,       NULL, 'a'},
+    {"delete",      required_argument, NULL, 'd'},
+    {"compact",     no_argument,       NULL, 'c'},
+    {NULL, 0, NULL, 0}
+};
+
+static void saft_makedb_usage  (char        *argv0);
+
+static int  saft_makedb_delete (const char  *db_path,
+                                const char  *names_path);
+
+static int  saft_makedb_append (SaftOptions *options,
+                                const char  *db_path);
+
+int
+main (int    argc,
+      char **argv)
+{
+  SaftOptions      *options    = saft_options_new ();
+  SaftSearchEngine *engine;
+  char             *names_path = NULL;
+  char             *fasta_path = NULL;
+  char             *db_path;
+  char             *endptr;
+  int               append     = 0;
+  int               compact    = 0;
+  int               ret        = 0;
+  int               i;
+
+  options->program  = SAFTN;
+  options->alphabet = &SaftAlphabetDNA;
+  while (1)
+    {
+      int c;
+
+      c = getopt_long (argc, argv, "hVt:Q:w:ad:c", long_options, NULL);
+      if (c == -1)
+        break;
+
+      switch (c)
+        {
+          case 'h':
+              saft_makedb_usage (argv[0]);
+              goto cleanup;
+          case 'V':
+              printf ("SAFT version " SAFT_VERSION "\n");
+              goto cleanup;
+          case 't':
+              options->n_threads = strtoul (optarg, &endptr, 10);
+              if (errno == ERANGE || errno == EINVAL || *endptr != '\0' ||
+                  *optarg == '-' || options->n_threads < 1)
+                {
+                  saft_error ("Wrong `--threads (-t)' argument: could not convert `%s' to a positive integer", optarg);
+                  ret = 1;
+                  goto cleanup;
+                }
+              break;
+          case 'Q':
+              options->min_quality = strtoul (optarg, &endptr, 10);
+              if (errno == ERANGE || errno == EINVAL || *endptr != '\0' ||
+                  *optarg == '-' || options->min_quality > 93)
+                {
+                  saft_error ("Wrong `--min_quality (-Q)' argument: `%s' is not a quality between 0 and 93", optarg);
+                  ret = 1;
+                  goto cleanup;
+                }
+              break;
+          case 'w':
+              options->word_size = strtol (optarg, &endptr, 10);
+              if (errno == ERANGE || errno == EINVAL || *endptr != '\0' ||
+                  *optarg == '-' || options->word_size < 1)
+                {
+                  saft_error ("Wrong `--wordsize (-w)' argument: could not convert `%s' to a positive integer", optarg);
+                  ret = 1;
+                  goto cleanup;
+                }
+              break;
+          case 'a':
+              append = 1;
+              break;
+          case 'd':
+              names_path = optarg;
+              break;
+          case 'c':
+              compact = 1;
+              break;
+          default:
+              saft_makedb_usage (argv[0]);
+              ret = 1;
+              goto cleanup;
+        }
+    }
+  /* The database is only given to delete from it or compact it */
+  if (argc - optind == 2)
+    {
+      fasta_path = argv[optind];
+      db_path    = argv[optind + 1];
+    }
+  else if (argc - optind == 1 && !append && (names_path || compact))
+    db_path = argv[optind];
+  else
+    {
+      saft_makedb_usage (argv[0]);
+      ret = 1;
+      goto cleanup;
+    }
+  if (append && saft_makedb_append (options, db_path))
+    {
+      ret = 1;
+      goto cleanup;
+    }
+  if (options->word_size == 0)
+    options->word_size = 7;
+
+  /* The parsers only report the files they can't open */
+  if (fasta_path && strcmp (fasta_path, "-") && access (fasta_path, R_OK) == -1)
+    {
+      saft_error ("Couldn't open `%s'", fasta_path);
+      ret = 1;
+      goto cleanup;
+    }
+
+  /* The frequencies are those of the searches, not of the database */
+  options->letter_frequencies = malloc (options->alphabet->size * sizeof (*options->letter_frequencies));
+  for (i = 0; i < options->alphabet->size; i++)
+    options->letter_frequencies[i] = 1. / options->alphabet->size;
+
+  if (fasta_path)
+    {
+      engine = saft_search_engine_new (options);
+      if (!engine)
+        {
+          ret = 1;
+          goto cleanup;
+        }
+      ret = saft_search_engine_write_db (engine, fasta_path, db_path, append);
+      saft_search_engine_free (engine);
+    }
+  if (!ret && names_path)
+    ret = saft_makedb_delete (db_path, names_path);
+  if (!ret && compact)
+    ret = saft_db_compact (db_path);
+
+cleanup:
+  saft_options_free (options);
+
+  return ret;
+}
+
+static void
+saft_makedb_usage (char *argv0)
+{
+  char *prog = basename (argv0);
+
+  printf ("Usage: %s [OPTIONS] FASTA DB\n", prog);
+  printf ("       %s [--delete NAMES] [--compact] DB\n", prog);
+  printf ("Writes the word counts of the sequences of FASTA to DB, for saft --database DB\n");
+  printf ("Where OPTIONS are:\n");
+  printf ("  --wordsize    (-w) : Word size (default 7, or that of DB when appending)\n");
+  printf ("  --threads     (-t) : Number of threads to use\n");
+  printf ("  --min_quality (-Q) : Mask the bases of FASTQ reads with a lower quality (Phred score) as unknown\n");
+  printf ("  --append      (-a) : Append the sequences of FASTA to DB\n");
+  printf ("  --delete      (-d) : Delete the sequences named in the file NAMES, one per line, from DB\n");
+  printf ("  --compact     (-c) : Write DB again without the deleted sequences, as a single file\n");
+}
+
+static int
+saft_makedb_delete (const char *db_path,
+                    const char *names_path)
+{
+  FILE    *stream;
+  char   **names   = NULL;
+  char    *line    = NULL;
+  size_t   size    = 0;
+  size_t   n_names = 0;
+  size_t   i;
+  int      ret;
+
+  if (!(stream = fopen (names_path, "r")))
+    {
+      saft_error ("Couldn't open `%s'", names_path);
+      return 1;
+    }
+  while (getline (&line, &size, stream) != -1)
+    {
+      line[strcspn (line, "\r\n")] = '\0';
+      if (*line == '\0')
+        continue;
+      names            = realloc (names, (n_names + 1) * sizeof (*names));
+      names[n_names++] = strdup (line);
+    }
+  if (line)
+    free (line);
+  fclose (stream);
+
+  ret = saft_db_delete (db_path, names, n_names);
+
+  for (i = 0; i < n_names; i++)
+    free (names[i]);
+  if (names)
+    free (names);
+
+  return ret;
+}
+
+/* The words appended are those of the database */
+static int
+saft_makedb_append (SaftOptions *options,
+                    const char  *db_path)
+{
+  SaftDB *db;
+
+  if (!(db = saft_db_open (db_path)))
+    return 1;
+  if (options->word_size != 0 && options->word_size != db->header->word_size)
+    {
+      saft_error ("`%s' holds words of size %u, not %lu",
+                  db_path, db->header->word_size, (unsigned long)options->word_size);
+      saft_db_close (db);
+      return 1;
+    }
+  options->word_size = db->header->word_size;
+  saft_db_close (db);
+
+  return 0;
+}
+
+/* vim:ft=c:expandtab:sw=4:ts=4:sts=4:cinoptions={.5s^-2n-2(0:
+ */
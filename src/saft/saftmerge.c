@@ -0,0 +1,219 @@
+/* saftmerge.c
+ * Copyright (C) 2008  Sylvain FORET
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *                                                                       
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *                                                                       
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Merges the partial results written by the shards of a search (see the
+ * --shard option of saft) into the results of the whole search.
+ */
+
+
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "safterror.h"
+#include "saftresults.h"
+#include "saftsearch.h"
+
+
+static struct option long_options[] =
+{
+    {"help",    no_argument,       NULL, 'h'},
+    {"version", no_argument,       NULL, 'V'},
+    {"output",  required_argument, NULL, 'o'},
+    {NULL, 0, NULL, 0}
+};
+
+static void        saft_merge_usage   (char        *argv0);
+
+static SaftSearch* saft_merge_shards  (SaftOptions *options,
+                                       char       **paths,
+                                       int          n_paths);
+
+int
+main (int    argc,
+      char **argv)
+{
+  SaftOptions *options = saft_options_new ();
+  SaftSearch  *searches;
+  SaftSearch  *search;
+  FILE        *out_stream;
+  int          ret     = 0;
+
+  while (1)
+    {
+      int c;
+
+      c = getopt_long (argc, argv, "hVo:", long_options, NULL);
+      if (c == -1)
+        break;
+
+      switch (c)
+        {
+          case 'h':
+              saft_merge_usage (argv[0]);
+              goto cleanup;
+          case 'V':
+              printf ("SAFT version " SAFT_VERSION "\n");
+              goto cleanup;
+          case 'o':
+              options->output_path = strdup (optarg);
+              break;
+          default:
+              saft_merge_usage (argv[0]);
+              ret = 1;
+              goto cleanup;
+        }
+    }
+  if (optind == argc)
+    {
+      saft_merge_usage (argv[0]);
+      ret = 1;
+      goto cleanup;
+    }
+
+  searches = saft_merge_shards (options, argv + optind, argc - optind);
+  if (!searches)
+    {
+      ret = 1;
+      goto cleanup;
+    }
+
+  if (options->output_path == NULL)
+    out_stream = stdout;
+  else if ((out_stream = fopen (options->output_path, "w")) == NULL)
+    {
+      saft_error ("Could not open output file");
+      saft_search_free_all (searches);
+      ret = 1;
+      goto cleanup;
+    }
+
+  /* As in saft, queries without hits are not shown */
+  for (search = searches; search; search = search->next)
+    if (search->n_results > 0)
+      saft_results_write (out_stream, options, search);
+
+  if (options->output_path != NULL)
+    fclose (out_stream);
+  saft_search_free_all (searches);
+
+cleanup:
+  saft_options_free (options);
+
+  return ret;
+}
+
+static void
+saft_merge_usage (char *argv0)
+{
+  char *prog = basename (argv0);
+
+  printf ("Usage: %s [-o OUTPUT] PARTIAL_RESULTS...\n", prog);
+  printf ("Merges the partial results of the shards of a saft search\n");
+}
+
+static SaftSearch*
+saft_merge_shards (SaftOptions *options,
+                   char       **paths,
+                   int          n_paths)
+{
+  SaftSearch *merged = NULL;
+  char       *seen   = NULL;
+  int         i;
+
+  for (i = 0; i < n_paths; i++)
+    {
+      SaftOptions *shard_options = saft_options_new ();
+      SaftSearch  *searches;
+      SaftSearch  *search;
+      SaftSearch  *other;
+      int          error;
+
+      searches = saft_results_read_partial (paths[i], shard_options, &error);
+      if (error)
+        goto fail;
+
+      if (i == 0)
+        {
+          options->program     = shard_options->program;
+          options->word_size   = shard_options->word_size;
+          options->max_results = shard_options->max_results;
+          options->n_shards    = shard_options->n_shards;
+          seen                 = calloc (options->n_shards, sizeof (*seen));
+          merged               = searches;
+        }
+      else if (shard_options->program     != options->program     ||
+               shard_options->word_size   != options->word_size   ||
+               shard_options->max_results != options->max_results ||
+               shard_options->n_shards    != options->n_shards)
+        {
+          saft_error ("`%s' and `%s' do not come from the same search", paths[0], paths[i]);
+          saft_search_free_all (searches);
+          goto fail;
+        }
+      if (seen[shard_options->shard])
+        {
+          saft_error ("Shard %u/%u was given twice", shard_options->shard + 1, options->n_shards);
+          saft_search_free_all (searches);
+          goto fail;
+        }
+      seen[shard_options->shard] = 1;
+      if (i == 0)
+        {
+          saft_options_free (shard_options);
+          continue;
+        }
+
+      /* Every shard lists all the queries, in the same order */
+      for (search = merged, other = searches; search && other; search = search->next)
+        {
+          SaftSearch *next = other->next;
+
+          if (strcmp (search->name, other->name))
+            break;
+          saft_search_merge (search, other);
+          other = next;
+        }
+      if (search || other)
+        {
+          saft_error ("`%s' and `%s' do not have the same queries", paths[0], paths[i]);
+          saft_search_free_all (other);
+          goto fail;
+        }
+      saft_options_free (shard_options);
+      continue;
+
+fail:
+      saft_options_free (shard_options);
+      saft_search_free_all (merged);
+      if (seen)
+        free (seen);
+      return NULL;
+    }
+
+  if (n_paths != options->n_shards)
+    saft_error ("Only %d of the %u shards were merged", n_paths, options->n_shards);
+  free (seen);
+
+  return merged;
+}
+
+/* vim:ft=c:expandtab:sw=4:ts=4:sts=4:cinoptions={.5s^-2n-2(0:
+ */
@@ -0,0 +1,167 @@
+/* test_database.c
+ * Copyright (C) 2008  Sylvain FORET
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *                                                                       
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *                                                                       
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Checks that the queries searched against a database kept in memory, either
+ * counted from its path or sequence by sequence, get the same results as
+ * saft_search_all
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "safterror.h"
+#include "saftfasta.h"
+#include "saftsearch.h"
+
+
+static int test_result_cmp  (const void  *a,
+                             const void  *b);
+
+static int test_same_search (SaftSearch  *expected,
+                             SaftSearch  *search);
+
+static int test_check       (const char  *what,
+                             SaftSearch  *expected,
+                             SaftSearch  *search);
+
+int
+main (int    argc,
+      char **argv)
+{
+  SaftSequence     **queries;
+  SaftSequence     **subjects;
+  SaftSequence     **tmp;
+  SaftOptions       *options;
+  SaftSearchEngine  *engine;
+  SaftDatabase      *database;
+  SaftSearch        *expected;
+  unsigned int       n_queries;
+  unsigned int       n_subjects;
+  unsigned int       i;
+  int                ret = 0;
+
+  if (argc < 4)
+    {
+      saft_error ("Usage: %s QUERIES_FASTA DB_FASTA WORD_SIZE", argv[0]);
+      return 1;
+    }
+
+  options                     = saft_options_new ();
+  options->program            = SAFTN;
+  options->alphabet           = &SaftAlphabetDNA;
+  options->input_path         = strdup (argv[1]);
+  options->db_path            = strdup (argv[2]);
+  options->word_size          = atoi (argv[3]);
+  options->p_max              = 1;
+  options->letter_frequencies = malloc (options->alphabet->size * sizeof (*options->letter_frequencies));
+  for (i = 0; i < options->alphabet->size; i++)
+    options->letter_frequencies[i] = 1. / options->alphabet->size;
+
+  queries  = saft_fasta_read (argv[1], NULL, &n_queries);
+  subjects = saft_fasta_read (argv[2], NULL, &n_subjects);
+
+  engine   = saft_search_engine_new (options);
+  expected = saft_search_all (engine, argv[1], argv[2]);
+
+  database = saft_database_new_from_path (engine, argv[2]);
+  ret     |= test_check ("counted from its path", expected,
+                         saft_search_engine_query (engine, database, queries));
+  /* Searched twice, the database is not counted again */
+  ret     |= test_check ("searched again", expected,
+                         saft_search_engine_query (engine, database, queries));
+  saft_database_free (database);
+
+  database = saft_database_new (engine);
+  for (i = 0; i < n_subjects; i++)
+    saft_database_add_sequence (database, subjects[i]);
+  ret     |= test_check ("counted sequence by sequence", expected,
+                         saft_search_engine_query (engine, database, queries));
+  saft_database_free (database);
+
+  saft_search_free_all (expected);
+  saft_search_engine_free (engine);
+  saft_options_free (options);
+
+  for (tmp = queries; *tmp; tmp++)
+    saft_sequence_free (*tmp);
+  free (queries);
+  for (tmp = subjects; *tmp; tmp++)
+    saft_sequence_free (*tmp);
+  free (subjects);
+
+  return ret;
+}
+
+/* Ties are not ranked in the same order by every search */
+static int
+test_result_cmp (const void *a,
+                 const void *b)
+{
+  const SaftResult *r1 = a;
+  const SaftResult *r2 = b;
+
+  if (r1->d2 != r2->d2)
+    return r1->d2 < r2->d2 ? -1 : 1;
+
+  return strcmp (r1->name, r2->name);
+}
+
+static int
+test_same_search (SaftSearch *expected,
+                  SaftSearch *search)
+{
+  unsigned int i;
+
+  if (strcmp (expected->name, search->name) ||
+      expected->n_results != search->n_results ||
+      expected->n_tests != search->n_tests)
+    return 0;
+
+  qsort (expected->results, expected->n_results, sizeof (*expected->results), test_result_cmp);
+  qsort (search->results, search->n_results, sizeof (*search->results), test_result_cmp);
+  for (i = 0; i < search->n_results; i++)
+    if (expected->results[i].d2 != search->results[i].d2 ||
+        expected->results[i].p_value != search->results[i].p_value ||
+        strcmp (expected->results[i].name, search->results[i].name))
+      return 0;
+
+  return 1;
+}
+
+/* Frees search */
+static int
+test_check (const char *what,
+            SaftSearch *expected,
+            SaftSearch *search)
+{
+  SaftSearch *tmp;
+  int         ok = 1;
+
+  for (tmp = search; ok && tmp && expected; tmp = tmp->next, expected = expected->next)
+    ok = test_same_search (expected, tmp);
+  ok = ok && !tmp && !expected;
+
+  printf ("Database %s : %s\n", what, ok ? "OK" : "FAILED");
+  saft_search_free_all (search);
+
+  return !ok;
+}
+
+/* vim:ft=c:expandtab:sw=4:ts=4:sts=4:cinoptions={.5s^-2n-2(0:
+ */
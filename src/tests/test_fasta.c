@@ -21,25 +21,29 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
-#include "safterror.h"
 #include "saftfasta.h"
 
 int
 main (int    argc,
       char **argv)
 {
-  SaftSequence **seqs;
-  SaftSequence **tmp;
-  unsigned int   n;
+  SaftSequence     **seqs;
+  SaftSequence     **tmp;
+  SaftFastaOptions   options = {1, 0};
+  unsigned int       n;
 
-  if (argc < 2)
-    {
-      saft_error ("A fasta file need to be given as argument");
-      return 1;
-    }
+  /* The bases of FASTQ reads with a quality below the second argument are
+   * masked */
+  if (argc > 2)
+    options.min_quality = atoi (argv[2]);
 
-  seqs = saft_fasta_read (argv[1], &n);
+  /* Without argument, the sequences are read from the standard input */
+  if (argc < 2)
+    seqs = saft_fasta_read_fd (STDIN_FILENO, &options, &n);
+  else
+    seqs = saft_fasta_read (argv[1], &options, &n);
   tmp  = seqs - 1;
   while (*++tmp)
     {
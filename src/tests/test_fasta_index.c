@@ -0,0 +1,79 @@
+/* test_fasta_index.c
+ * Copyright (C) 2008  Sylvain FORET
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *                                                                       
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *                                                                       
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "safterror.h"
+#include "saftfasta.h"
+#include "saftfastaindex.h"
+
+int
+main (int    argc,
+      char **argv)
+{
+  SaftFastaIndex  *index;
+  SaftSequence   **seqs;
+  unsigned int     n;
+  unsigned int     i;
+  int              ret = 0;
+
+  if (argc < 2)
+    {
+      saft_error ("A fasta file need to be given as argument");
+      return 1;
+    }
+
+  /* Every sequence fetched through the index must be the one parsed */
+  seqs  = saft_fasta_read (argv[1], NULL, &n);
+  index = saft_fasta_index_build (argv[1]);
+  if (!index || index->n_records != n)
+    {
+      saft_error ("Wrong number of sequences in the index");
+      return 1;
+    }
+  for (i = n; i-- > 0; )
+    {
+      SaftSequence *seq = saft_fasta_index_fetch (index, i);
+
+      if (!seq ||
+          strcmp (seq->name, seqs[i]->name) ||
+          seq->seq_length != seqs[i]->seq_length ||
+          strcmp (seq->seq, seqs[i]->seq))
+        {
+          printf ("Sequence %u (%s) differs\n", i, seqs[i]->name);
+          ret = 1;
+        }
+      saft_sequence_free (seq);
+    }
+  printf ("%u sequences, %lu letters\n", n, (unsigned long)index->length);
+
+  for (i = 0; i < n; i++)
+    saft_sequence_free (seqs[i]);
+  free (seqs);
+  saft_fasta_index_free (index);
+
+  return ret;
+}
+
+/* vim:ft=c:expandtab:sw=4:ts=4:sts=4:cinoptions={.5s^-2n-2(0:
+ */
@@ -54,7 +54,7 @@ main (int    argc,
 
   getrusage (RUSAGE_SELF, &ru_start);
   for (i = 0; i < iterations; i++)
-    saft_fasta_iter (path, iter_func, NULL);
+    saft_fasta_iter (path, NULL, iter_func, NULL);
   getrusage (RUSAGE_SELF, &ru_end);
 
   printf ("Fasta speed results (%ld iterations on file `%s')\n",
@@ -28,7 +28,9 @@ int
 main (int    argc,
       char **argv)
 {
-  unsigned int seq_sizes[]     = {10, 20, 40, 60, 100, 200, 400, 800};
+  /* The larger sizes overflowed 32 bits integers in earlier versions */
+  size_t       seq_sizes[]     = {10, 20, 40, 60, 100, 200, 400, 800,
+                                  100000, 5000000, 250000000};
   unsigned int nb_seq_sizes    = sizeof seq_sizes / sizeof (*seq_sizes);
   unsigned int word_sizes[]    = {1, 2, 4, 6, 8, 10};
   unsigned int nb_word_sizes   = sizeof word_sizes / sizeof (*word_sizes);
@@ -40,7 +42,7 @@ main (int    argc,
 
   for (i = 0; i < nb_seq_sizes; i++)
     {
-      unsigned int seq_size = seq_sizes[i];
+      size_t seq_size = seq_sizes[i];
 
       for (j = 0; j < nb_word_sizes; j++)
         {
@@ -54,8 +56,9 @@ main (int    argc,
           double            var       = saft_stats_var  (context,
                                                          seq_size,
                                                          seq_size);
-          printf ("n = m = %-4d ; k = %-3d ; mean = %.5e ; var = %.5e\n",
-                  seq_size, word_size, mean, var);
+          printf ("n = m = %-9lu ; k = %-3d ; mean = %.5e ; var = %.5e\n",
+                  (unsigned long)seq_size, word_size, mean, var);
+          saft_stats_context_free (context);
         }
     }
 
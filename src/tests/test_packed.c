@@ -0,0 +1,111 @@
+/* test_packed.c
+ * Copyright (C) 2008  Sylvain FORET
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *                                                                       
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *                                                                       
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Packs and unpacks the sequences of a FASTA file, and checks the words and
+ * the composition of the packed sequences against their letters
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "saftfasta.h"
+
+static int check_packed (SaftSequence       *seq,
+                         SaftPackedSequence *packed,
+                         unsigned int        k);
+
+int
+main (int    argc,
+      char **argv)
+{
+  SaftSequence **seqs;
+  SaftSequence **tmp;
+  unsigned int   k      = 12;
+  unsigned int   n;
+  int            status = 0;
+
+  if (argc < 2)
+    {
+      fprintf (stderr, "Usage: %s FASTA [WORD_SIZE]\n", argv[0]);
+      return 1;
+    }
+  if (argc > 2)
+    k = atoi (argv[2]);
+
+  seqs = saft_fasta_read (argv[1], NULL, &n);
+  tmp  = seqs - 1;
+  while (*++tmp)
+    {
+      SaftPackedSequence *packed   = saft_sequence_pack (*tmp);
+      SaftSequence       *unpacked = saft_packed_sequence_unpack (packed);
+
+      if (!check_packed (*tmp, packed, k))
+        status = 1;
+      printf (">%s\n", unpacked->name);
+      printf ("%s\n", unpacked->seq);
+      saft_sequence_free (unpacked);
+      saft_packed_sequence_free (packed);
+    }
+
+  tmp = seqs - 1;
+  while (*++tmp)
+    saft_sequence_free (*tmp);
+  free (seqs);
+
+  return status;
+}
+
+static int
+check_packed (SaftSequence       *seq,
+              SaftPackedSequence *packed,
+              unsigned int        k)
+{
+  uint64_t composition[NUC_NB]        = {0};
+  uint64_t packed_composition[NUC_NB] = {0};
+  uint64_t word                       = 0;
+  size_t   i;
+
+  saft_packed_sequence_composition (packed, packed_composition);
+  for (i = 0; i < seq->seq_length; i++)
+    {
+      const unsigned char c = SaftNucleotideCodes[(unsigned char)seq->seq[i]];
+
+      /* The N are left out of the composition, but packed as A */
+      if (c != NUC_UNKNOWN)
+        composition[c]++;
+      word = (word << BITS_PER_NUC) | (c & 3);
+      if (k < NUCS_PER_WORD)
+        word &= (1ull << (BITS_PER_NUC * k)) - 1;
+      if (i + 1 >= k && saft_packed_sequence_kmer (packed, i + 1 - k, k) != word)
+        {
+          fprintf (stderr, "%s: wrong word at %lu\n", seq->name, (unsigned long)(i + 1 - k));
+          return 0;
+        }
+    }
+  for (i = 0; i < NUC_NB; i++)
+    if (composition[i] != packed_composition[i])
+      {
+        fprintf (stderr, "%s: wrong composition\n", seq->name);
+        return 0;
+      }
+
+  return 1;
+}
+
+/* vim:ft=c:expandtab:sw=4:ts=4:sts=4:cinoptions={.5s^-2n-2(0:
+ */
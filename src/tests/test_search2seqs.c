@@ -19,58 +19,243 @@
  *
  */
 
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "safterror.h"
 #include "saftfasta.h"
 #include "saftsearch.h"
 
+
+/* Size of the homopolymers used to check that D2 does not overflow: every
+ * word occurs LARGE_SIZE - k + 1 times, hence D2 is in the order of 10^10 */
+#define LARGE_SIZE 200000
+
+/* Size of the reads masked against a homopolymer of A */
+#define MASKED_SIZE 300
+
+
+static SaftOptions*  test_options_new     (unsigned int  word_size);
+
+static SaftSequence* test_homopolymer_new (const char   *name,
+                                           char          letter,
+                                           size_t        size);
+
+static int           test_large           (unsigned int  word_size);
+
+static SaftSequence* test_masked_read_new (void);
+
+static int           test_masked          (unsigned int  word_size);
+
 int
 main (int    argc,
       char **argv)
 {
-  /*
-  SaftFasta   **seqs;
-  SaftFasta   **tmp;
-  unsigned int  word_size;
-  unsigned int  n;
+  SaftSequence     **seqs;
+  SaftSequence     **tmp;
+  SaftOptions       *options;
+  SaftSearchEngine  *engine;
+  SaftSearch        *search;
+  unsigned int       n;
+  int                ret = 0;
 
+  if (argc == 1)
+    {
+      /* Array-based and hash-based engines */
+      ret |= test_large (7);
+      ret |= test_large (9);
+      ret |= test_masked (7);
+      ret |= test_masked (9);
+      return ret;
+    }
   if (argc < 3)
     {
-      saft_error ("Usage: %s FASTA_FILE WORD_SIZE", argv[0]);
+      saft_error ("Usage: %s [FASTA_FILE WORD_SIZE]", argv[0]);
       return 1;
     }
 
-  seqs = saft_fasta_read (argv[1], &n);
-  word_size = atoi (argv[2]);
-
+  seqs = saft_fasta_read (argv[1], NULL, &n);
   if (n < 2)
     {
       saft_error ("The fasta file must contain at least two sequences");
-      return 1;
+      ret = 1;
     }
   else
     {
-      SaftSequence *s1     = saft_fasta_to_seq (seqs[0], &SaftAlphabetDNA);
-      SaftSequence *s2     = saft_fasta_to_seq (seqs[1], &SaftAlphabetDNA);
-      SaftSearch   *search = saft_search_new (s1, word_size, SAFT_FREQ_UNIFORM, NULL);
+      options = test_options_new (atoi (argv[2]));
+      engine  = saft_search_engine_new (options);
+      search  = saft_search_two_sequences (engine, seqs[0], seqs[1]);
 
-      saft_search_add_subject (search, s2);
-      saft_search_compute_pvalues (search);
-      printf ("D2 = %d ; p-value = %.5e\n", search->results->d2, search->results->p_value);
+      printf ("D2 = %" PRIu64 " ; p-value = %.5e\n",
+              search->results[0].d2,
+              search->results[0].p_value);
 
-      saft_sequence_free (s2);
       saft_search_free (search);
+      saft_search_engine_free (engine);
+      saft_options_free (options);
     }
 
   tmp = seqs - 1;
   while (*++tmp)
-    saft_fasta_free (*tmp);
+    saft_sequence_free (*tmp);
+  free (seqs);
+
+  return ret;
+}
+
+static SaftOptions*
+test_options_new (unsigned int word_size)
+{
+  SaftOptions  *options;
+  unsigned int  i;
+
+  options                     = saft_options_new ();
+  options->program            = SAFTN;
+  options->alphabet           = &SaftAlphabetDNA;
+  options->word_size          = word_size;
+  options->letter_frequencies = malloc (options->alphabet->size * sizeof (*options->letter_frequencies));
+  for (i = 0; i < options->alphabet->size; i++)
+    options->letter_frequencies[i] = 1. / options->alphabet->size;
+
+  return options;
+}
+
+static SaftSequence*
+test_homopolymer_new (const char *name,
+                      char        letter,
+                      size_t      size)
+{
+  SaftSequence *seq;
+
+  seq              = saft_sequence_new ();
+  seq->name        = strdup (name);
+  seq->name_length = strlen (name);
+  seq->name_alloc  = seq->name_length + 1;
+  seq->seq         = malloc (size + 1);
+  seq->seq_length  = size;
+  seq->seq_alloc   = size + 1;
+  memset (seq->seq, letter, size);
+  seq->seq[size]   = '\0';
+
+  return seq;
+}
+
+static int
+test_large (unsigned int word_size)
+{
+  SaftOptions      *options;
+  SaftSearchEngine *engine;
+  SaftSearch       *search;
+  SaftSequence     *query;
+  SaftSequence     *subject;
+  const uint64_t    n_words  = LARGE_SIZE - word_size + 1;
+  const uint64_t    expected = n_words * n_words;
+  uint64_t          d2;
+  double            p_value;
+
+  options = test_options_new (word_size);
+  engine  = saft_search_engine_new (options);
+  query   = test_homopolymer_new ("query", 'A', LARGE_SIZE);
+  subject = test_homopolymer_new ("subject", 'A', LARGE_SIZE);
+  search  = saft_search_two_sequences (engine, query, subject);
+  d2      = search->results[0].d2;
+  p_value = search->results[0].p_value;
+
+  printf ("k = %-3u ; n = m = %d ; D2 = %" PRIu64 " (expected %" PRIu64 ") ; p-value = %.5e : %s\n",
+          word_size, LARGE_SIZE, d2, expected, p_value,
+          d2 == expected ? "OK" : "FAILED");
+
+  saft_search_free (search);
+  saft_sequence_free (query);
+  saft_sequence_free (subject);
+  saft_search_engine_free (engine);
+  saft_options_free (options);
+
+  return d2 != expected;
+}
+
+/* A FASTQ read of A whose bases all have the lowest quality, read back with
+ * the bases below quality 20 masked */
+static SaftSequence*
+test_masked_read_new (void)
+{
+  SaftSequence     **seqs;
+  SaftSequence      *read    = NULL;
+  SaftFastaOptions   options = {1, 20};
+  char               path[]  = "/tmp/test_search2seqsXXXXXX";
+  char               bases[MASKED_SIZE + 1];
+  char               quality[MASKED_SIZE + 1];
+  FILE              *stream;
+  unsigned int       n;
+  int                fd;
+
+  if ((fd = mkstemp (path)) == -1)
+    return NULL;
+  memset (bases, 'A', MASKED_SIZE);
+  memset (quality, '!', MASKED_SIZE);
+  bases[MASKED_SIZE]   = '\0';
+  quality[MASKED_SIZE] = '\0';
+  stream = fdopen (fd, "w");
+  fprintf (stream, "@masked\n%s\n+\n%s\n", bases, quality);
+  fclose (stream);
+
+  seqs = saft_fasta_read (path, &options, &n);
+  unlink (path);
+  if (n == 1)
+    read = seqs[0];
   free (seqs);
-  */
 
-  return 0;
+  return read;
+}
+
+/**
+ * The masked bases, like the unknown ones, are no A: a masked read, and a
+ * read of A with an N every k - 1 bases, share no word with a homopolymer of
+ * A
+ */
+static int
+test_masked (unsigned int word_size)
+{
+  SaftOptions      *options;
+  SaftSearchEngine *engine;
+  SaftSearch       *search;
+  SaftSequence     *queries[2];
+  SaftSequence     *subject;
+  unsigned int      i;
+  int               ret = 0;
+
+  if (!(queries[0] = test_masked_read_new ()))
+    {
+      saft_error ("Could not read the masked read");
+      return 1;
+    }
+  queries[1] = test_homopolymer_new ("unknown", 'A', MASKED_SIZE);
+  for (i = word_size - 1; i < MASKED_SIZE; i += word_size)
+    queries[1]->seq[i] = 'N';
+  options    = test_options_new (word_size);
+  engine     = saft_search_engine_new (options);
+  subject    = test_homopolymer_new ("subject", 'A', MASKED_SIZE);
+  for (i = 0; i < 2; i++)
+    {
+      uint64_t d2;
+
+      search = saft_search_two_sequences (engine, queries[i], subject);
+      d2     = search->results[0].d2;
+      printf ("k = %-3u ; %s read ; D2 = %" PRIu64 " (expected 0) : %s\n",
+              word_size, queries[i]->name, d2, d2 == 0 ? "OK" : "FAILED");
+      ret |= d2 != 0;
+      saft_search_free (search);
+      saft_sequence_free (queries[i]);
+    }
+
+  saft_sequence_free (subject);
+  saft_search_engine_free (engine);
+  saft_options_free (options);
+
+  return ret;
 }
 
 /* vim:ft=c:expandtab:sw=4:ts=4:sts=4:cinoptions={.5s^-2n-2(0:
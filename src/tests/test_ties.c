@@ -0,0 +1,346 @@
+/* test_ties.c
+ * Copyright (C) 2008  Sylvain FORET
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *                                                                       
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *                                                                       
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Checks that every way of searching a database keeps the same hits when
+ * they are tied: the database holds copies of some of its sequences, which
+ * are searched for with a single hit kept per query. The copies sort before
+ * the sequences they copy, so that the ties are not broken by name.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "saftfastaindex.h"
+#include "saftresults.h"
+#include "saftsearch.h"
+#include "saftsearchengines.h"
+
+#define TIES_N_SEQS   40
+#define TIES_SEQ_SIZE 200
+#define TIES_N_SHARDS 3
+
+
+typedef struct _TestMode TestMode;
+
+struct _TestMode
+{
+  const char   *name;
+  unsigned int  cache_db      : 1;
+  unsigned int  cache_queries : 1;
+  unsigned int  n_threads;
+};
+
+static const TestMode test_modes[] =
+{
+  {"cached database",             1, 0, 1},
+  {"cached database, 3 threads",  1, 0, 3},
+  {"cached queries",              0, 1, 1},
+  {"cached queries, 3 threads",   0, 1, 3},
+  {"not cached, 3 threads",       0, 0, 3}
+};
+
+
+typedef struct _TestPartial TestPartial;
+
+struct _TestPartial
+{
+  FILE   *stream;
+  size_t  first_subject;
+  size_t  subject_step;
+};
+
+
+static int          test_files_new     (char           *db_path,
+                                        char           *query_path);
+
+static SaftOptions* test_options_new   (const char     *query_path,
+                                        const char     *db_path,
+                                        unsigned int    word_size);
+
+static char*        test_search        (const char     *query_path,
+                                        const char     *db_path,
+                                        unsigned int    word_size,
+                                        const TestMode *mode);
+
+static char*        test_search_shards (const char     *query_path,
+                                        const char     *db_path,
+                                        unsigned int    word_size);
+
+static void         test_write_partial (SaftSearch     *search,
+                                        void           *data);
+
+int
+main (int    argc,
+      char **argv)
+{
+  char            db_path[]    = "/tmp/test_ties_dbXXXXXX";
+  char            query_path[] = "/tmp/test_ties_queryXXXXXX";
+  char           *index_path;
+  unsigned int    word_sizes[] = {5, 9};
+  unsigned int    i;
+  unsigned int    j;
+  int             ret = 0;
+
+  if (test_files_new (db_path, query_path))
+    return 1;
+
+  /* Both DNA engines */
+  for (i = 0; i < sizeof (word_sizes) / sizeof (*word_sizes); i++)
+    {
+      const TestMode  plain    = {"not cached", 0, 0, 1};
+      char           *expected = test_search (query_path, db_path, word_sizes[i], &plain);
+      char           *output;
+      int             ok;
+
+      for (j = 0; j < sizeof (test_modes) / sizeof (*test_modes); j++)
+        {
+          char *output = test_search (query_path, db_path, word_sizes[i], test_modes + j);
+          int   ok     = !strcmp (expected, output);
+
+          printf ("k = %u ; %s : %s\n", word_sizes[i], test_modes[j].name, ok ? "OK" : "FAILED");
+          ret |= !ok;
+          free (output);
+        }
+
+      /* Every third sequence in a shard, then runs of the indexed file */
+      for (j = 0; j < 2; j++)
+        {
+          if (j == 1)
+            {
+              SaftFastaIndex *index = saft_fasta_index_build (db_path);
+
+              saft_fasta_index_write (index);
+              saft_fasta_index_free (index);
+            }
+          output = test_search_shards (query_path, db_path, word_sizes[i]);
+          ok     = output && !strcmp (expected, output);
+          printf ("k = %u ; %u merged shards%s : %s\n", word_sizes[i], TIES_N_SHARDS,
+                  j == 1 ? ", indexed" : "", ok ? "OK" : "FAILED");
+          ret |= !ok;
+          free (output);
+        }
+      index_path = malloc (strlen (db_path) + sizeof (SAFT_FASTA_INDEX_SUFFIX));
+      sprintf (index_path, "%s%s", db_path, SAFT_FASTA_INDEX_SUFFIX);
+      unlink (index_path);
+      free (index_path);
+      free (expected);
+    }
+
+  unlink (db_path);
+  unlink (query_path);
+
+  return ret;
+}
+
+/* Every third sequence of the database is followed by a copy, and every
+ * sequence that has a copy is a query */
+static int
+test_files_new (char *db_path,
+                char *query_path)
+{
+  FILE         *db;
+  FILE         *queries;
+  char          seq[TIES_SEQ_SIZE + 1];
+  unsigned int  i;
+  int           fd_db;
+  int           fd_query;
+
+  if ((fd_db = mkstemp (db_path)) == -1)
+    return 1;
+  if ((fd_query = mkstemp (query_path)) == -1)
+    {
+      unlink (db_path);
+      return 1;
+    }
+  db      = fdopen (fd_db, "w");
+  queries = fdopen (fd_query, "w");
+
+  srand (1);
+  seq[TIES_SEQ_SIZE] = '\0';
+  for (i = 0; i < TIES_N_SEQS; i++)
+    {
+      unsigned int j;
+
+      for (j = 0; j < TIES_SEQ_SIZE; j++)
+        seq[j] = "ACGT"[rand () % 4];
+      fprintf (db, ">seq%u\n%s\n", i, seq);
+      if (i % 3 == 0)
+        {
+          fprintf (db, ">copy%u\n%s\n", i, seq);
+          fprintf (queries, ">query%u\n%s\n", i, seq);
+        }
+    }
+  fclose (db);
+  fclose (queries);
+
+  return 0;
+}
+
+static SaftOptions*
+test_options_new (const char   *query_path,
+                  const char   *db_path,
+                  unsigned int  word_size)
+{
+  SaftOptions  *options;
+  unsigned int  i;
+
+  options                     = saft_options_new ();
+  options->program            = SAFTN;
+  options->alphabet           = &SaftAlphabetDNA;
+  options->input_path         = strdup (query_path);
+  options->db_path            = strdup (db_path);
+  options->word_size          = word_size;
+  options->p_max              = 1;
+  options->max_results        = 1;
+  options->letter_frequencies = malloc (options->alphabet->size * sizeof (*options->letter_frequencies));
+  for (i = 0; i < options->alphabet->size; i++)
+    options->letter_frequencies[i] = 1. / options->alphabet->size;
+
+  return options;
+}
+
+/* Returns the results written as by saft */
+static char*
+test_search (const char     *query_path,
+             const char     *db_path,
+             unsigned int    word_size,
+             const TestMode *mode)
+{
+  SaftOptions      *options;
+  SaftSearchEngine *engine;
+  SaftSearch       *searches;
+  SaftSearch       *search;
+  FILE             *stream;
+  char             *output;
+  size_t            size;
+
+  options                = test_options_new (query_path, db_path, word_size);
+  options->cache_db      = mode->cache_db;
+  options->cache_queries = mode->cache_queries;
+  options->n_threads     = mode->n_threads;
+
+  engine   = saft_search_engine_new (options);
+  searches = saft_search_all (engine, query_path, db_path);
+
+  stream = open_memstream (&output, &size);
+  for (search = searches; search; search = search->next)
+    saft_results_write (stream, options, search);
+  fclose (stream);
+
+  saft_search_free_all (searches);
+  saft_search_engine_free (engine);
+  saft_options_free (options);
+
+  return output;
+}
+
+/* Returns the results written as by saft-merge from the partial results of
+ * every shard, or NULL if they could not be read back */
+static char*
+test_search_shards (const char   *query_path,
+                    const char   *db_path,
+                    unsigned int  word_size)
+{
+  SaftSearch   *merged = NULL;
+  SaftSearch   *search;
+  FILE         *stream;
+  char         *output;
+  size_t        size;
+  unsigned int  shard;
+
+  for (shard = 0; shard < TIES_N_SHARDS; shard++)
+    {
+      SaftOptions      *options;
+      SaftSearchEngine *engine;
+      SaftSearch       *searches;
+      SaftSearch       *other;
+      TestPartial       partial;
+      char              partial_path[] = "/tmp/test_ties_partialXXXXXX";
+      int               error;
+
+      options           = test_options_new (query_path, db_path, word_size);
+      options->shard    = shard;
+      options->n_shards = TIES_N_SHARDS;
+      partial.stream    = fdopen (mkstemp (partial_path), "w");
+      saft_search_engine_db_ranks (options, db_path, &partial.first_subject, &partial.subject_step);
+      saft_results_write_partial_header (partial.stream, options);
+
+      engine                   = saft_search_engine_new (options);
+      engine->search_done      = test_write_partial;
+      engine->search_done_data = &partial;
+      saft_search_all (engine, query_path, db_path);
+      saft_search_engine_free (engine);
+      fclose (partial.stream);
+
+      searches = saft_results_read_partial (partial_path, options, &error);
+      unlink (partial_path);
+      saft_options_free (options);
+      if (error)
+        {
+          saft_search_free_all (merged);
+          return NULL;
+        }
+
+      if (!merged)
+        {
+          merged = searches;
+          continue;
+        }
+      for (search = merged, other = searches; search && other; search = search->next)
+        {
+          SaftSearch *next = other->next;
+
+          saft_search_merge (search, other);
+          other = next;
+        }
+    }
+
+  stream = open_memstream (&output, &size);
+  for (search = merged; search; search = search->next)
+    if (search->n_results > 0)
+      {
+        SaftOptions *options = test_options_new (query_path, db_path, word_size);
+
+        saft_results_write (stream, options, search);
+        saft_options_free (options);
+      }
+  fclose (stream);
+  saft_search_free_all (merged);
+
+  return output;
+}
+
+static void
+test_write_partial (SaftSearch *search,
+                    void       *data)
+{
+  TestPartial *partial = data;
+
+  saft_results_write_partial (partial->stream,
+                              search->name,
+                              search->n_tests,
+                              search,
+                              partial->first_subject,
+                              partial->subject_step);
+}
+
+/* vim:ft=c:expandtab:sw=4:ts=4:sts=4:cinoptions={.5s^-2n-2(0:
+ */